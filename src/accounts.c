@@ -0,0 +1,566 @@
+// Account table of gauthenticatord
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "accounts.h"
+#include "util.h"
+
+#define DEFAULT_PERIOD 30
+#define DEFAULT_DIGITS 6
+#define MAX_PERIOD     86400
+
+#define TRIE_BITS   4
+#define TRIE_FANOUT (1 << TRIE_BITS)
+#define TRIE_LEVELS (32 / TRIE_BITS)
+
+// A node is a branch or a leaf. A leaf holds the accounts of one hash,
+// normally one, and sits as high up as the other hashes allow: a branch
+// is only made where two hashes share the bits above it.
+typedef struct trie_node {
+  EPOCH_ENTRY retire;
+  int leaf;
+} TRIE_NODE;
+
+typedef struct trie_branch {
+  TRIE_NODE node;
+  TRIE_NODE *child[TRIE_FANOUT];
+} TRIE_BRANCH;
+
+typedef struct trie_leaf {
+  TRIE_NODE node;
+  uint32_t hash;
+  int count;
+  ACCOUNT *account[];
+} TRIE_LEAF;
+
+// The nodes one change makes and the ones it replaces: at most a branch
+// per level and a leaf.
+typedef struct trie_edit {
+  TRIE_NODE *made[TRIE_LEVELS + 1];
+  int made_count;
+  TRIE_NODE *replaced[TRIE_LEVELS + 1];
+  int replaced_count;
+} TRIE_EDIT;
+
+struct accounts {
+  _Atomic(TRIE_NODE *) root;
+  _Atomic int count;
+  EPOCH *epoch;
+  pthread_mutex_t lock;         // taken by writers only
+  uint32_t next_id;
+};
+
+static uint32_t accounts_hash(const char *name, size_t length) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= (uint8_t)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int parse_int(const char *text, int min, int max, int *value) {
+  char *end;
+  errno = 0;
+  long number = strtol(text, &end, 10);
+  if (errno || *end || number < min || number > max) {
+    return -1;
+  }
+  *value = (int)number;
+  return 0;
+}
+
+void account_hold(ACCOUNT *account) {
+  atomic_fetch_add_explicit(&account->refs, 1, memory_order_relaxed);
+}
+
+void account_release(ACCOUNT *account) {
+  if (atomic_fetch_sub_explicit(&account->refs, 1,
+                                memory_order_acq_rel) == 1) {
+    gauth_key_clear(&account->key);
+    free(account->name);
+    free(account);
+  }
+}
+
+// Drops the table's reference once a removed account is out of sight.
+static void account_retired(EPOCH_ENTRY *entry) {
+  account_release((ACCOUNT *)((char *)entry - offsetof(ACCOUNT, retire)));
+}
+
+static void trie_node_retired(EPOCH_ENTRY *entry) {
+  free(entry);
+}
+
+static unsigned trie_index(uint32_t hash, int level) {
+  return hash >> (32 - TRIE_BITS * (level + 1)) & (TRIE_FANOUT - 1);
+}
+
+static void *trie_make(TRIE_EDIT *edit, size_t size, int leaf) {
+  TRIE_NODE *node = malloc(size);
+  if (node) {
+    node->retire.release = trie_node_retired;
+    node->leaf = leaf;
+    edit->made[edit->made_count++] = node;
+  }
+  return node;
+}
+
+static void trie_replace(TRIE_EDIT *edit, TRIE_NODE *node) {
+  edit->replaced[edit->replaced_count++] = node;
+}
+
+static int trie_leaf_find(const TRIE_LEAF *leaf,
+                          const char *name, size_t length) {
+  for (int i = 0; i < leaf->count; ++i) {
+    const char *other = leaf->account[i]->name;
+    if (strnlen(other, length + 1) == length &&
+        !memcmp(other, name, length)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static ACCOUNT *trie_find(const TRIE_NODE *node, uint32_t hash,
+                          const char *name, size_t length) {
+  for (int level = 0; node && !node->leaf; ++level) {
+    node = ((const TRIE_BRANCH *)node)->child[trie_index(hash, level)];
+  }
+  const TRIE_LEAF *leaf = (const TRIE_LEAF *)node;
+  if (!leaf || leaf->hash != hash) {
+    return NULL;
+  }
+  int at = trie_leaf_find(leaf, name, length);
+  return at < 0 ? NULL : leaf->account[at];
+}
+
+// A copy of "leaf", which may be NULL, with "account" added.
+static TRIE_NODE *trie_leaf_add(TRIE_EDIT *edit, const TRIE_LEAF *leaf,
+                                ACCOUNT *account) {
+  int count = leaf ? leaf->count : 0;
+  TRIE_LEAF *copy = trie_make(edit, sizeof(TRIE_LEAF) +
+                              (count + 1) * sizeof(ACCOUNT *), 1);
+  if (!copy) {
+    return NULL;
+  }
+  copy->hash = account->hash;
+  copy->count = count + 1;
+  for (int i = 0; i < count; ++i) {
+    copy->account[i] = leaf->account[i];
+  }
+  copy->account[count] = account;
+  return &copy->node;
+}
+
+// "node", at "level", with "account" added. NULL when out of memory.
+static TRIE_NODE *trie_insert(TRIE_EDIT *edit, TRIE_NODE *node, int level,
+                              ACCOUNT *account) {
+  TRIE_BRANCH *branch;
+
+  if (!node) {
+    return trie_leaf_add(edit, NULL, account);
+  }
+  if (node->leaf) {
+    TRIE_LEAF *leaf = (TRIE_LEAF *)node;
+    if (leaf->hash == account->hash) {
+      trie_replace(edit, node);
+      return trie_leaf_add(edit, leaf, account);
+    }
+    // The leaf moves one level down, as it is, next to the new account.
+    branch = trie_make(edit, sizeof(TRIE_BRANCH), 0);
+    if (!branch) {
+      return NULL;
+    }
+    memset(branch->child, 0, sizeof(branch->child));
+    branch->child[trie_index(leaf->hash, level)] = node;
+  } else {
+    branch = trie_make(edit, sizeof(TRIE_BRANCH), 0);
+    if (!branch) {
+      return NULL;
+    }
+    memcpy(branch->child, ((TRIE_BRANCH *)node)->child,
+           sizeof(branch->child));
+    trie_replace(edit, node);
+  }
+
+  TRIE_NODE **slot = &branch->child[trie_index(account->hash, level)];
+  *slot = trie_insert(edit, *slot, level + 1, account);
+  return *slot ? &branch->node : NULL;
+}
+
+// Sets *result to "node", at "level", without the account called name;
+// NULL if nothing is left. Returns 0, or -1 and sets errno.
+static int trie_delete(TRIE_EDIT *edit, TRIE_NODE *node, int level,
+                       uint32_t hash, const char *name, size_t length,
+                       TRIE_NODE **result, ACCOUNT **removed) {
+  if (!node) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  if (node->leaf) {
+    TRIE_LEAF *leaf = (TRIE_LEAF *)node;
+    int at = leaf->hash == hash ? trie_leaf_find(leaf, name, length) : -1;
+    if (at < 0) {
+      errno = ENOENT;
+      return -1;
+    }
+    *removed = leaf->account[at];
+    *result = NULL;
+    trie_replace(edit, node);
+    if (leaf->count == 1) {
+      return 0;
+    }
+    TRIE_LEAF *copy = trie_make(edit, sizeof(TRIE_LEAF) +
+                                (leaf->count - 1) * sizeof(ACCOUNT *), 1);
+    if (!copy) {
+      errno = ENOMEM;
+      return -1;
+    }
+    copy->hash = hash;
+    copy->count = 0;
+    for (int i = 0; i < leaf->count; ++i) {
+      if (i != at) {
+        copy->account[copy->count++] = leaf->account[i];
+      }
+    }
+    *result = &copy->node;
+    return 0;
+  }
+
+  TRIE_BRANCH *branch = (TRIE_BRANCH *)node;
+  unsigned index = trie_index(hash, level);
+  TRIE_NODE *child;
+  if (trie_delete(edit, branch->child[index], level + 1, hash, name, length,
+                  &child, removed)) {
+    return -1;
+  }
+  trie_replace(edit, node);
+
+  // A branch left with a single leaf gives way to it.
+  int children = 0;
+  TRIE_NODE *last = NULL;
+  for (unsigned i = 0; i < TRIE_FANOUT; ++i) {
+    TRIE_NODE *c = i == index ? child : branch->child[i];
+    if (c) {
+      ++children;
+      last = c;
+    }
+  }
+  if (children == 0 || (children == 1 && last->leaf)) {
+    *result = last;
+    return 0;
+  }
+  TRIE_BRANCH *copy = trie_make(edit, sizeof(TRIE_BRANCH), 0);
+  if (!copy) {
+    errno = ENOMEM;
+    return -1;
+  }
+  memcpy(copy->child, branch->child, sizeof(copy->child));
+  copy->child[index] = child;
+  *result = &copy->node;
+  return 0;
+}
+
+// Frees what a failed change made. Nothing was published.
+static void trie_abort(TRIE_EDIT *edit) {
+  for (int i = 0; i < edit->made_count; ++i) {
+    free(edit->made[i]);
+  }
+}
+
+static void trie_commit(ACCOUNTS *accounts, TRIE_EDIT *edit,
+                        TRIE_NODE *root) {
+  atomic_store_explicit(&accounts->root, root, memory_order_release);
+  for (int i = 0; i < edit->replaced_count; ++i) {
+    epoch_retire(accounts->epoch, &edit->replaced[i]->retire);
+  }
+}
+
+static void trie_free(TRIE_NODE *node) {
+  if (!node) {
+    return;
+  }
+  if (node->leaf) {
+    TRIE_LEAF *leaf = (TRIE_LEAF *)node;
+    for (int i = 0; i < leaf->count; ++i) {
+      account_release(leaf->account[i]);
+    }
+  } else {
+    for (int i = 0; i < TRIE_FANOUT; ++i) {
+      trie_free(((TRIE_BRANCH *)node)->child[i]);
+    }
+  }
+  free(node);
+}
+
+// Adds the accounts under "node", whose hashes start with "prefix", from
+// the hash *cursor on. Returns 0 once "out" is full.
+static int trie_scan(const TRIE_NODE *node, int level, uint32_t prefix,
+                     uint64_t *cursor, ACCOUNT **out, int max, int *count) {
+  if (node->leaf) {
+    const TRIE_LEAF *leaf = (const TRIE_LEAF *)node;
+    if (leaf->hash < *cursor) {
+      return 1;
+    }
+    if (*count && *count + leaf->count > max) {
+      *cursor = leaf->hash;
+      return 0;
+    }
+    for (int i = 0; i < leaf->count && *count < max; ++i) {
+      out[(*count)++] = leaf->account[i];
+    }
+    *cursor = (uint64_t)leaf->hash + 1;
+    return *count < max;
+  }
+
+  const TRIE_BRANCH *branch = (const TRIE_BRANCH *)node;
+  int shift = 32 - TRIE_BITS * (level + 1);
+  for (unsigned i = 0; i < TRIE_FANOUT; ++i) {
+    uint32_t first = prefix | (uint32_t)i << shift;
+    uint64_t last = first + ((uint64_t)1 << shift) - 1;
+    if (branch->child[i] && last >= *cursor &&
+        !trie_scan(branch->child[i], level + 1, first, cursor, out, max,
+                   count)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int valid_name(const char *name, size_t length) {
+  if (length == 0 || length > ACCOUNT_MAX_NAME || name[0] == '#') {
+    return 0;
+  }
+  for (size_t i = 0; i < length; ++i) {
+    if ((uint8_t)name[i] <= ' ' || name[i] == 0x7F) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int accounts_add(ACCOUNTS *accounts, const char *name, size_t length,
+                 const char *base32_secret, int period, int digits) {
+  if (!valid_name(name, length) ||
+      (period != ACCOUNT_HOTP && (period < 1 || period > MAX_PERIOD)) ||
+      digits < GAUTH_MIN_DIGITS || digits > GAUTH_MAX_DIGITS) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  ACCOUNT *account = calloc(1, sizeof(ACCOUNT));
+  if (!account) {
+    errno = ENOMEM;
+    return -1;
+  }
+  if (gauth_key_init(&account->key, base32_secret)) {
+    free(account);
+    errno = EINVAL;
+    return -1;
+  }
+  account->name = strndup(name, length);
+  if (!account->name) {
+    gauth_key_clear(&account->key);
+    free(account);
+    errno = ENOMEM;
+    return -1;
+  }
+  account->hash = accounts_hash(name, length);
+  account->period = period;
+  account->digits = digits;
+  account->retire.release = account_retired;
+  atomic_init(&account->refs, 1);
+
+  TRIE_EDIT edit = { .made_count = 0, .replaced_count = 0 };
+  int error = 0;
+  pthread_mutex_lock(&accounts->lock);
+  TRIE_NODE *root = atomic_load_explicit(&accounts->root,
+                                         memory_order_relaxed);
+  if (trie_find(root, account->hash, name, length)) {
+    error = EEXIST;
+  } else if (!(root = trie_insert(&edit, root, 0, account))) {
+    trie_abort(&edit);
+    error = ENOMEM;
+  } else {
+    account->id = accounts->next_id++;
+    trie_commit(accounts, &edit, root);
+    atomic_fetch_add_explicit(&accounts->count, 1, memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&accounts->lock);
+
+  if (error) {
+    account_release(account);
+    errno = error;
+    return -1;
+  }
+  if (accounts->epoch) {
+    epoch_reclaim(accounts->epoch);
+  }
+  return 0;
+}
+
+int accounts_remove(ACCOUNTS *accounts, const char *name, size_t length) {
+  uint32_t hash = accounts_hash(name, length);
+  TRIE_EDIT edit = { .made_count = 0, .replaced_count = 0 };
+  ACCOUNT *removed = NULL;
+  TRIE_NODE *root;
+  int error = 0;
+
+  pthread_mutex_lock(&accounts->lock);
+  if (trie_delete(&edit, atomic_load_explicit(&accounts->root,
+                                              memory_order_relaxed),
+                  0, hash, name, length, &root, &removed)) {
+    error = errno;
+    trie_abort(&edit);
+  } else {
+    trie_commit(accounts, &edit, root);
+    atomic_fetch_sub_explicit(&accounts->count, 1, memory_order_relaxed);
+    atomic_store_explicit(&removed->removed, 1, memory_order_relaxed);
+    epoch_retire(accounts->epoch, &removed->retire);
+  }
+  pthread_mutex_unlock(&accounts->lock);
+
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  if (accounts->epoch) {
+    epoch_reclaim(accounts->epoch);
+  }
+  return 0;
+}
+
+static int accounts_add_fields(ACCOUNTS *accounts, char *fields[], int n) {
+  int period = DEFAULT_PERIOD;
+  int digits = DEFAULT_DIGITS;
+
+  if (n > 2 && strcmp(fields[2], "hotp") == 0) {
+    period = ACCOUNT_HOTP;
+  } else if (n > 2 && parse_int(fields[2], 1, MAX_PERIOD, &period)) {
+    return -1;
+  }
+  if (n < 2 || n > 4 ||
+      (n > 3 && parse_int(fields[3], GAUTH_MIN_DIGITS, GAUTH_MAX_DIGITS,
+                          &digits))) {
+    return -1;
+  }
+  return accounts_add(accounts, fields[0], strlen(fields[0]), fields[1],
+                      period, digits);
+}
+
+ACCOUNTS *accounts_load(const char *path, EPOCH *epoch, int *line) {
+  *line = 0;
+
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return NULL;
+  }
+
+  ACCOUNTS *accounts = calloc(1, sizeof(ACCOUNTS));
+  if (!accounts || pthread_mutex_init(&accounts->lock, NULL)) {
+    free(accounts);
+    fclose(file);
+    return NULL;
+  }
+  atomic_init(&accounts->root, NULL);
+  atomic_init(&accounts->count, 0);
+
+  // Nobody reads the table yet: replaced nodes go right away.
+  accounts->epoch = NULL;
+
+  char *buf = NULL;
+  size_t buf_len = 0;
+  int number = 0;
+  int error_line = 0;
+  while (getline(&buf, &buf_len, file) >= 0) {
+    ++number;
+
+    char *fields[5];
+    char *save;
+    int n = 0;
+    for (char *field = strtok_r(buf, " \t\r\n", &save);
+         field && n < 5; field = strtok_r(NULL, " \t\r\n", &save)) {
+      fields[n++] = field;
+    }
+    if (n == 0 || *fields[0] == '#') {
+      continue;
+    }
+    if (accounts_add_fields(accounts, fields, n)) {
+      error_line = number;
+      break;
+    }
+  }
+  int read_error = !error_line && ferror(file);
+
+  if (buf) {
+    explicit_bzero(buf, buf_len);
+    free(buf);
+  }
+  fclose(file);
+
+  if (error_line || read_error) {
+    accounts_free(accounts);
+    *line = error_line;
+    errno = EIO;
+    return NULL;
+  }
+  accounts->epoch = epoch;
+  return accounts;
+}
+
+void accounts_free(ACCOUNTS *accounts) {
+  if (!accounts) {
+    return;
+  }
+  trie_free(atomic_load(&accounts->root));
+  pthread_mutex_destroy(&accounts->lock);
+  free(accounts);
+}
+
+int accounts_count(const ACCOUNTS *accounts) {
+  return atomic_load_explicit(&accounts->count, memory_order_relaxed);
+}
+
+ACCOUNT *accounts_find(const ACCOUNTS *accounts,
+                       const char *name, size_t length) {
+  return trie_find(atomic_load_explicit(&accounts->root,
+                                        memory_order_acquire),
+                   accounts_hash(name, length), name, length);
+}
+
+int accounts_scan(const ACCOUNTS *accounts, uint64_t *cursor,
+                  ACCOUNT **out, int max) {
+  const TRIE_NODE *root = atomic_load_explicit(&accounts->root,
+                                               memory_order_acquire);
+  int count = 0;
+
+  if (*cursor >= ACCOUNTS_SCAN_END || max <= 0) {
+    return 0;
+  }
+  if (!root || trie_scan(root, 0, 0, cursor, out, max, &count)) {
+    *cursor = ACCOUNTS_SCAN_END;
+  }
+  return count;
+}
@@ -0,0 +1,106 @@
+// Account table of gauthenticatord
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// The accounts file has one account per line:
+//
+//   name  base32-secret  [period  [digits]]
+//
+// Fields are separated by white-space, so names cannot contain any. A
+// period of "hotp" makes a counter-based (HOTP) account, see hotp.h. Empty
+// lines and lines starting with '#' are ignored. Secrets are turned into
+// their HMAC key states while loading and never kept in Base32 form.
+//
+// The table is a radix trie on the hash of the names, four bits per level.
+// Published nodes are never changed: adding or removing an account
+// copies the nodes on the path to it, a handful however large the table
+// is, and swaps in the new root. Readers follow whichever root they find
+// without a lock, from inside an epoch critical section (see epoch.h);
+// replaced nodes and removed accounts are freed once no reader can see
+// them. Writers take turns on a mutex.
+
+#ifndef _ACCOUNTS_H_
+#define _ACCOUNTS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "epoch.h"
+#include "gauth.h"
+#include "steptable.h"
+
+#define ACCOUNT_MAX_NAME 255
+
+// Period of counter-based (HOTP) accounts
+#define ACCOUNT_HOTP 0
+
+// accounts_scan() cursor once all accounts were seen
+#define ACCOUNTS_SCAN_END ((uint64_t)1 << 32)
+
+typedef struct account {
+  uint32_t id;          // unique for the life of the table
+  char *name;
+  uint32_t hash;
+  GAUTH_KEY key;
+  int period;           // or ACCOUNT_HOTP
+  int digits;
+  _Atomic int refs;     // the table's and one per holder
+  _Atomic int removed;
+  _Atomic int32_t drift; // step offset estimate, see drift.h
+  _Atomic uint64_t counter; // next HOTP counter, see hotp.h
+  _Atomic int journaled;    // waiting in the counter journal, see journal.h
+  struct account *journal_next;
+  EPOCH_ENTRY retire;
+  STEP_CODES codes;
+} ACCOUNT;
+
+typedef struct accounts ACCOUNTS;
+
+// Reads an accounts file. On error returns NULL and sets *line to the
+// number of the offending line, or to 0 if the file could not be read (see
+// errno). Readers of the table use "epoch", which may be NULL if the
+// table is only used by one thread.
+ACCOUNTS *accounts_load(const char *path, EPOCH *epoch, int *line);
+
+// Wipes all keys. Accounts still held are freed by their last holder.
+void accounts_free(ACCOUNTS *accounts);
+
+// Adds an account, counter-based if "period" is ACCOUNT_HOTP. Returns 0, or
+// -1 and sets errno to EEXIST if the name is taken, EINVAL if a field is
+// not valid or ENOMEM.
+int accounts_add(ACCOUNTS *accounts, const char *name, size_t length,
+                 const char *base32_secret, int period, int digits);
+
+// Removes an account. Returns 0, or -1 and sets errno to ENOENT or ENOMEM.
+int accounts_remove(ACCOUNTS *accounts, const char *name, size_t length);
+
+int accounts_count(const ACCOUNTS *accounts);
+
+// The account called name (not NUL-terminated), or NULL. Only valid until
+// the reader leaves its critical section.
+ACCOUNT *accounts_find(const ACCOUNTS *accounts,
+                       const char *name, size_t length);
+
+// Stores up to "max" accounts in the order of their hashes, starting at
+// the hash *cursor, and moves the cursor past them. The cursor starts at 0
+// and is ACCOUNTS_SCAN_END once all accounts were seen. Accounts with the
+// same hash come in one call, unless there are more than "max" of them.
+int accounts_scan(const ACCOUNTS *accounts, uint64_t *cursor,
+                  ACCOUNT **out, int max);
+
+// Keeps an account from being freed after it is removed, until
+// account_release().
+void account_hold(ACCOUNT *account);
+void account_release(ACCOUNT *account);
+
+#endif /* _ACCOUNTS_H_ */
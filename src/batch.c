@@ -0,0 +1,385 @@
+// Multi-threaded batch code generation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Each worker owns a range of item indexes, packed as (begin << 32 | end)
+// into one atomic word. The owner takes chunks from the front and thieves
+// cut off the back half, both with a compare-and-swap on the same word, so
+// every item is handed out exactly once without any lock.
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "batch.h"
+
+// Jobs handed to hmac_sha1_counter_codes() at once; a multiple of every
+// multi-buffer lane count.
+#define BATCH_JOBS 256
+
+// Items a worker takes from its own range at a time
+#define BATCH_CHUNK_CODES 256
+#define BATCH_CHUNK_KEYS  16
+
+typedef struct {
+  _Alignas(64) _Atomic uint64_t range;
+} BATCH_SLOT;
+
+typedef struct batch_run {
+  void (*work)(const struct batch_run *run, uint32_t begin, uint32_t end);
+  uint32_t chunk;
+  const HMAC_SHA1_KEY *keys;
+  uint64_t step;
+  int steps;
+  int window;
+  int digits;
+  const int *expected;
+  int *out;
+} BATCH_RUN;
+
+struct batch_pool {
+  int threads;
+  pthread_t *workers;
+  BATCH_SLOT *slots;
+
+  pthread_mutex_t run_lock;     // one run at a time
+
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  const BATCH_RUN *run;
+  unsigned long generation;
+  int busy;
+  int quit;
+};
+
+typedef struct {
+  BATCH_POOL *pool;
+  int index;
+} BATCH_WORKER;
+
+static inline uint64_t batch_pack(uint32_t begin, uint32_t end) {
+  return (uint64_t)begin << 32 | end;
+}
+
+static inline uint32_t batch_begin(uint64_t range) {
+  return (uint32_t)(range >> 32);
+}
+
+static inline uint32_t batch_end(uint64_t range) {
+  return (uint32_t)range;
+}
+
+// Takes up to "chunk" items from the front of our own range.
+static int batch_take(BATCH_SLOT *slot, uint32_t chunk,
+                      uint32_t *begin, uint32_t *end) {
+  uint64_t range = atomic_load_explicit(&slot->range, memory_order_acquire);
+  for (;;) {
+    uint32_t b = batch_begin(range);
+    uint32_t e = batch_end(range);
+    if (b >= e) {
+      return 0;
+    }
+    uint32_t n = e - b < chunk ? e - b : chunk;
+    if (atomic_compare_exchange_weak_explicit(&slot->range, &range,
+                                              batch_pack(b + n, e),
+                                              memory_order_acq_rel,
+                                              memory_order_acquire)) {
+      *begin = b;
+      *end = b + n;
+      return 1;
+    }
+  }
+}
+
+// Cuts the back half off the first other range that still has more than
+// one chunk left, and makes it our own.
+static int batch_steal(BATCH_POOL *pool, int self, uint32_t chunk) {
+  for (int i = 1; i < pool->threads; ++i) {
+    BATCH_SLOT *victim = &pool->slots[(self + i) % pool->threads];
+    uint64_t range = atomic_load_explicit(&victim->range, memory_order_acquire);
+    for (;;) {
+      uint32_t b = batch_begin(range);
+      uint32_t e = batch_end(range);
+      if (e - b <= chunk || b >= e) {
+        break;
+      }
+      uint32_t mid = b + (e - b) / 2;
+      if (atomic_compare_exchange_weak_explicit(&victim->range, &range,
+                                                batch_pack(b, mid),
+                                                memory_order_acq_rel,
+                                                memory_order_acquire)) {
+        // Our own range is empty, so nobody else writes it right now
+        atomic_store_explicit(&pool->slots[self].range, batch_pack(mid, e),
+                              memory_order_release);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+static void batch_work(BATCH_POOL *pool, int self, const BATCH_RUN *run) {
+  uint32_t begin, end;
+
+  for (;;) {
+    while (batch_take(&pool->slots[self], run->chunk, &begin, &end)) {
+      run->work(run, begin, end);
+    }
+    if (!batch_steal(pool, self, run->chunk)) {
+      break;
+    }
+  }
+}
+
+static void *batch_worker(void *arg) {
+  BATCH_WORKER *worker = arg;
+  BATCH_POOL *pool = worker->pool;
+  unsigned long seen = 0;
+
+  for (;;) {
+    const BATCH_RUN *run;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->quit && pool->generation == seen) {
+      pthread_cond_wait(&pool->start, &pool->lock);
+    }
+    if (pool->quit) {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    seen = pool->generation;
+    run = pool->run;
+    pthread_mutex_unlock(&pool->lock);
+
+    batch_work(pool, worker->index, run);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->busy == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  free(worker);
+  return NULL;
+}
+
+static void batch_run(BATCH_POOL *pool, const BATCH_RUN *run, uint32_t items) {
+  pthread_mutex_lock(&pool->run_lock);
+
+  // Even split; stealing evens out whatever the split got wrong
+  for (int i = 0; i < pool->threads; ++i) {
+    uint32_t b = (uint32_t)((uint64_t)items * i / pool->threads);
+    uint32_t e = (uint32_t)((uint64_t)items * (i + 1) / pool->threads);
+    atomic_store_explicit(&pool->slots[i].range, batch_pack(b, e),
+                          memory_order_relaxed);
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->run = run;
+  pool->busy = pool->threads - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  batch_work(pool, 0, run);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->busy > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pool->run = NULL;
+  pthread_mutex_unlock(&pool->lock);
+
+  pthread_mutex_unlock(&pool->run_lock);
+}
+
+BATCH_POOL *batch_pool_new(int threads) {
+  if (threads <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? (int)cpus : 1;
+  }
+
+  BATCH_POOL *pool = calloc(1, sizeof(BATCH_POOL));
+  if (!pool) {
+    return NULL;
+  }
+  pool->threads = threads;
+  pool->workers = calloc(threads, sizeof(pthread_t));
+  pool->slots = aligned_alloc(_Alignof(BATCH_SLOT),
+                              threads * sizeof(BATCH_SLOT));
+  if (!pool->workers || !pool->slots) {
+    free(pool->workers);
+    free(pool->slots);
+    free(pool);
+    return NULL;
+  }
+  for (int i = 0; i < threads; ++i) {
+    atomic_init(&pool->slots[i].range, 0);
+  }
+  pthread_mutex_init(&pool->run_lock, NULL);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  // Slot 0 belongs to the calling thread
+  for (int i = 1; i < threads; ++i) {
+    BATCH_WORKER *worker = malloc(sizeof(BATCH_WORKER));
+    if (worker) {
+      worker->pool = pool;
+      worker->index = i;
+    }
+    if (!worker || pthread_create(&pool->workers[i], NULL,
+                                  batch_worker, worker) != 0) {
+      free(worker);
+      pool->threads = i;
+      batch_pool_free(pool);
+      return NULL;
+    }
+  }
+
+  return pool;
+}
+
+void batch_pool_free(BATCH_POOL *pool) {
+  if (!pool) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 1; i < pool->threads; ++i) {
+    pthread_join(pool->workers[i], NULL);
+  }
+
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->start);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_mutex_destroy(&pool->run_lock);
+  free(pool->slots);
+  free(pool->workers);
+  free(pool);
+}
+
+int batch_pool_threads(const BATCH_POOL *pool) {
+  return pool->threads;
+}
+
+// Items are (key, step) pairs in output order.
+static void batch_generate_work(const BATCH_RUN *run,
+                                uint32_t begin, uint32_t end) {
+  HMAC_SHA1_JOB jobs[BATCH_JOBS];
+
+  while (begin < end) {
+    int n = end - begin < BATCH_JOBS ? (int)(end - begin) : BATCH_JOBS;
+    for (int i = 0; i < n; ++i) {
+      uint32_t item = begin + i;
+      jobs[i].key = &run->keys[item / run->steps];
+      jobs[i].counter = run->step + item % run->steps;
+    }
+    hmac_sha1_counter_codes(jobs, n, run->digits, run->out + begin);
+    begin += n;
+  }
+}
+
+static void batch_verify_keys(const BATCH_RUN *run, uint32_t key, int keys,
+                              const int *codes) {
+  const int width = 2 * run->window + 1;
+
+  for (int k = 0; k < keys; ++k, ++key) {
+    const int *code = codes + k * width + run->window;
+    int offset = INT_MIN;
+
+    // Closest step first: 0, -1, +1, -2, +2, ...
+    for (int d = 0; d <= run->window && offset == INT_MIN; ++d) {
+      if ((uint64_t)d <= run->step && code[-d] == run->expected[key]) {
+        offset = -d;
+      } else if (code[d] == run->expected[key]) {
+        offset = d;
+      }
+    }
+    run->out[key] = offset;
+  }
+}
+
+// Items are keys; the codes of whole windows are computed together.
+static void batch_verify_work(const BATCH_RUN *run,
+                              uint32_t begin, uint32_t end) {
+  HMAC_SHA1_JOB jobs[BATCH_JOBS];
+  int codes[BATCH_JOBS];
+  const int width = 2 * run->window + 1;
+  const int per_call = BATCH_JOBS / width;
+
+  while (begin < end) {
+    int keys = end - begin < (uint32_t)per_call ? (int)(end - begin) : per_call;
+    int n = 0;
+    for (int k = 0; k < keys; ++k) {
+      for (int d = -run->window; d <= run->window; ++d) {
+        jobs[n].key = &run->keys[begin + k];
+        jobs[n].counter = run->step + d;
+        ++n;
+      }
+    }
+    hmac_sha1_counter_codes(jobs, n, run->digits, codes);
+    batch_verify_keys(run, begin, keys, codes);
+    begin += keys;
+  }
+}
+
+int batch_generate(BATCH_POOL *pool, const HMAC_SHA1_KEY *keys, int count,
+                   uint64_t first_step, int steps, int digits, int *codes) {
+  if (count < 0 || steps <= 0 || digits < 6 || digits > 8 ||
+      (uint64_t)count * steps > UINT32_MAX) {
+    return -1;
+  }
+
+  BATCH_RUN run = {
+    .work = batch_generate_work,
+    .chunk = BATCH_CHUNK_CODES,
+    .keys = keys,
+    .step = first_step,
+    .steps = steps,
+    .digits = digits,
+    .out = codes,
+  };
+  batch_run(pool, &run, (uint32_t)count * steps);
+  return 0;
+}
+
+int batch_verify(BATCH_POOL *pool, const HMAC_SHA1_KEY *keys, int count,
+                 uint64_t step, int window, int digits,
+                 const int *expected, int *offsets) {
+  if (count < 0 || window < 0 || window > BATCH_MAX_WINDOW ||
+      digits < 6 || digits > 8) {
+    return -1;
+  }
+
+  BATCH_RUN run = {
+    .work = batch_verify_work,
+    .chunk = BATCH_CHUNK_KEYS,
+    .keys = keys,
+    .step = step,
+    .window = window,
+    .digits = digits,
+    .expected = expected,
+    .out = offsets,
+  };
+  batch_run(pool, &run, (uint32_t)count);
+  return 0;
+}
@@ -0,0 +1,61 @@
+// Multi-threaded batch code generation header file
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// A batch pool owns a fixed set of worker threads. Every run splits its
+// items evenly between the workers, and a worker that runs out steals half
+// of what is left to another one. The calling thread works as well, so a
+// pool of N threads starts N - 1 of its own. Runs on the same pool are
+// serialized; use one pool per thread for independent concurrent runs.
+//
+// Results go into buffers owned by the caller, and no memory is allocated
+// once the pool exists. All functions return 0 or -1 on error.
+
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <stdint.h>
+
+#include "hmac.h"
+
+// Largest window accepted by batch_verify()
+#define BATCH_MAX_WINDOW 100
+
+typedef struct batch_pool BATCH_POOL;
+
+// Starts a pool of "threads" threads, or one per online CPU if it is 0.
+BATCH_POOL *batch_pool_new(int threads)
+ __attribute__((visibility("hidden")));
+
+void batch_pool_free(BATCH_POOL *pool)
+ __attribute__((visibility("hidden")));
+
+int batch_pool_threads(const BATCH_POOL *pool)
+ __attribute__((visibility("hidden")));
+
+// Codes of every key for the steps first_step .. first_step + steps - 1,
+// stored key by key: codes[k * steps + s] is the code of keys[k] at step
+// first_step + s.
+int batch_generate(BATCH_POOL *pool, const HMAC_SHA1_KEY *keys, int count,
+                   uint64_t first_step, int steps, int digits, int *codes)
+ __attribute__((visibility("hidden")));
+
+// Checks expected[k] against the codes of keys[k] from step - window to
+// step + window. offsets[k] receives the step offset of the match that is
+// closest to "step", or INT_MIN if there is none.
+int batch_verify(BATCH_POOL *pool, const HMAC_SHA1_KEY *keys, int count,
+                 uint64_t step, int window, int digits,
+                 const int *expected, int *offsets)
+ __attribute__((visibility("hidden")));
+
+#endif /* _BATCH_H_ */
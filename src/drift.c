@@ -0,0 +1,335 @@
+// Per-account clock drift
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "drift.h"
+#include "gauth.h"
+#include "steptable.h"
+
+// One step in the fixed point estimate
+#define DRIFT_ONE 256
+
+// Each accepted code moves the estimate 1 / DRIFT_WEIGHT of the way.
+#define DRIFT_WEIGHT 4
+
+// Accounts written per accounts_scan() call
+#define SAVE_BATCH 1024
+
+struct drift_saver {
+  const ACCOUNTS *accounts;
+  EPOCH *epoch;
+  int reader;
+  char *path;
+  int pending;          // a save was asked for
+  int error;            // of the last save that failed, 0 if none did
+  int closing;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_t thread;
+};
+
+int drift_center(const ACCOUNT *account, int window) {
+  int32_t estimate = atomic_load_explicit(&account->drift,
+                                          memory_order_relaxed);
+  int center = estimate >= 0 ? (estimate + DRIFT_ONE / 2) / DRIFT_ONE
+                             : -((-estimate + DRIFT_ONE / 2) / DRIFT_ONE);
+  if (center < -window) {
+    return -window;
+  }
+  return center > window ? window : center;
+}
+
+void drift_record(ACCOUNT *account, int offset) {
+  int32_t estimate = atomic_load_explicit(&account->drift,
+                                          memory_order_relaxed);
+  estimate += (offset * DRIFT_ONE - estimate) / DRIFT_WEIGHT;
+  atomic_store_explicit(&account->drift, estimate, memory_order_relaxed);
+}
+
+// The code of "account" at "step", from its ring if the ring has it.
+static int drift_code(const ACCOUNT *account, uint64_t step) {
+  int code;
+  if (step_codes_get(account, step, &code)) {
+    return code;
+  }
+  return gauth_generate(&account->key, step, account->digits);
+}
+
+int drift_verify(const ACCOUNT *account, time_t now, int window, int code,
+                 int *offset) {
+  uint64_t step = gauth_totp_step(now, account->period);
+
+  if (window < 0 || window > GAUTH_MAX_WINDOW) {
+    return -1;
+  }
+  int center = drift_center(account, window);
+
+  // Without drift, the ring answers a window of one without any HMAC.
+  if (center == 0 && window <= 1) {
+    int result = step_codes_verify(account, now, window, code, offset);
+    if (result >= 0) {
+      return result;
+    }
+  }
+
+  // The estimate, then its neighbours, nearest first
+  int low = center - DRIFT_NARROW < -window ? -window : center - DRIFT_NARROW;
+  int high = center + DRIFT_NARROW > window ? window : center + DRIFT_NARROW;
+  for (int d = 0; d <= DRIFT_NARROW; ++d) {
+    for (int o = center - d; o <= center + d; o += d ? 2 * d : 1) {
+      if (o < low || o > high || (o < 0 && (uint64_t)-o > step)) {
+        continue;
+      }
+      if (drift_code(account, step + o) == code) {
+        if (offset) {
+          *offset = o;
+        }
+        return 1;
+      }
+    }
+  }
+
+  if (low == -window && high == window) {
+    return 0;
+  }
+  return gauth_verify(&account->key, step, window, account->digits, code,
+                      offset);
+}
+
+// Makes a rename in the directory of "path" last.
+static void sync_dir(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char *dir = slash ? strndup(path, slash == path ? 1 : slash - path)
+                    : strdup(".");
+  if (!dir) {
+    return;
+  }
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+  free(dir);
+}
+
+int drift_save(const ACCOUNTS *accounts, EPOCH *epoch, int reader,
+               const char *path) {
+  size_t length = strlen(path);
+  char *temp = malloc(length + sizeof(".tmp"));
+  if (!temp) {
+    return -1;
+  }
+  memcpy(temp, path, length);
+  memcpy(temp + length, ".tmp", sizeof(".tmp"));
+
+  FILE *file = fopen(temp, "w");
+  if (!file) {
+    free(temp);
+    return -1;
+  }
+
+  ACCOUNT *batch[SAVE_BATCH];
+  uint64_t cursor = 0;
+  if (epoch) {
+    epoch_enter(epoch, reader);
+  }
+  while (cursor < ACCOUNTS_SCAN_END) {
+    int n = accounts_scan(accounts, &cursor, batch, SAVE_BATCH);
+    for (int i = 0; i < n; ++i) {
+      int32_t estimate = atomic_load_explicit(&batch[i]->drift,
+                                              memory_order_relaxed);
+      if (estimate) {
+        fprintf(file, "%s %d\n", batch[i]->name, (int)estimate);
+      }
+    }
+  }
+  if (epoch) {
+    epoch_exit(epoch, reader);
+  }
+
+  // The new file reaches the disk before it replaces the old one.
+  int write_error = ferror(file);
+  int error = 0;
+  if (write_error || fflush(file) || fdatasync(fileno(file))) {
+    error = write_error ? EIO : errno;
+  }
+  if (fclose(file) && !error) {
+    error = errno;
+  }
+  if (error || rename(temp, path)) {
+    if (!error) {
+      error = errno;
+    }
+    unlink(temp);
+    free(temp);
+    errno = error;
+    return -1;
+  }
+  sync_dir(path);
+  free(temp);
+  return 0;
+}
+
+static void *saver_thread(void *arg) {
+  DRIFT_SAVER *saver = arg;
+
+  pthread_mutex_lock(&saver->lock);
+  for (;;) {
+    while (!saver->pending && !saver->closing) {
+      pthread_cond_wait(&saver->wake, &saver->lock);
+    }
+    // drift_saver_stop() saves once more anyway.
+    if (saver->closing) {
+      break;
+    }
+    saver->pending = 0;
+    pthread_mutex_unlock(&saver->lock);
+    int result = drift_save(saver->accounts, saver->epoch, saver->reader,
+                            saver->path);
+    int error = errno;
+    pthread_mutex_lock(&saver->lock);
+    if (result) {
+      saver->error = error;
+    }
+  }
+  pthread_mutex_unlock(&saver->lock);
+  return NULL;
+}
+
+DRIFT_SAVER *drift_saver_start(const ACCOUNTS *accounts, EPOCH *epoch,
+                               int reader, const char *path) {
+  DRIFT_SAVER *saver = calloc(1, sizeof(DRIFT_SAVER));
+  if (!saver) {
+    return NULL;
+  }
+  saver->accounts = accounts;
+  saver->epoch = epoch;
+  saver->reader = reader;
+  saver->path = strdup(path);
+  if (!saver->path) {
+    free(saver);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  pthread_mutex_init(&saver->lock, NULL);
+  pthread_cond_init(&saver->wake, NULL);
+  int error = pthread_create(&saver->thread, NULL, saver_thread, saver);
+  if (error) {
+    pthread_cond_destroy(&saver->wake);
+    pthread_mutex_destroy(&saver->lock);
+    free(saver->path);
+    free(saver);
+    errno = error;
+    return NULL;
+  }
+  return saver;
+}
+
+int drift_saver_kick(DRIFT_SAVER *saver) {
+  pthread_mutex_lock(&saver->lock);
+  int error = saver->error;
+  saver->error = 0;
+  saver->pending = 1;
+  pthread_cond_signal(&saver->wake);
+  pthread_mutex_unlock(&saver->lock);
+
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+int drift_saver_stop(DRIFT_SAVER *saver) {
+  pthread_mutex_lock(&saver->lock);
+  saver->closing = 1;
+  pthread_cond_signal(&saver->wake);
+  pthread_mutex_unlock(&saver->lock);
+  pthread_join(saver->thread, NULL);
+
+  int result = drift_save(saver->accounts, saver->epoch, saver->reader,
+                          saver->path);
+  int error = errno;
+  pthread_cond_destroy(&saver->wake);
+  pthread_mutex_destroy(&saver->lock);
+  free(saver->path);
+  free(saver);
+  errno = error;
+  return result;
+}
+
+int drift_load(ACCOUNTS *accounts, const char *path, int *line) {
+  *line = 0;
+
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return -1;
+  }
+
+  char *buf = NULL;
+  size_t buf_len = 0;
+  int number = 0;
+  int error_line = 0;
+  while (getline(&buf, &buf_len, file) >= 0) {
+    ++number;
+
+    char *fields[3];
+    char *save;
+    int n = 0;
+    for (char *field = strtok_r(buf, " \t\r\n", &save);
+         field && n < 3; field = strtok_r(NULL, " \t\r\n", &save)) {
+      fields[n++] = field;
+    }
+    if (n == 0 || *fields[0] == '#') {
+      continue;
+    }
+
+    char *end;
+    errno = 0;
+    long estimate = n == 2 ? strtol(fields[1], &end, 10) : 0;
+    if (n != 2 || errno || *end ||
+        estimate < -GAUTH_MAX_WINDOW * DRIFT_ONE ||
+        estimate > GAUTH_MAX_WINDOW * DRIFT_ONE) {
+      error_line = number;
+      break;
+    }
+    ACCOUNT *account = accounts_find(accounts, fields[0], strlen(fields[0]));
+    if (account) {
+      atomic_store_explicit(&account->drift, (int32_t)estimate,
+                            memory_order_relaxed);
+    }
+  }
+  int read_error = !error_line && ferror(file);
+
+  free(buf);
+  fclose(file);
+
+  if (error_line || read_error) {
+    *line = error_line;
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,79 @@
+// Per-account clock drift
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// A token whose clock is off keeps matching at the same step offset. Every
+// account keeps a smoothed estimate of that offset, moved a quarter of the
+// way towards the offset of each accepted code, and verification looks
+// around it first: one code at the estimate, then DRIFT_NARROW steps on
+// either side of it, and the whole window only when both miss. A token
+// that is five steps off is then checked with one HMAC instead of eleven.
+//
+// The estimate is a 32-bit fixed point number of 1/256 steps in the
+// account, read and written without locks. Two codes of the same account
+// accepted at once may lose one sample, which the smoothing absorbs.
+//
+// Estimates can be saved to a file with one "name estimate" line per
+// account that has drifted, and loaded back when the accounts are. A
+// DRIFT_SAVER saves them from a thread of its own, so the thread that asks
+// for a save never waits for the disk.
+
+#ifndef _DRIFT_H_
+#define _DRIFT_H_
+
+#include <time.h>
+
+#include "accounts.h"
+#include "epoch.h"
+
+#define DRIFT_NARROW 1
+
+typedef struct drift_saver DRIFT_SAVER;
+
+// The step offset closest to the estimate of "account" within "window".
+int drift_center(const ACCOUNT *account, int window);
+
+// Moves the estimate of "account" towards "offset", where a code matched.
+void drift_record(ACCOUNT *account, int offset);
+
+// Checks "code" within "window" steps of the current one, nearest the
+// estimate first. Returns 1 on a match and stores its step offset in
+// *offset, 0 if nothing matched, or -1 on error, like gauth_verify().
+int drift_verify(const ACCOUNT *account, time_t now, int window, int code,
+                 int *offset);
+
+// Writes the estimates of all accounts to "path", through a temporary file
+// that is synced and renamed over it, reading the table as reader "reader"
+// of "epoch", which may be NULL. Returns 0, or -1 and sets errno.
+int drift_save(const ACCOUNTS *accounts, EPOCH *epoch, int reader,
+               const char *path);
+
+// Starts a thread that runs drift_save() whenever drift_saver_kick() asks
+// it to. Returns NULL and sets errno on error.
+DRIFT_SAVER *drift_saver_start(const ACCOUNTS *accounts, EPOCH *epoch,
+                               int reader, const char *path);
+
+// Has the thread of "saver" save the estimates, and returns at once.
+// Returns 0, or -1 and sets errno if the save before this one failed.
+int drift_saver_kick(DRIFT_SAVER *saver);
+
+// Stops the thread, saves the estimates once more and frees "saver".
+// Returns 0, or -1 if that save failed (see errno).
+int drift_saver_stop(DRIFT_SAVER *saver);
+
+// Reads estimates written by drift_save(). Names that are not accounts are
+// skipped. Returns 0, or -1 and sets *line to the number of the offending
+// line, or to 0 if the file could not be read (see errno).
+int drift_load(ACCOUNTS *accounts, const char *path, int *line);
+
+#endif /* _DRIFT_H_ */
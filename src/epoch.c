@@ -0,0 +1,143 @@
+// Epoch-based memory reclamation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Retiring an entry stamps it with the current epoch and moves the epoch
+// on. A reader announces the epoch it entered in; one that entered after
+// the stamp read the epoch after the object was unlinked, so it cannot
+// reach it. An entry is released once every active reader entered after
+// its stamp. Retired entries wait on a lock-free stack; a reclaimer takes
+// the whole stack, releases what it can and pushes the rest back.
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+
+typedef struct epoch_reader {
+  _Atomic uint64_t active;      // epoch entered in, 0 outside
+  char pad[64 - sizeof(uint64_t)];
+} EPOCH_READER;
+
+struct epoch {
+  _Atomic uint64_t current;
+  _Atomic(EPOCH_ENTRY *) retired;
+  int readers;
+  EPOCH_READER *reader;
+};
+
+EPOCH *epoch_new(int readers) {
+  EPOCH *epoch = malloc(sizeof(EPOCH));
+  if (!epoch) {
+    return NULL;
+  }
+  epoch->reader = aligned_alloc(64, readers * sizeof(EPOCH_READER));
+  if (!epoch->reader) {
+    free(epoch);
+    return NULL;
+  }
+  atomic_init(&epoch->current, 1);
+  atomic_init(&epoch->retired, NULL);
+  epoch->readers = readers;
+  for (int i = 0; i < readers; ++i) {
+    atomic_init(&epoch->reader[i].active, 0);
+  }
+  return epoch;
+}
+
+static void epoch_release_all(EPOCH_ENTRY *entry) {
+  while (entry) {
+    EPOCH_ENTRY *next = entry->next;
+    entry->release(entry);
+    entry = next;
+  }
+}
+
+void epoch_free(EPOCH *epoch) {
+  if (epoch) {
+    epoch_release_all(atomic_load(&epoch->retired));
+    free(epoch->reader);
+    free(epoch);
+  }
+}
+
+void epoch_enter(EPOCH *epoch, int reader) {
+  atomic_store_explicit(&epoch->reader[reader].active,
+                        atomic_load(&epoch->current), memory_order_release);
+  // The announcement must be visible before any shared pointer is read.
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit(EPOCH *epoch, int reader) {
+  atomic_store_explicit(&epoch->reader[reader].active, 0,
+                        memory_order_release);
+}
+
+static void epoch_push(EPOCH *epoch, EPOCH_ENTRY *first, EPOCH_ENTRY *last) {
+  EPOCH_ENTRY *head = atomic_load_explicit(&epoch->retired,
+                                           memory_order_relaxed);
+  do {
+    last->next = head;
+  } while (!atomic_compare_exchange_weak_explicit(&epoch->retired, &head,
+                                                  first,
+                                                  memory_order_release,
+                                                  memory_order_relaxed));
+}
+
+void epoch_retire(EPOCH *epoch, EPOCH_ENTRY *entry) {
+  if (!epoch) {
+    entry->release(entry);
+    return;
+  }
+  entry->epoch = atomic_fetch_add(&epoch->current, 1);
+  epoch_push(epoch, entry, entry);
+}
+
+void epoch_reclaim(EPOCH *epoch) {
+  EPOCH_ENTRY *entry = atomic_exchange_explicit(&epoch->retired, NULL,
+                                                memory_order_acquire);
+  if (!entry) {
+    return;
+  }
+
+  atomic_thread_fence(memory_order_seq_cst);
+  uint64_t oldest = UINT64_MAX;
+  for (int i = 0; i < epoch->readers; ++i) {
+    // Pairs with the release stores of the reader: whatever it read
+    // before its current epoch is done with.
+    uint64_t active = atomic_load_explicit(&epoch->reader[i].active,
+                                           memory_order_acquire);
+    if (active && active < oldest) {
+      oldest = active;
+    }
+  }
+
+  EPOCH_ENTRY *keep = NULL;
+  EPOCH_ENTRY *keep_last = NULL;
+  while (entry) {
+    EPOCH_ENTRY *next = entry->next;
+    if (entry->epoch < oldest) {
+      entry->release(entry);
+    } else {
+      entry->next = keep;
+      keep = entry;
+      if (!keep_last) {
+        keep_last = entry;
+      }
+    }
+    entry = next;
+  }
+  if (keep) {
+    epoch_push(epoch, keep, keep_last);
+  }
+}
@@ -0,0 +1,52 @@
+// Epoch-based memory reclamation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Lets readers use shared objects without locks while writers replace
+// them. Readers bracket every use with epoch_enter() and epoch_exit(), which
+// only store to a slot of their own. A writer that unlinks an object passes
+// it to epoch_retire(), and epoch_reclaim() frees it once every reader that
+// could have seen it has left its critical section. Nobody ever waits.
+//
+// Retired objects embed an EPOCH_ENTRY, so retiring never allocates.
+
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+#include <stdint.h>
+
+typedef struct epoch_entry {
+  struct epoch_entry *next;
+  uint64_t epoch;
+  void (*release)(struct epoch_entry *entry);
+} EPOCH_ENTRY;
+
+typedef struct epoch EPOCH;
+
+// A domain for "readers" reader threads, numbered from 0.
+EPOCH *epoch_new(int readers);
+
+// Releases all retired entries. No reader may be inside a critical section.
+void epoch_free(EPOCH *epoch);
+
+void epoch_enter(EPOCH *epoch, int reader);
+void epoch_exit(EPOCH *epoch, int reader);
+
+// Releases "entry" once no reader can see it any more, or right away if
+// "epoch" is NULL. Any number of threads may retire at once.
+void epoch_retire(EPOCH *epoch, EPOCH_ENTRY *entry);
+
+// Releases the retired entries that no reader can see any more.
+void epoch_reclaim(EPOCH *epoch);
+
+#endif /* _EPOCH_H_ */
@@ -0,0 +1,198 @@
+// libgauth public API
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "base32.h"
+#include "batch.h"
+#include "gauth.h"
+#include "hmac.h"
+#include "sha1.h"
+#include "util.h"
+
+#define BITS_PER_BASE32_CHAR 5          // Base32 expands space by 8/5
+#define MAX_SECRET_LEN       100
+
+struct gauth_pool {
+  BATCH_POOL *batch;
+};
+
+static int valid_digits(int digits) {
+  return digits >= GAUTH_MIN_DIGITS && digits <= GAUTH_MAX_DIGITS;
+}
+
+int gauth_key_init(GAUTH_KEY *key, const char *base32_secret) {
+  // Estimated number of bytes needed to represent the decoded secret. Because
+  // of white-space and separators, this is an upper bound of the real number,
+  // which we later get as a return-value from base32_decode()
+  int secretLen = (strlen(base32_secret) + 7)/8*BITS_PER_BASE32_CHAR;
+
+  // Sanity check, that our secret will fixed into a reasonably-sized static
+  // array.
+  if (secretLen <= 0 || secretLen > MAX_SECRET_LEN) {
+    return -1;
+  }
+
+  // Decode secret from Base32 to a binary representation, and check that we
+  // have at least one byte's worth of secret data.
+  uint8_t secret[MAX_SECRET_LEN];
+  if ((secretLen = base32_decode((const uint8_t *)base32_secret,
+                                 secret, secretLen)) < 1) {
+    explicit_bzero(secret, sizeof(secret));
+    return -1;
+  }
+
+  hmac_sha1_init_key(key, secret, secretLen);
+  explicit_bzero(secret, sizeof(secret));
+
+  return 0;
+}
+
+int gauth_key_init_raw(GAUTH_KEY *key, const uint8_t *secret, int length) {
+  if (length < 1) {
+    return -1;
+  }
+  hmac_sha1_init_key(key, secret, length);
+  return 0;
+}
+
+void gauth_key_clear(GAUTH_KEY *key) {
+  explicit_bzero(key, sizeof(*key));
+}
+
+int gauth_generate(const GAUTH_KEY *key, uint64_t counter, int digits) {
+  if (!valid_digits(digits)) {
+    return -1;
+  }
+
+  // Compute the HMAC_SHA1 of the secret and the challenge.
+  uint8_t hash[SHA1_DIGEST_LENGTH];
+  hmac_sha1_counter(key, counter, hash);
+
+  // Pick the offset where to sample our hash value for the actual verification
+  // code.
+  const int offset = hash[SHA1_DIGEST_LENGTH - 1] & 0xF;
+
+  // Compute the truncated hash in a byte-order independent loop.
+  unsigned int truncatedHash = 0;
+  for (int i = 0; i < 4; ++i) {
+    truncatedHash <<= 8;
+    truncatedHash  |= hash[offset + i];
+  }
+  explicit_bzero(hash, sizeof(hash));
+
+  // Truncate to a smaller number of digits.
+  unsigned int modulus = 1;
+  while (digits-- > 0) {
+    modulus *= 10;
+  }
+  truncatedHash &= 0x7FFFFFFF;
+  truncatedHash %= modulus;
+
+  return truncatedHash;
+}
+
+uint64_t gauth_totp_step(time_t now, int period) {
+  return (uint64_t)now / (period > 0 ? period : 30);
+}
+
+int gauth_totp(const GAUTH_KEY *key, time_t now, int period, int digits) {
+  return gauth_generate(key, gauth_totp_step(now, period), digits);
+}
+
+int gauth_verify(const GAUTH_KEY *key, uint64_t counter,
+                 int window, int digits, int code, int *offset) {
+  GAUTH_JOB jobs[2 * GAUTH_MAX_WINDOW + 1];
+  int codes[2 * GAUTH_MAX_WINDOW + 1];
+
+  if (window < 0 || window > GAUTH_MAX_WINDOW || !valid_digits(digits)) {
+    return -1;
+  }
+
+  int n = 0;
+  for (int d = -window; d <= window; ++d) {
+    jobs[n].key = key;
+    jobs[n].counter = counter + d;
+    ++n;
+  }
+  hmac_sha1_counter_codes(jobs, n, digits, codes);
+
+  // Closest counter first: 0, -1, +1, -2, +2, ...
+  const int *center = codes + window;
+  for (int d = 0; d <= window; ++d) {
+    int match = 0;
+    if ((uint64_t)d <= counter && center[-d] == code) {
+      match = -d;
+    } else if (center[d] == code) {
+      match = d;
+    } else {
+      continue;
+    }
+    if (offset) {
+      *offset = match;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+int gauth_generate_many(const GAUTH_JOB *jobs, int count,
+                        int digits, int *codes) {
+  if (count < 0 || !valid_digits(digits)) {
+    return -1;
+  }
+  hmac_sha1_counter_codes(jobs, count, digits, codes);
+  return 0;
+}
+
+GAUTH_POOL *gauth_pool_new(int threads) {
+  GAUTH_POOL *pool = malloc(sizeof(GAUTH_POOL));
+  if (!pool) {
+    return NULL;
+  }
+  pool->batch = batch_pool_new(threads);
+  if (!pool->batch) {
+    free(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+void gauth_pool_free(GAUTH_POOL *pool) {
+  if (pool) {
+    batch_pool_free(pool->batch);
+    free(pool);
+  }
+}
+
+int gauth_pool_threads(const GAUTH_POOL *pool) {
+  return batch_pool_threads(pool->batch);
+}
+
+int gauth_batch_generate(GAUTH_POOL *pool, const GAUTH_KEY *keys, int count,
+                         uint64_t first_step, int steps,
+                         int digits, int *codes) {
+  return batch_generate(pool->batch, keys, count, first_step, steps,
+                        digits, codes);
+}
+
+int gauth_batch_verify(GAUTH_POOL *pool, const GAUTH_KEY *keys, int count,
+                       uint64_t step, int window, int digits,
+                       const int *expected, int *offsets) {
+  return batch_verify(pool->batch, keys, count, step, window, digits,
+                      expected, offsets);
+}
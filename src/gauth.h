@@ -0,0 +1,109 @@
+// libgauth public header file
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// HOTP (RFC 4226) and TOTP (RFC 6238) codes with HMAC-SHA1. All functions
+// are reentrant and keep no global state: a GAUTH_KEY is only read once it
+// is initialized, so any number of threads may share it.
+//
+// Functions that can fail return -1 on error; codes are never negative.
+
+#ifndef _GAUTH_H_
+#define _GAUTH_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GAUTH_API __attribute__((visibility("default")))
+
+#define GAUTH_MIN_DIGITS 6
+#define GAUTH_MAX_DIGITS 8
+
+// Largest window accepted by gauth_verify() and gauth_batch_verify()
+#define GAUTH_MAX_WINDOW 100
+
+// gauth_verify() and gauth_batch_verify() offset when nothing matched
+#define GAUTH_NO_MATCH INT32_MIN
+
+// A secret ready for use: the HMAC-SHA1 inner and outer key states. It
+// holds key material; wipe it with gauth_key_clear().
+typedef struct gauth_key {
+  uint32_t inner[5];
+  uint32_t outer[5];
+} GAUTH_KEY;
+
+// One code to compute: a key and the HOTP counter or TOTP step.
+typedef struct gauth_job {
+  const GAUTH_KEY *key;
+  uint64_t counter;
+} GAUTH_JOB;
+
+// A fixed set of worker threads for the gauth_batch_*() functions.
+typedef struct gauth_pool GAUTH_POOL;
+
+// Prepares a key from its Base32 form (white-space and hyphens allowed).
+GAUTH_API int gauth_key_init(GAUTH_KEY *key, const char *base32_secret);
+
+// Prepares a key from the raw secret bytes.
+GAUTH_API int gauth_key_init_raw(GAUTH_KEY *key,
+                                 const uint8_t *secret, int length);
+
+GAUTH_API void gauth_key_clear(GAUTH_KEY *key);
+
+// The "digits" long code for an HOTP counter or TOTP step.
+GAUTH_API int gauth_generate(const GAUTH_KEY *key, uint64_t counter,
+                             int digits);
+
+// The TOTP step of a point in time, and its code.
+GAUTH_API uint64_t gauth_totp_step(time_t now, int period);
+GAUTH_API int gauth_totp(const GAUTH_KEY *key, time_t now, int period,
+                         int digits);
+
+// Checks "code" against counter - window .. counter + window. Returns 1
+// on a match and stores the offset of the closest matching counter in
+// *offset (if not NULL), 0 if nothing matched, or -1 on error.
+GAUTH_API int gauth_verify(const GAUTH_KEY *key, uint64_t counter,
+                           int window, int digits, int code, int *offset);
+
+// Computes the codes of "count" jobs at once in the calling thread, with
+// several jobs per SIMD instruction where the CPU allows it.
+GAUTH_API int gauth_generate_many(const GAUTH_JOB *jobs, int count,
+                                  int digits, int *codes);
+
+// Starts a pool of "threads" threads, or one per online CPU if it is 0.
+GAUTH_API GAUTH_POOL *gauth_pool_new(int threads);
+GAUTH_API void gauth_pool_free(GAUTH_POOL *pool);
+GAUTH_API int gauth_pool_threads(const GAUTH_POOL *pool);
+
+// codes[k * steps + s] gets the code of keys[k] for first_step + s.
+GAUTH_API int gauth_batch_generate(GAUTH_POOL *pool,
+                                   const GAUTH_KEY *keys, int count,
+                                   uint64_t first_step, int steps,
+                                   int digits, int *codes);
+
+// offsets[k] gets the offset of the closest step within "window" of
+// "step" where keys[k] produces expected[k], or GAUTH_NO_MATCH.
+GAUTH_API int gauth_batch_verify(GAUTH_POOL *pool,
+                                 const GAUTH_KEY *keys, int count,
+                                 uint64_t step, int window, int digits,
+                                 const int *expected, int *offsets);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GAUTH_H_ */
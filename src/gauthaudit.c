@@ -0,0 +1,427 @@
+// Parallel re-verification of login records
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Checks a log of login records, one per line:
+//
+//   name  unix-time  code
+//
+// against the accounts file of gauthenticatord, and prints every record
+// whose code was not valid at its time, preceded by its byte offset in the
+// log and the reason. Records of HOTP accounts cannot be checked and are
+// printed too.
+//
+// The log is mapped, never read into memory. It is cut into CHUNK_SIZE
+// pieces that the threads take in turn; a line belongs to the chunk it
+// starts in, so each thread finds its first line by skipping to the end of
+// the line before its chunk. Pages of finished chunks are dropped from the
+// mapping. Records are parsed in place and their codes computed
+// BATCH_JOBS at a time with gauth_generate_many(), so SHA-1 runs several
+// records per SIMD instruction. Each thread collects its output in a buffer
+// of its own and writes it out whole, so lines of different threads never
+// mix.
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accounts.h"
+#include "gauth.h"
+
+#define CHUNK_SIZE    (4u << 20)
+#define BATCH_JOBS    1024
+#define OUTPUT_SIZE   65536
+#define MAX_THREADS   256
+
+#define DEFAULT_WINDOW 1
+
+// A record waiting for its codes
+typedef struct record {
+  const char *line;
+  uint32_t length;
+  const ACCOUNT *account;
+  uint64_t step;
+  int code;
+} RECORD;
+
+typedef struct worker {
+  pthread_t thread;
+  uint64_t records;
+  uint64_t mismatches;
+  double seconds;
+  int batched;
+  int jobs_used;
+  RECORD batch[BATCH_JOBS];
+  GAUTH_JOB jobs[BATCH_JOBS];
+  int codes[BATCH_JOBS];
+  size_t output_len;
+  char output[OUTPUT_SIZE];
+} WORKER;
+
+static ACCOUNTS *accounts;
+static int window = DEFAULT_WINDOW;
+
+static const char *log_map;
+static size_t log_size;
+static size_t page_size;
+static _Atomic size_t next_chunk;
+
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int output_failed;
+
+// 10^digits; codes are computed with GAUTH_MAX_DIGITS digits and reduced.
+static const int modulus[GAUTH_MAX_DIGITS + 1] = {
+  1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000
+};
+
+static double monotonic_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void output_flush(WORKER *worker) {
+  size_t pos = 0;
+
+  pthread_mutex_lock(&output_lock);
+  while (pos < worker->output_len && !atomic_load(&output_failed)) {
+    ssize_t n = write(STDOUT_FILENO, worker->output + pos,
+                      worker->output_len - pos);
+    if (n < 0 && errno != EINTR) {
+      perror("gauthaudit: write");
+      atomic_store(&output_failed, 1);
+    }
+    if (n > 0) {
+      pos += n;
+    }
+  }
+  pthread_mutex_unlock(&output_lock);
+  worker->output_len = 0;
+}
+
+// Prints "offset reason record". Very long records are cut short.
+static void report(WORKER *worker, const char *reason,
+                   const char *line, size_t length) {
+  char offset[32];
+  int offset_len = snprintf(offset, sizeof(offset), "%zu %s ",
+                            (size_t)(line - log_map), reason);
+  if (length > OUTPUT_SIZE / 2) {
+    length = OUTPUT_SIZE / 2;
+  }
+  if (OUTPUT_SIZE - worker->output_len < offset_len + length + 1) {
+    output_flush(worker);
+  }
+  memcpy(worker->output + worker->output_len, offset, offset_len);
+  memcpy(worker->output + worker->output_len + offset_len, line, length);
+  worker->output_len += offset_len + length;
+  worker->output[worker->output_len++] = '\n';
+  ++worker->mismatches;
+}
+
+// Computes the codes of the batched records and reports those that match
+// none of them.
+static void verify_batch(WORKER *worker) {
+  const int *codes = worker->codes;
+
+  gauth_generate_many(worker->jobs, worker->jobs_used, GAUTH_MAX_DIGITS,
+                      worker->codes);
+  for (int r = 0; r < worker->batched; ++r, codes += 2 * window + 1) {
+    const RECORD *record = &worker->batch[r];
+    int mod = modulus[record->account->digits];
+    int match = 0;
+    for (int d = -window; d <= window && !match; ++d) {
+      match = (d >= 0 || (uint64_t)-d <= record->step) &&
+              codes[window + d] % mod == record->code;
+    }
+    if (!match) {
+      report(worker, "rejected", record->line, record->length);
+    }
+  }
+  worker->batched = worker->jobs_used = 0;
+}
+
+static int blank(char c) {
+  return c == ' ' || c == '\t';
+}
+
+// Reads a decimal field of at most "max" that ends at a blank or at "end".
+static int parse_number(const char **p, const char *end, uint64_t max,
+                        uint64_t *value) {
+  const char *s = *p;
+  uint64_t v = 0;
+
+  while (s < end && blank(*s)) {
+    ++s;
+  }
+  if (s == end || *s < '0' || *s > '9') {
+    return 0;
+  }
+  for (; s < end && *s >= '0' && *s <= '9'; ++s) {
+    if (v > (max - (*s - '0')) / 10) {
+      return 0;
+    }
+    v = v * 10 + (*s - '0');
+  }
+  if (s < end && !blank(*s)) {
+    return 0;
+  }
+  *p = s;
+  *value = v;
+  return 1;
+}
+
+static void audit_line(WORKER *worker, const char *line, const char *end) {
+  const char *p = line;
+  uint64_t when;
+  uint64_t code;
+
+  if (end > line && end[-1] == '\r') {
+    --end;
+  }
+  while (p < end && blank(*p)) {
+    ++p;
+  }
+  if (p == end || *p == '#') {
+    return;
+  }
+  ++worker->records;
+
+  const char *name = p;
+  while (p < end && !blank(*p)) {
+    ++p;
+  }
+  size_t name_len = p - name;
+  if (!parse_number(&p, end, INT64_MAX, &when) ||
+      !parse_number(&p, end, INT32_MAX, &code)) {
+    report(worker, "invalid", line, end - line);
+    return;
+  }
+  while (p < end && blank(*p)) {
+    ++p;
+  }
+  if (p != end) {
+    report(worker, "invalid", line, end - line);
+    return;
+  }
+  const ACCOUNT *account = accounts_find(accounts, name, name_len);
+  if (!account) {
+    report(worker, "unknown", line, end - line);
+    return;
+  }
+  // A time tells nothing about the counter an HOTP code was made for.
+  if (account->period == ACCOUNT_HOTP) {
+    report(worker, "counter", line, end - line);
+    return;
+  }
+
+  if (worker->jobs_used + 2 * window + 1 > BATCH_JOBS) {
+    verify_batch(worker);
+  }
+  RECORD *record = &worker->batch[worker->batched++];
+  record->line = line;
+  record->length = end - line;
+  record->account = account;
+  record->step = gauth_totp_step((time_t)when, account->period);
+  record->code = (int)code;
+  for (int d = -window; d <= window; ++d) {
+    GAUTH_JOB *job = &worker->jobs[worker->jobs_used++];
+    job->key = &account->key;
+    job->counter = record->step + d;
+  }
+}
+
+// Checks the lines that start in [begin, end).
+static void audit_chunk(WORKER *worker, size_t begin, size_t end) {
+  const char *p = log_map + begin;
+  const char *log_end = log_map + log_size;
+
+  if (begin > 0) {
+    // The line running into the chunk belongs to the chunk before.
+    const char *newline = memchr(p - 1, '\n', log_end - (p - 1));
+    if (!newline) {
+      return;
+    }
+    p = newline + 1;
+  }
+  while (p < log_map + end) {
+    const char *newline = memchr(p, '\n', log_end - p);
+    const char *line_end = newline ? newline : log_end;
+    audit_line(worker, p, line_end);
+    p = newline ? newline + 1 : log_end;
+  }
+  verify_batch(worker);
+
+  size_t first_page = (begin + page_size - 1) & ~(page_size - 1);
+  size_t last_page = end & ~(page_size - 1);
+  if (last_page > first_page) {
+    madvise((void *)(log_map + first_page), last_page - first_page,
+            MADV_DONTNEED);
+  }
+}
+
+static void *audit(void *arg) {
+  WORKER *worker = arg;
+  double start = monotonic_seconds();
+
+  for (;;) {
+    size_t begin = atomic_fetch_add(&next_chunk, CHUNK_SIZE);
+    if (begin >= log_size || atomic_load(&output_failed)) {
+      break;
+    }
+    size_t end = log_size - begin > CHUNK_SIZE ? begin + CHUNK_SIZE : log_size;
+    audit_chunk(worker, begin, end);
+  }
+  output_flush(worker);
+  worker->seconds = monotonic_seconds() - start;
+  return NULL;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "Usage: gauthaudit [-j THREADS] [-w WINDOW] ACCOUNTS-FILE LOG-FILE\n");
+}
+
+int main(int argc, char *argv[]) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : (int)cpus;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:w:h")) != -1) {
+    switch (opt) {
+      case 'j':
+        threads = atoi(optarg);
+        if (threads < 1 || threads > MAX_THREADS) {
+          usage();
+          return 2;
+        }
+        break;
+      case 'w':
+        window = atoi(optarg);
+        if (window < 0 || window > GAUTH_MAX_WINDOW) {
+          usage();
+          return 2;
+        }
+        break;
+      default:
+        usage();
+        return opt == 'h' ? EXIT_SUCCESS : 2;
+    }
+  }
+  if (optind != argc - 2) {
+    usage();
+    return 2;
+  }
+  const char *accounts_path = argv[optind];
+  const char *log_path = argv[optind + 1];
+
+  int line;
+  accounts = accounts_load(accounts_path, NULL, &line);
+  if (!accounts) {
+    if (line) {
+      fprintf(stderr, "gauthaudit: %s:%d: invalid account\n",
+              accounts_path, line);
+    } else {
+      fprintf(stderr, "gauthaudit: %s: %s\n", accounts_path,
+              strerror(errno));
+    }
+    return 2;
+  }
+
+  struct stat st;
+  int fd = open(log_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "gauthaudit: %s: %s\n", log_path, strerror(errno));
+    accounts_free(accounts);
+    return 2;
+  }
+  log_size = st.st_size;
+  page_size = sysconf(_SC_PAGESIZE);
+  if (log_size > 0) {
+    log_map = mmap(NULL, log_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (log_map == MAP_FAILED) {
+      fprintf(stderr, "gauthaudit: %s: %s\n", log_path, strerror(errno));
+      close(fd);
+      accounts_free(accounts);
+      return 2;
+    }
+    madvise((void *)log_map, log_size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  WORKER *workers = calloc(threads, sizeof(WORKER));
+  if (!workers) {
+    perror("gauthaudit");
+    if (log_size > 0) {
+      munmap((void *)log_map, log_size);
+    }
+    accounts_free(accounts);
+    return 2;
+  }
+
+  double start = monotonic_seconds();
+  int spawned = 0;
+  for (; spawned < threads; ++spawned) {
+    if (pthread_create(&workers[spawned].thread, NULL, audit,
+                       &workers[spawned]) != 0) {
+      perror("gauthaudit: pthread_create");
+      break;
+    }
+  }
+  // Chunks are taken as they come, so fewer threads still finish the log.
+  if (!spawned) {
+    audit(&workers[0]);
+    spawned = 1;
+  } else {
+    for (int i = 0; i < spawned; ++i) {
+      pthread_join(workers[i].thread, NULL);
+    }
+  }
+  double seconds = monotonic_seconds() - start;
+
+  uint64_t records = 0;
+  uint64_t mismatches = 0;
+  for (int i = 0; i < spawned; ++i) {
+    fprintf(stderr, "gauthaudit: thread %d: %llu records in %.3f s, "
+            "%.0f records/s\n", i, (unsigned long long)workers[i].records,
+            workers[i].seconds,
+            workers[i].seconds > 0 ? workers[i].records / workers[i].seconds
+                                   : 0.0);
+    records += workers[i].records;
+    mismatches += workers[i].mismatches;
+  }
+  fprintf(stderr, "gauthaudit: %llu records, %llu mismatches in %.3f s, "
+          "%.0f records/s\n", (unsigned long long)records,
+          (unsigned long long)mismatches, seconds,
+          seconds > 0 ? records / seconds : 0.0);
+
+  free(workers);
+  if (log_size > 0) {
+    munmap((void *)log_map, log_size);
+  }
+  accounts_free(accounts);
+
+  if (atomic_load(&output_failed)) {
+    return 2;
+  }
+  return mismatches ? 1 : EXIT_SUCCESS;
+}
@@ -0,0 +1,86 @@
+// gauthenticatord wire protocol
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Clients talk to gauthenticatord over a Unix stream socket. Every message,
+// in either direction, is a frame: a 4-byte length, then that many bytes.
+// All integers are big-endian.
+//
+//   request:  length:4  tag:4  op:1  body
+//   response: length:4  tag:4  status:1  body
+//
+// The tag is chosen by the client and copied into the response, so a client
+// may send any number of requests without waiting, and the server answers
+// all requests it finds in one read at once. Responses come back in request
+// order.
+//
+// GAUTHD_OP_VERIFY checks a code of the account "name" within "window"
+// steps of the current one. A code is only accepted once:
+//
+//   request body:  window:1  code:4  name_length:1  name
+//   response body: offset:1 (signed step offset of the match; 0 unless
+//                  the status is GAUTHD_OK)
+//
+// For an HOTP account, "window" is the number of counters past the next
+// expected one to look at, and "offset" is how far past it the code was.
+// Accepting a code makes it and all codes of earlier counters invalid.
+//
+// GAUTHD_OP_LOOKUP finds the accounts whose code at the current step, or
+// within "window" (0 or 1) steps of it, is "code". The status is GAUTHD_OK
+// if there is at least one. "total" counts all matches; more than one means
+// the code is ambiguous. The first GAUTHD_MAX_MATCHES of them, closest step
+// first, are listed:
+//
+//   request body:  window:1  code:4
+//   response body: total:2  count:1  count * (offset:1  name_length:1  name)
+//
+// GAUTHD_OP_ADD adds an account, GAUTHD_OP_REMOVE removes one. Only
+// clients of the same user as the server, or root, may change accounts,
+// and changes are not written back to the accounts file. Both have no
+// response body:
+//
+//   add request body:    period:4  digits:1  name_length:1  name  secret
+//   remove request body: name_length:1  name
+//
+// The secret is in Base32 and takes the rest of the frame. A period of 0
+// adds an HOTP account, starting at counter 0.
+//
+// A frame longer than GAUTHD_MAX_FRAME closes the connection.
+
+#ifndef _GAUTHD_H_
+#define _GAUTHD_H_
+
+#define GAUTHD_DEFAULT_SOCKET "/run/gauthenticatord.sock"
+
+#define GAUTHD_MAX_FRAME 1024
+
+// Accounts listed in a GAUTHD_OP_LOOKUP response
+#define GAUTHD_MAX_MATCHES 8
+
+// Requests
+#define GAUTHD_OP_VERIFY 1
+#define GAUTHD_OP_LOOKUP 2
+#define GAUTHD_OP_ADD    3
+#define GAUTHD_OP_REMOVE 4
+
+// Response status
+#define GAUTHD_OK             0  // the code is valid, or the change made
+#define GAUTHD_REJECTED       1  // the code is not valid
+#define GAUTHD_NO_ACCOUNT     2  // no account of that name
+#define GAUTHD_BAD_REQUEST    3  // malformed request or unknown op
+#define GAUTHD_REPLAYED       4  // the code is valid but was used before
+#define GAUTHD_UNAVAILABLE    5  // cannot check for replays; try again
+#define GAUTHD_EXISTS         6  // an account of that name exists
+#define GAUTHD_DENIED         7  // the client may not change accounts
+
+#endif /* _GAUTHD_H_ */
@@ -24,111 +24,396 @@
 #include <time.h>
 #include <unistd.h>
 
-#include "base32.h"
-#include "hmac.h"
-#include "sha1.h"
+#include "gauth.h"
+#include "keyring.h"
+#include "search.h"
+#include "util.h"
 
 #include <stdio.h>
 
 #include <gtk/gtk.h>
 
-#define VERIFICATION_CODE_MODULUS (1000*1000) // Six digits
-#define BITS_PER_BASE32_CHAR      5           // Base32 expands space by 8/5
+#define DEFAULT_PERIOD 30 // Seconds per time step
+#define DEFAULT_DIGITS 6  // Digits per code
+#define MAX_PERIOD 86400  // Longest time step, as in gauthenticatord
 
 #define KEY_STR_LEN 16
 
 #define BUFFER_LEN 128
 
+// One account, kept by value in the growable mydata array. The slot of a
+// removed account goes to free_slots and is reused by the next one added.
+// The key lives apart, so that growing the array leaves no copy of it in
+// the memory it moves out of.
 typedef struct mydata {
-  GtkWidget *window;
-  GtkWidget *box_scrolled;
-  char key_str[KEY_STR_LEN + 1];
-  GtkWidget *status_bar;
+  gint id;
+  gboolean in_use;
+  GtkTreeIter row;
+  gchar *account;
+  GAUTH_KEY *hmac_key;
+  gboolean key_valid;
+  const gchar *invalid;   // the field that keeps it from having codes, or NULL
+  int period;
+  int digits;
 } MYDATA;
 
-#define MAX_ACCOUNTS 1000
+// The widgets of the main window, shared by all callbacks. store has a row
+// for every account; while a search is active the view shows matches, a
+// filter over store that only lets through the rows the search index marked.
+typedef struct gui {
+  GtkWidget *window;
+  GtkWidget *search_entry;
+  GtkWidget *tree_view;
+  GtkListStore *store;
+  GtkTreeModel *matches;
+  GtkWidget *status_bar;
+} GUI;
+
+// The list stores only hold the position of each account in mydata.
+enum {
+  COLUMN_SLOT,
+  N_COLUMNS
+};
+
+// One account as stored in the keyring. The "index" attribute is a stable
+// id: it is never renumbered, and a new account gets one past the highest.
+typedef struct token {
+  gint index;
+  gchar *account;
+  gchar *key;
+  gint period;
+  gint digits;
+  const gchar *invalid;   // the attribute out of range, or NULL
+} TOKEN;
+
+// Seconds before a rollover at which the next table is computed.
+#define LOOKAHEAD_SECONDS 3
+
+// The codes of every account for one span of time, during which no account
+// changes step. With mixed periods the span ends at the nearest rollover.
+typedef struct code_table {
+  time_t from;
+  time_t until;
+  unsigned int count;
+  unsigned int version;
+  unsigned int capacity;
+  int *codes;
+} CODE_TABLE;
+
+// Number of account rows added per idle iteration while loading.
+#define LOAD_BATCH 256
+
+typedef struct loader {
+  GUI *pgui;
+  GPtrArray *tokens;
+  guint next;
+  GList *passwords;
+  GList *accounts;
+  int pending;
+  gboolean cancelled;   // a search was cut short by keyring_shutdown()
+  gboolean failed;      // a search of the old schemas failed
+} LOADER;
 
 #undef DEBUG
 
-MYDATA mydata[MAX_ACCOUNTS];
+GArray *mydata;
+
+// Slots of removed accounts, reused before mydata grows.
+GArray *free_slots;
+
+// Bumped whenever an account is added or removed.
+unsigned int accounts_version = 0;
+
+// Keyring id for the next account added.
+gint next_account_id = 0;
+
+// Account names by slot, kept up to date as accounts come and go.
+SEARCH_INDEX *search_index;
+
+GUI gui;
+
+CODE_TABLE code_tables[2];
+
+// The table for now, and the one for the span after it.
+CODE_TABLE *current_codes = &code_tables[0];
+CODE_TABLE *next_codes = &code_tables[1];
+
+guint lookahead_source = 0;
+
+// Account whose code the copy button puts on the clipboard, or -1.
+int selected_account = -1;
+
+// The 1 Hz timer that relabels the visible accounts, 0 while paused.
+guint tick_source = 0;
 
-MYDATA mydata2[1];
+gboolean accounts_loading = FALSE;
 
-int correct_code;
+// Command lines forwarded by other instances while the accounts load.
+GQueue pending_commands = G_QUEUE_INIT;
 
-unsigned int mydata_index = 0;
+// Stores and clears of the migration not answered yet, and whether any of
+// them failed.
+gint migration_pending = 0;
+gboolean migration_failed = FALSE;
 
-static int generateCode(const char *key, unsigned long tm) {
-  uint8_t challenge[8];
-  for (int i = 8; i--; tm >>= 8) {
-    challenge[i] = tm;
+static inline MYDATA *
+account_at (unsigned int index)
+{
+  return &g_array_index (mydata, MYDATA, index);
+}
+
+// Computes the codes of all accounts at time "now" in one batch.
+static void
+code_table_fill (CODE_TABLE *table,
+                 time_t      now)
+{
+  unsigned int count = mydata->len;
+  GAUTH_JOB *jobs = g_new (GAUTH_JOB, count);
+  int *slots = g_new (int, count);
+  int *codes = g_new (int, count);
+
+  if (table->capacity < count) {
+    table->capacity = MAX (count, 2 * table->capacity);
+    table->codes = g_renew (int, table->codes, table->capacity);
   }
 
+  table->from = 0;
+  table->until = G_MAXINT64;
 
-  // Estimated number of bytes needed to represent the decoded secret. Because
-  // of white-space and separators, this is an upper bound of the real number,
-  // which we later get as a return-value from base32_decode()
-  int secretLen = (strlen(key) + 7)/8*BITS_PER_BASE32_CHAR;
+  for (unsigned int i = 0; i < count; i++) {
+    MYDATA *account = account_at (i);
+    time_t step;
 
-  // Sanity check, that our secret will fixed into a reasonably-sized static
-  // array.
-  if (secretLen <= 0 || secretLen > 100) {
-    return -1;
+    table->codes[i] = -1;
+    if (!account->in_use) {
+      continue;
+    }
+    step = now / account->period;
+
+    table->from = MAX (table->from, step * account->period);
+    table->until = MIN (table->until, (step + 1) * account->period);
   }
 
-  // Decode secret from Base32 to a binary representation, and check that we
-  // have at least one byte's worth of secret data.
-  uint8_t secret[100];
-  if ((secretLen = base32_decode((const uint8_t *)key, secret, secretLen))<1) {
-    return -1;
+  // The batch takes a single code length, so group the accounts by it.
+  for (int digits = GAUTH_MIN_DIGITS; digits <= GAUTH_MAX_DIGITS; digits++) {
+    int n = 0;
+
+    for (unsigned int i = 0; i < count; i++) {
+      MYDATA *account = account_at (i);
+
+      if (account->in_use && account->key_valid && account->digits == digits) {
+        jobs[n].key = account->hmac_key;
+        jobs[n].counter = now / account->period;
+        slots[n++] = i;
+      }
+    }
+    gauth_generate_many (jobs, n, digits, codes);
+    for (int j = 0; j < n; j++) {
+      table->codes[slots[j]] = codes[j];
+    }
   }
 
-  // Compute the HMAC_SHA1 of the secret and the challenge.
-  uint8_t hash[SHA1_DIGEST_LENGTH];
-  hmac_sha1(secret, secretLen, challenge, 8, hash, SHA1_DIGEST_LENGTH);
+  table->count = count;
+  table->version = accounts_version;
 
-  // Pick the offset where to sample our hash value for the actual verification
-  // code.
-  const int offset = hash[SHA1_DIGEST_LENGTH - 1] & 0xF;
+  g_free (jobs);
+  g_free (slots);
+  g_free (codes);
+}
+
+static gboolean
+code_table_lookahead (gpointer user_data)
+{
+  lookahead_source = 0;
+  code_table_fill (next_codes, current_codes->until);
+
+  return G_SOURCE_REMOVE;
+}
+
+// Schedules the next table to be computed shortly before the current one
+// runs out, at idle priority.
+static void
+code_table_schedule (time_t now)
+{
+  time_t wait = current_codes->until - LOOKAHEAD_SECONDS - now;
 
-  // Compute the truncated hash in a byte-order independent loop.
-  unsigned int truncatedHash = 0;
-  for (int i = 0; i < 4; ++i) {
-    truncatedHash <<= 8;
-    truncatedHash  |= hash[offset + i];
+  if (lookahead_source != 0) {
+    g_source_remove (lookahead_source);
+    lookahead_source = 0;
+  }
+  // A table without accounts never runs out, and adding one refills it.
+  if (current_codes->until == G_MAXINT64) {
+    return;
   }
+  lookahead_source = g_timeout_add_seconds_full (G_PRIORITY_DEFAULT_IDLE, wait > 0 ? wait : 0,
+                                                 code_table_lookahead, NULL, NULL);
+}
 
-  // Truncate to a smaller number of digits.
-  truncatedHash &= 0x7FFFFFFF;
-  truncatedHash %= VERIFICATION_CODE_MODULUS;
+static gboolean
+code_table_covers (const CODE_TABLE *table,
+                   time_t            now)
+{
+  return table->version == accounts_version && now >= table->from && now < table->until;
+}
 
-  return truncatedHash;
+// The code of an account at time "now", or -1 if its key is not valid.
+static int
+code_table_lookup (unsigned int index,
+                   time_t       now)
+{
+  if (!code_table_covers (current_codes, now)) {
+    if (code_table_covers (next_codes, now)) {
+      CODE_TABLE *table = current_codes;
+      current_codes = next_codes;
+      next_codes = table;
+    } else {
+      code_table_fill (current_codes, now);
+    }
+    code_table_schedule (now);
+  }
+
+  return current_codes->codes[index];
 }
 
+// Replaces the status bar message instead of stacking a new one on it.
 static void
-calculate_code (GtkWidget *widget,
-                gpointer   data)
+show_status (GUI         *pgui,
+             const gchar *text)
+{
+  gtk_statusbar_remove_all (GTK_STATUSBAR (pgui->status_bar), 1);
+  gtk_statusbar_push (GTK_STATUSBAR (pgui->status_bar), 1, text);
+}
+
+// Writes a code in two groups, e.g. "123 456" or "1234 5678".
+static void
+format_code (char *buf,
+             int   code,
+             int   digits)
+{
+  int half = digits / 2;
+  int split;
+
+  for (split = 1; half > 0; half--) {
+    split *= 10;
+  }
+  snprintf (buf, BUFFER_LEN, "%0*d %0*d", digits - digits / 2, code / split,
+            digits / 2, code % split);
+}
+
+static void
+account_selected (GtkTreeSelection *selection,
+                  gpointer          data)
 {
-  unsigned long tm;
-  int step_size = 30;
   char buf[BUFFER_LEN];
+  char code_buf[BUFFER_LEN];
+  GtkTreeModel *model;
+  GtkTreeIter iter;
+  guint slot;
+  int code;
   int expires;
-  GtkClipboard *clipboard;
 
-  MYDATA *mydata = data;
+  GUI *pgui = data;
 
-  tm = time(NULL)/(step_size ? step_size : 30);
+  if (!gtk_tree_selection_get_selected (selection, &model, &iter)) {
+    selected_account = -1;
+    return;
+  }
+  gtk_tree_model_get (model, &iter, COLUMN_SLOT, &slot, -1);
 
-#ifdef DEBUG
-g_print ("%s::key_str:%s\n", __FUNCTION__, mydata->key_str);
-#endif // DEBUG
-  correct_code = generateCode(mydata->key_str, tm);
+  MYDATA *mydata_account = account_at (slot);
+
+  // One snapshot for both the code and the time it expires.
+  time_t now = time(NULL);
+
+  selected_account = slot;
+  code = code_table_lookup(slot, now);
+  if (code < 0) {
+    snprintf (buf, BUFFER_LEN, "The %s of this account is not valid.", mydata_account->invalid);
+    show_status (pgui, buf);
+    return;
+  }
+
+  format_code (code_buf, code, mydata_account->digits);
+  expires = mydata_account->period - now % mydata_account->period;
+  snprintf(buf, BUFFER_LEN, "The token is %s and expires in %2d second(s).", code_buf, expires);
+
+  show_status (pgui, buf);
+}
 
-  expires = step_size - (time(NULL) % (step_size ? step_size : 30));
-  snprintf(buf, BUFFER_LEN, "The token is %03d %03d and expires in %2d second(s).", correct_code / 1000,
-              correct_code - ((correct_code / 1000) * 1000), expires);
+// Renders a row when it is drawn, so only visible rows are ever formatted.
+static void
+account_cell_data (GtkTreeViewColumn *column,
+                   GtkCellRenderer   *cell,
+                   GtkTreeModel      *model,
+                   GtkTreeIter       *iter,
+                   gpointer           data)
+{
+  char buf[BUFFER_LEN];
+  char code_buf[BUFFER_LEN];
+  guint slot;
+  time_t now = time(NULL);
+
+  gtk_tree_model_get (model, iter, COLUMN_SLOT, &slot, -1);
+
+  MYDATA *account = account_at (slot);
+  int code = code_table_lookup (slot, now);
+
+  if (code < 0) {
+    snprintf (buf, BUFFER_LEN, "%s   (invalid %s)", account->account, account->invalid);
+  } else {
+    format_code (code_buf, code, account->digits);
+    snprintf (buf, BUFFER_LEN, "%s   %s   %2ds", account->account, code_buf,
+              (int) (account->period - now % account->period));
+  }
+  g_object_set (cell, "text", buf, NULL);
+}
+
+static gboolean
+tick (gpointer data)
+{
+  GUI *pgui = data;
+
+  // The tree view only redraws, and so relabels, the visible rows.
+  gtk_widget_queue_draw (pgui->tree_view);
 
-  gtk_statusbar_push(GTK_STATUSBAR(mydata->status_bar), 1, buf);
+  // Wake up right after the next second starts, where every rollover falls.
+  tick_source = g_timeout_add (1000 - (g_get_real_time () / 1000) % 1000 + 5, tick, data);
+
+  return G_SOURCE_REMOVE;
+}
+
+// Runs the timer only while the window can be seen.
+static void
+tick_update (GUI *pgui)
+{
+  GdkWindow *gdk_window = gtk_widget_get_window (pgui->window);
+  gboolean visible = gtk_widget_get_mapped (pgui->window) && gdk_window != NULL &&
+                     !(gdk_window_get_state (gdk_window) & (GDK_WINDOW_STATE_ICONIFIED |
+                                                            GDK_WINDOW_STATE_WITHDRAWN));
+
+  if (visible && tick_source == 0) {
+    tick (pgui);
+  } else if (!visible && tick_source != 0) {
+    g_source_remove (tick_source);
+    tick_source = 0;
+  }
+}
+
+static void
+window_mapped (GtkWidget *widget,
+               gpointer   data)
+{
+  tick_update (data);
+}
+
+static gboolean
+window_state_changed (GtkWidget           *widget,
+                      GdkEventWindowState *event,
+                      gpointer             data)
+{
+  tick_update (data);
+
+  return FALSE;
 }
 
 const SecretSchema *gauthenticator_get_schema_password (void)
@@ -155,6 +440,22 @@ const SecretSchema *gauthenticator_get_schema_account (void)
     return &the_schema;
 }
 
+const SecretSchema *gauthenticator_get_schema_token (void)
+{
+    static const SecretSchema the_schema = {
+        "org.gauthenticator.Token", SECRET_SCHEMA_NONE,
+        {
+            {  "index", SECRET_SCHEMA_ATTRIBUTE_INTEGER },
+            {  "account", SECRET_SCHEMA_ATTRIBUTE_STRING },
+            {  "period", SECRET_SCHEMA_ATTRIBUTE_INTEGER },
+            {  "digits", SECRET_SCHEMA_ATTRIBUTE_INTEGER },
+            {  "migrated", SECRET_SCHEMA_ATTRIBUTE_INTEGER },
+            {  "NULL", 0 },
+        }
+    };
+    return &the_schema;
+}
+
 const SecretSchema *gauthenticator_get_schema_unlock (void)
 {
     static const SecretSchema the_schema = {
@@ -167,11 +468,151 @@ const SecretSchema *gauthenticator_get_schema_unlock (void)
     return &the_schema;
 }
 
+static gboolean
+account_matches (GtkTreeModel *model,
+                 GtkTreeIter  *iter,
+                 gpointer      data)
+{
+  guint slot;
+
+  gtk_tree_model_get (model, iter, COLUMN_SLOT, &slot, -1);
+  return search_index_matches (search_index, slot);
+}
+
+// Shows only the accounts whose name contains the text of the search entry.
+// Rows stay in the full store, in the order the accounts were created; a
+// new query only refilters them.
+static void
+filter_accounts (GUI *pgui)
+{
+  const gchar *query = gtk_entry_get_text (GTK_ENTRY (pgui->search_entry));
+
+  search_index_set_query (search_index, query);
+
+  if (*query == '\0') {
+    if (pgui->matches != NULL) {
+      gtk_tree_view_set_model (GTK_TREE_VIEW (pgui->tree_view), GTK_TREE_MODEL (pgui->store));
+      g_object_unref (pgui->matches);
+      pgui->matches = NULL;
+    }
+    return;
+  }
+
+  if (pgui->matches != NULL) {
+    gtk_tree_model_filter_refilter (GTK_TREE_MODEL_FILTER (pgui->matches));
+    return;
+  }
+  pgui->matches = gtk_tree_model_filter_new (GTK_TREE_MODEL (pgui->store), NULL);
+  gtk_tree_model_filter_set_visible_func (GTK_TREE_MODEL_FILTER (pgui->matches),
+                                          account_matches, NULL, NULL);
+  gtk_tree_view_set_model (GTK_TREE_VIEW (pgui->tree_view), pgui->matches);
+}
+
+static void
+search_changed (GtkSearchEntry *entry,
+                gpointer        data)
+{
+  filter_accounts (data);
+}
+
+static void
+add_account (GUI         *pgui,
+             const TOKEN *token)
+{
+  MYDATA *account;
+  guint slot;
+
+  if (free_slots->len > 0) {
+    slot = g_array_index (free_slots, guint, free_slots->len - 1);
+    g_array_set_size (free_slots, free_slots->len - 1);
+  } else {
+    slot = mydata->len;
+    g_array_set_size (mydata, mydata->len + 1);
+  }
+
+  account = account_at (slot);
+  account->id = token->index;
+  account->in_use = TRUE;
+  account->account = g_strdup (token->account);
+  account->invalid = token->invalid;
+  account->hmac_key = g_new0 (GAUTH_KEY, 1);
+  if (account->invalid == NULL && gauth_key_init (account->hmac_key, token->key) != 0) {
+    account->invalid = "secret";
+  }
+  account->key_valid = account->invalid == NULL;
+  // An account without codes still needs a step to show a row.
+  account->period = account->key_valid ? token->period : DEFAULT_PERIOD;
+  account->digits = account->key_valid ? token->digits : DEFAULT_DIGITS;
+  accounts_version++;
+
+  if (token->index >= next_account_id) {
+    next_account_id = token->index + 1;
+  }
+
+  // Indexed first, so an active search already knows whether the new row
+  // matches when the filter sees it.
+  search_index_add (search_index, slot, token->account);
+  gtk_list_store_insert_with_values (pgui->store, &account->row, -1,
+                                     COLUMN_SLOT, slot,
+                                     -1);
+}
+
+// Wipes the key material of an account that is going away.
+static void
+clear_account (MYDATA *account)
+{
+  if (account->hmac_key != NULL) {
+    gauth_key_clear (account->hmac_key);
+    g_free (account->hmac_key);
+    account->hmac_key = NULL;
+  }
+  account->key_valid = FALSE;
+  account->invalid = NULL;
+  account->in_use = FALSE;
+  g_free (account->account);
+  account->account = NULL;
+}
+
+static void
+key_stored (gpointer      result,
+            const GError *error,
+            gpointer      user_data)
+{
+  const char *what = user_data;
+
+  if (error != NULL) {
+#ifdef DEBUG
+g_printerr ("%s::ERROR %s storing the %s key.\n", __FUNCTION__, error->message, what);
+#endif // DEBUG
+  } else {
+#ifdef DEBUG
+g_print("%s::The %s key has been stored correctly.\n", __FUNCTION__, what);
+#endif // DEBUG
+  }
+}
+
+static void
+store_token (const TOKEN     *token,
+             KeyringCallback  callback,
+             gpointer         user_data)
+{
+  char buf[BUFFER_LEN];
+
+  snprintf (buf, BUFFER_LEN, "gauthenticator %s", token->account);
+  keyring_store (GAUTHENTICATOR_SCHEMA_TOKEN,
+                 secret_attributes_build (GAUTHENTICATOR_SCHEMA_TOKEN,
+                                          "index", token->index,
+                                          "account", token->account,
+                                          "period", token->period,
+                                          "digits", token->digits,
+                                          NULL),
+                 buf, token->key, callback, user_data);
+}
+
 static void
 new_account (GtkWidget *widget,
              gpointer   data)
 {
-  GtkWidget *btn;
   GtkWidget *wnd;
   GtkWidget *lbl_account;
   GtkWidget *entry_account;
@@ -180,17 +621,14 @@ new_account (GtkWidget *widget,
   GtkWidget *acc_grid;
   GtkWidget *box_dialog;
 
-  MYDATA *pdata = data;
-
-  if (mydata_index > (MAX_ACCOUNTS - 1)) {
-    char buf[BUFFER_LEN];
-    snprintf(buf, BUFFER_LEN, "The maximum number of accounts is %d", MAX_ACCOUNTS);
+  GUI *pgui = data;
 
-    gtk_statusbar_push(GTK_STATUSBAR(mydata->status_bar), 1, buf);
+  if (accounts_loading) {
+    show_status (pgui, "Accounts are still loading");
     return;
   }
 
-  wnd = gtk_dialog_new_with_buttons("Enter account data", GTK_WINDOW(mydata->window), GTK_DIALOG_MODAL, "OK", 1, "Cancel", 2, NULL);
+  wnd = gtk_dialog_new_with_buttons("Enter account data", GTK_WINDOW(pgui->window), GTK_DIALOG_MODAL, "OK", 1, "Cancel", 2, NULL);
   box_dialog = gtk_dialog_get_content_area(GTK_DIALOG(wnd));
   lbl_account = gtk_label_new ("Account name ");
   gtk_widget_show (lbl_account);
@@ -218,74 +656,26 @@ g_print ("%s::OK\n", __FUNCTION__);
 #endif // DEBUG
       ; // Compiler does not allow keyword const after #endif
       const gchar *entry_key_text = gtk_entry_get_text(GTK_ENTRY(entry_key));
-      strncpy(mydata[mydata_index].key_str, entry_key_text, KEY_STR_LEN + 1);
 #ifdef DEBUG
-g_print ("%s::mydata[%d].key_str %s\n", __FUNCTION__, mydata_index, mydata[mydata_index].key_str);
+g_print ("%s::key_str %s\n", __FUNCTION__, entry_key_text);
 #endif // DEBUG
       const gchar *entry_account_text = gtk_entry_get_text(GTK_ENTRY(entry_account));
 
-      GError *error_password = NULL;
-      GError *error_account = NULL;
-
-      /*
-       * The variable argument list is the attributes used to later
-       * lookup the password. These attributes must conform to the schema.
-       */
-      char buf[BUFFER_LEN];
-      snprintf (buf, BUFFER_LEN, "gauthenticator password index %d", mydata_index);
-      secret_password_store_sync (GAUTHENTICATOR_SCHEMA_PASSWORD, SECRET_COLLECTION_DEFAULT,
-                                  buf, entry_key_text, NULL, &error_password,
-                                  "index", mydata_index,
-                                  NULL);
-
-      if (error_password != NULL) {
-#ifdef DEBUG
-g_printerr ("%s::ERROR %s storing the password key.\n", __FUNCTION__, error_password->message);
-#endif // DEBUG
-          g_error_free (error_password);
-      } else {
-#ifdef DEBUG
-g_print("%s::The password key has been stored correctly.\n", __FUNCTION__);
-#endif // DEBUG
-      }
-      snprintf (buf, BUFFER_LEN, "gauthenticator account index %d", mydata_index);
-
-      secret_password_store_sync (GAUTHENTICATOR_SCHEMA_ACCOUNT, SECRET_COLLECTION_DEFAULT,
-                                  buf, entry_account_text, NULL, &error_account,
-                                  "index", mydata_index,
-                                  NULL);
-
-      if (error_account != NULL) {
-#ifdef DEBUG
-g_printerr ("%s::ERROR %s storing the account key.\n", __FUNCTION__, error_account->message);
-#endif // DEBUG
-          g_error_free (error_account);
-      } else {
-#ifdef DEBUG
-g_print("%s::The account key has been stored correctly.\n", __FUNCTION__);
-#endif // DEBUG
-      }
-
-      btn = gtk_button_new_with_label (entry_account_text);
-      gtk_widget_show (btn);
+      TOKEN token = {
+        .index = next_account_id,
+        .account = (gchar *) entry_account_text,
+        .key = (gchar *) entry_key_text,
+        .period = DEFAULT_PERIOD,
+        .digits = DEFAULT_DIGITS,
+      };
 
-      mydata[mydata_index].window = pdata->window;
-      mydata[mydata_index].box_scrolled = pdata->box_scrolled;
-      mydata[mydata_index].status_bar = pdata->status_bar;
+      // The keyring worker stores it in the background.
+      store_token (&token, key_stored, "token");
+      add_account (pgui, &token);
 
       char buf1[BUFFER_LEN];
       snprintf(buf1, BUFFER_LEN, "Added account %s", entry_account_text);
-      gtk_statusbar_push(GTK_STATUSBAR(mydata->status_bar), 1, buf1);
-
-      g_signal_connect (btn, "clicked", G_CALLBACK (calculate_code), &mydata[mydata_index]);
-
-      mydata_index += 1;
-
-      gtk_widget_set_hexpand (btn, TRUE);
-      gtk_widget_set_halign (btn, GTK_ALIGN_FILL);
-      gtk_widget_set_vexpand (btn, TRUE);
-      gtk_widget_set_valign (btn, GTK_ALIGN_FILL);
-      gtk_box_pack_start(GTK_BOX(mydata->box_scrolled), btn, TRUE, TRUE, 5);
+      show_status (pgui, buf1);
 
       break;
 
@@ -299,26 +689,559 @@ g_print ("%s::Cancel\n", __FUNCTION__);
   gtk_widget_destroy(wnd);
 }
 
+static void
+token_removed (gpointer      result,
+               const GError *error,
+               gpointer      user_data)
+{
+  if (error != NULL) {
+#ifdef DEBUG
+g_printerr ("%s::ERROR %s removing token %d.\n", __FUNCTION__, error->message, GPOINTER_TO_INT (user_data));
+#endif // DEBUG
+  }
+}
+
+static void
+remove_account (GtkWidget *widget,
+                gpointer   data)
+{
+  GtkWidget *dialog;
+  GtkTreeModel *model;
+  GtkTreeIter iter;
+  guint slot;
+  int reply;
+  char buf[BUFFER_LEN];
+
+  GUI *pgui = data;
+
+  if (accounts_loading) {
+    show_status (pgui, "Accounts are still loading");
+    return;
+  }
+
+  if (!gtk_tree_selection_get_selected (gtk_tree_view_get_selection (GTK_TREE_VIEW (pgui->tree_view)),
+                                        &model, &iter)) {
+    show_status (pgui, "Select the account to remove");
+    return;
+  }
+  gtk_tree_model_get (model, &iter, COLUMN_SLOT, &slot, -1);
+
+  MYDATA *account = account_at (slot);
+
+  dialog = gtk_message_dialog_new (GTK_WINDOW (pgui->window), GTK_DIALOG_MODAL,
+                                   GTK_MESSAGE_QUESTION, GTK_BUTTONS_YES_NO,
+                                   "Remove the account %s?", account->account);
+  reply = gtk_dialog_run (GTK_DIALOG (dialog));
+  gtk_widget_destroy (dialog);
+  if (reply != GTK_RESPONSE_YES) {
+    return;
+  }
+
+  // Only the keyring item of this account is touched; other ids stay as they are.
+  keyring_clear (GAUTHENTICATOR_SCHEMA_TOKEN,
+                 secret_attributes_build (GAUTHENTICATOR_SCHEMA_TOKEN, "index", account->id, NULL),
+                 token_removed, GINT_TO_POINTER (account->id));
+
+  snprintf (buf, BUFFER_LEN, "Removed account %s", account->account);
+
+  // List store iters persist, so the row in the full list needs no lookup.
+  // The filter drops its own row along with it.
+  gtk_list_store_remove (pgui->store, &account->row);
+  search_index_remove (search_index, slot);
+
+  clear_account (account);
+  g_array_append_val (free_slots, slot);
+  accounts_version++;
+
+  show_status (pgui, buf);
+}
+
 static void
 clipboard_clicked (GtkWidget *widget,
                    gpointer   data)
 {
-  unsigned long tm;
-  int step_size = 30;
   char buf[BUFFER_LEN];
   GtkClipboard *clipboard;
+  int code;
 
-  MYDATA *mydata2 = data;
+  if (selected_account < 0) {
+    return;
+  }
+
+  code = code_table_lookup(selected_account, time(NULL));
+  if (code < 0) {
+    return;
+  }
 
 #ifdef DEBUG
-g_print ("%s::code:%d\n", __FUNCTION__, correct_code);
+g_print ("%s::code:%d\n", __FUNCTION__, code);
 #endif // DEBUG
-  snprintf(buf, BUFFER_LEN, "%06d", correct_code);
+  snprintf(buf, BUFFER_LEN, "%0*d", account_at (selected_account)->digits, code);
   clipboard = gtk_clipboard_get (GDK_SELECTION_CLIPBOARD);
   gtk_clipboard_set_text (clipboard, buf, -1);
 
 }
 
+// Answers --code, --copy or --all from another instance with the codes
+// already in memory. Accounts are looked up in list order, so with duplicate
+// names the one created first wins, as in print_codes().
+static void
+answer_command (GApplicationCommandLine *cmdline)
+{
+  GVariantDict *options = g_application_command_line_get_options_dict (cmdline);
+  GtkTreeModel *model = GTK_TREE_MODEL (gui.store);
+  const gchar *name = NULL;
+  gboolean copy = g_variant_dict_lookup (options, "copy", "&s", &name);
+  gboolean found = FALSE;
+  time_t now = time (NULL);
+  GtkTreeIter iter;
+  gboolean valid;
+
+  if (!copy) {
+    g_variant_dict_lookup (options, "code", "&s", &name);
+  }
+
+  for (valid = gtk_tree_model_get_iter_first (model, &iter); valid;
+       valid = gtk_tree_model_iter_next (model, &iter)) {
+    char buf[BUFFER_LEN];
+    MYDATA *account;
+    guint slot;
+    int code;
+
+    gtk_tree_model_get (model, &iter, COLUMN_SLOT, &slot, -1);
+    account = account_at (slot);
+    if (name != NULL && strcmp (account->account, name) != 0) {
+      continue;
+    }
+
+    found = TRUE;
+    code = code_table_lookup (slot, now);
+    if (code < 0) {
+      g_application_command_line_printerr (cmdline, "gauthenticator: invalid %s for %s\n",
+                                           account->invalid, account->account);
+      g_application_command_line_set_exit_status (cmdline, EXIT_FAILURE);
+    } else if (copy) {
+      snprintf (buf, BUFFER_LEN, "%0*d", account->digits, code);
+      gtk_clipboard_set_text (gtk_clipboard_get (GDK_SELECTION_CLIPBOARD), buf, -1);
+    } else if (name != NULL) {
+      g_application_command_line_print (cmdline, "%0*d\n", account->digits, code);
+    } else {
+      g_application_command_line_print (cmdline, "%0*d  %s\n", account->digits, code,
+                                        account->account);
+    }
+
+    if (name != NULL) {
+      break;
+    }
+  }
+
+  if (!found) {
+    if (name != NULL) {
+      g_application_command_line_printerr (cmdline, "gauthenticator: no account named %s\n", name);
+    } else {
+      g_application_command_line_printerr (cmdline, "gauthenticator: no accounts\n");
+    }
+    g_application_command_line_set_exit_status (cmdline, EXIT_FAILURE);
+  }
+}
+
+static gint
+keyring_item_int (SecretItem  *item,
+                  const gchar *name,
+                  gint         fallback)
+{
+  GHashTable *attributes = secret_item_get_attributes (item);
+  const gchar *value = g_hash_table_lookup (attributes, name);
+  gint number = value ? (gint) g_ascii_strtoll (value, NULL, 10) : fallback;
+
+  g_hash_table_unref (attributes);
+  return number;
+}
+
+static gchar *
+keyring_item_secret (SecretItem *item)
+{
+  SecretValue *value = secret_item_get_secret (item);
+  gchar *secret = NULL;
+
+  if (value != NULL) {
+    secret = g_strdup (secret_value_get_text (value));
+    secret_value_unref (value);
+  }
+
+  return secret;
+}
+
+static void
+token_free (gpointer data)
+{
+  TOKEN *token = data;
+
+  g_free (token->account);
+  if (token->key != NULL) {
+    secret_password_free (token->key);
+  }
+  g_free (token);
+}
+
+// The token stored in an item of the token schema, or NULL if the item
+// lacks its account name or secret. A period or code length out of range
+// is named in the invalid field of the token.
+static TOKEN *
+token_from_item (SecretItem *item)
+{
+  GHashTable *attributes = secret_item_get_attributes (item);
+  const gchar *account = g_hash_table_lookup (attributes, "account");
+  gchar *key = keyring_item_secret (item);
+  TOKEN *token = NULL;
+
+  if (account != NULL && key != NULL) {
+    token = g_new0 (TOKEN, 1);
+    token->index = keyring_item_int (item, "index", -1);
+    token->account = g_strdup (account);
+    token->key = g_steal_pointer (&key);
+    token->period = keyring_item_int (item, "period", DEFAULT_PERIOD);
+    token->digits = keyring_item_int (item, "digits", DEFAULT_DIGITS);
+    if (token->period < 1 || token->period > MAX_PERIOD) {
+      token->invalid = "period";
+    } else if (token->digits < GAUTH_MIN_DIGITS || token->digits > GAUTH_MAX_DIGITS) {
+      token->invalid = "digits";
+    }
+  }
+
+  if (key != NULL) {
+    secret_password_free (key);
+  }
+  g_hash_table_unref (attributes);
+
+  return token;
+}
+
+static gint
+compare_token_index (gconstpointer a,
+                     gconstpointer b)
+{
+  return (*(TOKEN **) a)->index - (*(TOKEN **) b)->index;
+}
+
+static void
+loader_free (LOADER *loader)
+{
+  g_ptr_array_unref (loader->tokens);
+  g_list_free_full (loader->passwords, g_object_unref);
+  g_list_free_full (loader->accounts, g_object_unref);
+  g_free (loader);
+}
+
+static gboolean
+load_accounts_batch (gpointer user_data)
+{
+  LOADER *loader = user_data;
+
+  for (int n = 0; n < LOAD_BATCH && loader->next < loader->tokens->len; n++) {
+    TOKEN *token = g_ptr_array_index (loader->tokens, loader->next++);
+
+#ifdef DEBUG
+g_print("%s::Found password %s from account %s index %d \n", __FUNCTION__, token->key, token->account, token->index);
+#endif // DEBUG
+    add_account (loader->pgui, token);
+  }
+
+  if (loader->next < loader->tokens->len) {
+    return G_SOURCE_CONTINUE;
+  }
+
+  show_status (loader->pgui, "Ready");
+  accounts_loading = FALSE;
+  while (!g_queue_is_empty (&pending_commands)) {
+    GApplicationCommandLine *cmdline = g_queue_pop_head (&pending_commands);
+
+    answer_command (cmdline);
+    g_object_unref (cmdline);
+  }
+  loader_free (loader);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+load_accounts_start (LOADER *loader)
+{
+  // Keep the order in which the accounts were created.
+  g_ptr_array_sort (loader->tokens, compare_token_index);
+  loader->next = 0;
+
+  g_idle_add (load_accounts_batch, loader);
+}
+
+/*
+ * Once every old item is migrated and cleared, a token item with only the
+ * "migrated" attribute tells later starts not to search the old schemas.
+ * It has no account name, so it is never loaded as an account.
+ */
+static void
+migration_step_done (void)
+{
+  if (--migration_pending > 0 || migration_failed) {
+    return;
+  }
+
+  keyring_store (GAUTHENTICATOR_SCHEMA_TOKEN,
+                 secret_attributes_build (GAUTHENTICATOR_SCHEMA_TOKEN, "migrated", 1, NULL),
+                 "gauthenticator migration", "1", key_stored, "migration");
+}
+
+static void
+old_item_cleared (gpointer      result,
+                  const GError *error,
+                  gpointer      user_data)
+{
+  if (error != NULL) {
+    migration_failed = TRUE;
+  }
+  migration_step_done ();
+}
+
+static void
+token_migrated (gpointer      result,
+                const GError *error,
+                gpointer      user_data)
+{
+  gint index = GPOINTER_TO_INT (user_data);
+
+  // Only drop the old items once the new one is safely stored.
+  if (error != NULL) {
+    key_stored (result, error, "token");
+    migration_failed = TRUE;
+    migration_step_done ();
+    return;
+  }
+
+  migration_pending += 2;
+  keyring_clear (GAUTHENTICATOR_SCHEMA_PASSWORD,
+                 secret_attributes_build (GAUTHENTICATOR_SCHEMA_PASSWORD, "index", index, NULL),
+                 old_item_cleared, NULL);
+  keyring_clear (GAUTHENTICATOR_SCHEMA_ACCOUNT,
+                 secret_attributes_build (GAUTHENTICATOR_SCHEMA_ACCOUNT, "index", index, NULL),
+                 old_item_cleared, NULL);
+  migration_step_done ();
+}
+
+/*
+ * Versions up to 0.4 stored every account as two items, the key under
+ * GAUTHENTICATOR_SCHEMA_PASSWORD and the name under
+ * GAUTHENTICATOR_SCHEMA_ACCOUNT. Pair them by index, store each pair as a
+ * single GAUTHENTICATOR_SCHEMA_TOKEN item and clear the old ones. A pair
+ * whose token was stored by an earlier, interrupted migration is only
+ * cleared. The migration is recorded as done once everything was stored
+ * and cleared; a key without a name is lost either way and does not hold
+ * that back.
+ */
+static void
+migrate_accounts (LOADER *loader)
+{
+  GHashTable *names = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+  GHashTable *migrated = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  // Held until every store below is queued.
+  migration_pending = 1;
+  migration_failed = loader->failed;
+
+  for (guint i = 0; i < loader->tokens->len; i++) {
+    TOKEN *token = g_ptr_array_index (loader->tokens, i);
+
+    g_hash_table_add (migrated, GINT_TO_POINTER (token->index));
+  }
+
+  for (GList *l = loader->accounts; l != NULL; l = l->next) {
+    gchar *account = keyring_item_secret (l->data);
+
+    if (account != NULL) {
+      g_hash_table_insert (names, GINT_TO_POINTER (keyring_item_int (l->data, "index", -1)),
+                           account);
+    }
+  }
+
+  for (GList *l = loader->passwords; l != NULL; l = l->next) {
+    gint index = keyring_item_int (l->data, "index", -1);
+    const gchar *account = g_hash_table_lookup (names, GINT_TO_POINTER (index));
+    gchar *key;
+
+    if (g_hash_table_contains (migrated, GINT_TO_POINTER (index))) {
+      migration_pending++;
+      token_migrated (NULL, NULL, GINT_TO_POINTER (index));
+      continue;
+    }
+
+    key = keyring_item_secret (l->data);
+    if (key == NULL) {
+#ifdef DEBUG
+g_printerr ("%s::ERROR reading key %d from password\n", __FUNCTION__, index);
+#endif // DEBUG
+      migration_failed = TRUE;
+      continue;
+    }
+
+    if (account == NULL) {
+#ifdef DEBUG
+g_print("%s::Found password %s but not account.\n", __FUNCTION__, key);
+#endif // DEBUG
+      secret_password_free (key);
+      continue;
+    }
+
+    TOKEN *token = g_new0 (TOKEN, 1);
+    token->index = index;
+    token->account = g_strdup (account);
+    token->key = key;
+    token->period = DEFAULT_PERIOD;
+    token->digits = DEFAULT_DIGITS;
+    g_ptr_array_add (loader->tokens, token);
+
+    migration_pending++;
+    store_token (token, token_migrated, GINT_TO_POINTER (index));
+  }
+
+  g_hash_table_unref (migrated);
+  g_hash_table_unref (names);
+  g_list_free_full (loader->passwords, g_object_unref);
+  g_list_free_full (loader->accounts, g_object_unref);
+  loader->passwords = NULL;
+  loader->accounts = NULL;
+  migration_step_done ();
+}
+
+static void
+keyring_search_error (const GError *error)
+{
+  if (error != NULL) {
+#ifdef DEBUG
+g_printerr ("%s::ERROR %s searching accounts\n", __FUNCTION__, error->message);
+#endif // DEBUG
+  }
+}
+
+static void
+passwords_searched (gpointer      result,
+                    const GError *error,
+                    gpointer      user_data)
+{
+  LOADER *loader = user_data;
+
+  keyring_search_error (error);
+  loader->passwords = result;
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+    loader->cancelled = TRUE;
+  } else if (error != NULL) {
+    loader->failed = TRUE;
+  }
+  if (--loader->pending == 0) {
+    if (loader->cancelled) {
+      loader_free (loader);
+      return;
+    }
+    migrate_accounts (loader);
+    load_accounts_start (loader);
+  }
+}
+
+static void
+accounts_searched (gpointer      result,
+                   const GError *error,
+                   gpointer      user_data)
+{
+  LOADER *loader = user_data;
+
+  keyring_search_error (error);
+  loader->accounts = result;
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+    loader->cancelled = TRUE;
+  } else if (error != NULL) {
+    loader->failed = TRUE;
+  }
+  if (--loader->pending == 0) {
+    if (loader->cancelled) {
+      loader_free (loader);
+      return;
+    }
+    migrate_accounts (loader);
+    load_accounts_start (loader);
+  }
+}
+
+static void
+keyring_search_all (const SecretSchema *schema,
+                    KeyringCallback     callback,
+                    gpointer            user_data)
+{
+  /*
+   * An empty attribute table matches every item of the schema. The flags
+   * unlock the collection once and fetch all secrets in a single round trip.
+   */
+  keyring_search (schema, g_hash_table_new (g_str_hash, g_str_equal),
+                  SECRET_SEARCH_ALL | SECRET_SEARCH_UNLOCK | SECRET_SEARCH_LOAD_SECRETS,
+                  callback, user_data);
+}
+
+static void
+tokens_searched (gpointer      result,
+                 const GError *error,
+                 gpointer      user_data)
+{
+  LOADER *loader = user_data;
+  GList *items = result;
+  gboolean migrated = FALSE;
+
+  keyring_search_error (error);
+
+  // The application is going away, there is nothing to load into.
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+    loader_free (loader);
+    return;
+  }
+
+  for (GList *l = items; l != NULL; l = l->next) {
+    TOKEN *token = token_from_item (l->data);
+
+    if (token != NULL) {
+      g_ptr_array_add (loader->tokens, token);
+    } else if (keyring_item_int (l->data, "migrated", 0)) {
+      migrated = TRUE;
+    }
+  }
+
+  /*
+   * A migration that failed or was cut short leaves old items next to the
+   * tokens, so the old schemas are searched until one finishes. After a
+   * failed search of the tokens nothing is migrated, or tokens would be
+   * stored twice.
+   */
+  if (error == NULL && !migrated) {
+    loader->pending = 2;
+    keyring_search_all (GAUTHENTICATOR_SCHEMA_PASSWORD, passwords_searched, loader);
+    keyring_search_all (GAUTHENTICATOR_SCHEMA_ACCOUNT, accounts_searched, loader);
+  } else {
+    load_accounts_start (loader);
+  }
+
+  g_list_free_full (items, g_object_unref);
+}
+
+static void
+load_accounts (GUI *pgui)
+{
+  LOADER *loader = g_new0 (LOADER, 1);
+
+  loader->pgui = pgui;
+  loader->tokens = g_ptr_array_new_with_free_func (token_free);
+
+  // Shown until the last batch of rows has been added.
+  show_status (pgui, "Loading accounts...");
+  accounts_loading = TRUE;
+
+  keyring_search_all (GAUTHENTICATOR_SCHEMA_TOKEN, tokens_searched, loader);
+}
+
 static void
 activate (GtkApplication *app,
           gpointer        user_data)
@@ -340,9 +1263,18 @@ activate (GtkApplication *app,
   GtkWidget *icon_copy;
   GtkToolItem *tool_item_copy;
   GtkWidget *status_bar;
+  GtkWidget *search_entry;
   GtkWidget *scrolled_window;
-  GtkWidget *view_port;
-  GtkWidget *box_scrolled;
+  GtkWidget *tree_view;
+  GtkListStore *store;
+  GtkTreeViewColumn *column;
+  GtkCellRenderer *renderer;
+
+  // Launching gauthenticator again only raises the window.
+  if (gui.window != NULL) {
+    gtk_window_present (GTK_WINDOW (gui.window));
+    return;
+  }
 
   //*************************************************************************************
   // Add application_window
@@ -413,6 +1345,19 @@ activate (GtkApplication *app,
   gtk_box_pack_start(GTK_BOX(main_box), toolbar, FALSE, TRUE, 0);
   //*************************************************************************************
 
+  //*************************************************************************************
+  // Add search entry
+  //*************************************************************************************
+  search_entry = gtk_search_entry_new();
+  gtk_entry_set_placeholder_text (GTK_ENTRY (search_entry), "Search accounts");
+  gtk_widget_set_hexpand (search_entry, TRUE);
+  gtk_widget_set_halign (search_entry, GTK_ALIGN_FILL);
+  gtk_widget_set_vexpand (search_entry, FALSE);
+  gtk_widget_set_valign (search_entry, GTK_ALIGN_START);
+
+  gtk_box_pack_start(GTK_BOX(main_box), search_entry, FALSE, TRUE, 0);
+  //*************************************************************************************
+
   //*************************************************************************************
   // Add scrolled window
   //*************************************************************************************
@@ -426,12 +1371,26 @@ activate (GtkApplication *app,
   //*************************************************************************************
 
   //*************************************************************************************
-  // Add box_scrolled to view port
+  // Add the account list to the scrolled window
   //*************************************************************************************
-  box_scrolled = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
-
-  // We can ignore the presence of viewport
-  gtk_container_add (GTK_CONTAINER (scrolled_window), box_scrolled);
+  store = gtk_list_store_new (N_COLUMNS, G_TYPE_UINT);
+  tree_view = gtk_tree_view_new_with_model (GTK_TREE_MODEL (store));
+  g_object_unref (store);
+  gtk_tree_view_set_headers_visible (GTK_TREE_VIEW (tree_view), FALSE);
+  gtk_tree_view_set_enable_search (GTK_TREE_VIEW (tree_view), FALSE);
+
+  renderer = gtk_cell_renderer_text_new ();
+  column = gtk_tree_view_column_new ();
+  gtk_tree_view_column_set_sizing (column, GTK_TREE_VIEW_COLUMN_FIXED);
+  gtk_tree_view_column_pack_start (column, renderer, TRUE);
+  gtk_tree_view_column_set_cell_data_func (column, renderer, account_cell_data, NULL, NULL);
+  gtk_tree_view_append_column (GTK_TREE_VIEW (tree_view), column);
+
+  // All rows have the height of the first, so the view never measures the
+  // others and only renders the visible ones.
+  gtk_tree_view_set_fixed_height_mode (GTK_TREE_VIEW (tree_view), TRUE);
+
+  gtk_container_add (GTK_CONTAINER (scrolled_window), tree_view);
   //*************************************************************************************
 
   //*************************************************************************************
@@ -447,13 +1406,24 @@ activate (GtkApplication *app,
   gtk_box_pack_start(GTK_BOX(main_box), status_bar, FALSE, TRUE, 0);
   //*************************************************************************************
 
-  mydata2[0].window = window;
-  mydata2[0].box_scrolled = box_scrolled;
-  mydata2[0].status_bar = status_bar;
-
-  g_signal_connect (submenu_Options, "activate", G_CALLBACK(new_account), &mydata2);
-  g_signal_connect (tool_item_copy, "clicked", G_CALLBACK(clipboard_clicked), &mydata2);
-  g_signal_connect (tool_item_add, "clicked", G_CALLBACK(new_account), &mydata2);
+  gui.window = window;
+  gui.search_entry = search_entry;
+  gui.tree_view = tree_view;
+  gui.store = store;
+  gui.status_bar = status_bar;
+
+  // One timer for all accounts, paused while the window is hidden or minimized.
+  g_signal_connect (window, "map", G_CALLBACK (window_mapped), &gui);
+  g_signal_connect (window, "unmap", G_CALLBACK (window_mapped), &gui);
+  g_signal_connect (window, "window-state-event", G_CALLBACK (window_state_changed), &gui);
+
+  g_signal_connect (gtk_tree_view_get_selection (GTK_TREE_VIEW (tree_view)), "changed",
+                    G_CALLBACK (account_selected), &gui);
+  g_signal_connect (search_entry, "search-changed", G_CALLBACK (search_changed), &gui);
+  g_signal_connect (submenu_Options, "activate", G_CALLBACK(new_account), &gui);
+  g_signal_connect (tool_item_copy, "clicked", G_CALLBACK(clipboard_clicked), &gui);
+  g_signal_connect (tool_item_add, "clicked", G_CALLBACK(new_account), &gui);
+  g_signal_connect (tool_item_remove, "clicked", G_CALLBACK(remove_account), &gui);
 
   clipboard = gtk_clipboard_get (GDK_SELECTION_CLIPBOARD);
   gtk_clipboard_set_can_store (clipboard, NULL, 0);
@@ -461,86 +1431,211 @@ activate (GtkApplication *app,
   //*************************************************************************************
   // Read accounts and their key
   //*************************************************************************************
-  for (int i = 0; i < MAX_ACCOUNTS; i++) {
+  load_accounts (&gui);
+  //*************************************************************************************
 
-    GError *error_password = NULL;
+  gtk_widget_show_all (window);
+}
 
-    /* The attributes used to lookup the password should conform to the schema. */
-    gchar *password = secret_password_lookup_sync (GAUTHENTICATOR_SCHEMA_PASSWORD, NULL, &error_password,
-                                                   "index", i,
-                                                   NULL);
-    if (error_password != NULL) {
-        /* ... handle the failure here */
-#ifdef DEBUG
-g_printerr ("%s::ERROR %s reading key %d from password\n", __FUNCTION__, error_password, i);
-#endif // DEBUG
-        g_error_free (error_password);
-    } else if (password == NULL) {
-        /* password will be null, if no matching password found */
-#ifdef DEBUG
-//g_printerr("%s::password %d null\n", __FUNCTION__, i);
-#endif // DEBUG
-    } else {
-        /* ... do something with the password */
-        GError *error_account = NULL;
+static void
+app_shutdown (GApplication *app,
+              gpointer      user_data)
+{
+  while (!g_queue_is_empty (&pending_commands)) {
+    GApplicationCommandLine *cmdline = g_queue_pop_head (&pending_commands);
 
-        gchar *account = secret_password_lookup_sync (GAUTHENTICATOR_SCHEMA_ACCOUNT, NULL, &error_account,
-                                                       "index", i,
-                                                       NULL);
-        if (error_account != NULL) {
-#ifdef DEBUG
-g_printerr ("ERROR %s reading key %d from account\n", error_account, i);
-#endif // DEBUG
-            g_error_free (error_account);
-        } else if (account == NULL) {
-#ifdef DEBUG
-g_print("%s::Found password %s but not account.\n", __FUNCTION__, password);
-#endif // DEBUG
-        } else {
-#ifdef DEBUG
-g_print("%s::Found password %s from account %s index %d \n", __FUNCTION__, password, account, i);
-#endif // DEBUG
-            GtkWidget *btn = gtk_button_new_with_label (account);
+    g_application_command_line_printerr (cmdline, "gauthenticator: closed while loading accounts\n");
+    g_application_command_line_set_exit_status (cmdline, EXIT_FAILURE);
+    g_object_unref (cmdline);
+  }
+
+  for (unsigned int i = 0; i < mydata->len; i++) {
+    clear_account (account_at (i));
+  }
+}
+
+// Prints the current code of the account called name, or of every account
+// if name is NULL, straight from the keyring. Nothing of GTK is set up, so
+// this works without a display. Returns the exit status.
+static int
+print_codes (const gchar *name)
+{
+  GHashTable *attributes;
+  GPtrArray *tokens;
+  GList *items;
+  GError *error = NULL;
+  time_t now = time (NULL);
+  int status = EXIT_SUCCESS;
+
+  if (name != NULL) {
+    attributes = secret_attributes_build (GAUTHENTICATOR_SCHEMA_TOKEN,
+                                          "account", name, NULL);
+  } else {
+    attributes = g_hash_table_new (g_str_hash, g_str_equal);
+  }
 
-            strncpy(mydata[mydata_index].key_str, password, KEY_STR_LEN + 1);
-            mydata[mydata_index].window = window;
-            mydata[mydata_index].box_scrolled = box_scrolled;
-            mydata[mydata_index].status_bar = status_bar;
+  // One round trip fetches the matching items together with their secrets.
+  items = secret_service_search_sync (NULL, GAUTHENTICATOR_SCHEMA_TOKEN, attributes,
+                                      SECRET_SEARCH_ALL | SECRET_SEARCH_UNLOCK | SECRET_SEARCH_LOAD_SECRETS,
+                                      NULL, &error);
+  g_hash_table_unref (attributes);
 
-            g_signal_connect (btn, "clicked", G_CALLBACK (calculate_code), &mydata[mydata_index]);
+  if (error != NULL) {
+    fprintf (stderr, "gauthenticator: %s\n", error->message);
+    g_error_free (error);
+    return EXIT_FAILURE;
+  }
 
-            gtk_widget_set_hexpand (btn, TRUE);
-            gtk_widget_set_halign (btn, GTK_ALIGN_FILL);
-            gtk_widget_set_vexpand (btn, TRUE);
-            gtk_widget_set_valign (btn, GTK_ALIGN_FILL);
+  tokens = g_ptr_array_new_with_free_func (token_free);
+  for (GList *l = items; l != NULL; l = l->next) {
+    TOKEN *token = token_from_item (l->data);
 
-            gtk_box_pack_start(GTK_BOX(box_scrolled), btn, TRUE, TRUE, 5);
+    if (token != NULL) {
+      g_ptr_array_add (tokens, token);
+    }
+  }
+  g_list_free_full (items, g_object_unref);
+  g_ptr_array_sort (tokens, compare_token_index);
+
+  if (tokens->len == 0) {
+    if (name != NULL) {
+      fprintf (stderr, "gauthenticator: no account named %s\n", name);
+    } else {
+      fprintf (stderr, "gauthenticator: no accounts\n");
+    }
+    status = EXIT_FAILURE;
+  }
 
-            mydata_index += 1;
+  // With duplicate names, the account created first wins.
+  for (guint i = 0; i < tokens->len && (name == NULL || i == 0); i++) {
+    TOKEN *token = g_ptr_array_index (tokens, i);
+    const gchar *invalid = token->invalid;
+    GAUTH_KEY key;
+    int code = -1;
+
+    if (invalid == NULL && gauth_key_init (&key, token->key) == 0) {
+      code = gauth_totp (&key, now, token->period, token->digits);
+      gauth_key_clear (&key);
+    } else if (invalid == NULL) {
+      invalid = "secret";
+    }
 
-            secret_password_free (account);
-        }
-        secret_password_free (password);
+    if (code < 0) {
+      fprintf (stderr, "gauthenticator: invalid %s for %s\n", invalid, token->account);
+      status = EXIT_FAILURE;
+    } else if (name != NULL) {
+      printf ("%0*d\n", token->digits, code);
+    } else {
+      printf ("%0*d  %s\n", token->digits, code, token->account);
     }
   }
-  //*************************************************************************************
 
-  gtk_widget_show_all (window);
+  g_ptr_array_unref (tokens);
+
+  return status;
+}
+
+static gboolean
+has_command (GVariantDict *options)
+{
+  return g_variant_dict_contains (options, "code") ||
+         g_variant_dict_contains (options, "copy") ||
+         g_variant_dict_contains (options, "all");
+}
+
+// Runs in the launching process, before GTK is started.
+static gint
+handle_local_options (GApplication *app,
+                      GVariantDict *options,
+                      gpointer      user_data)
+{
+  GApplication *probe;
+  const gchar *name = NULL;
+  gboolean remote;
+
+  if (!has_command (options)) {
+    return -1;
+  }
+
+  /*
+   * Registering the GtkApplication as primary instance would start GTK. A
+   * plain GApplication with the same id tells whether another instance is
+   * running without doing so. If one is, the command line goes to it and is
+   * answered from the accounts it already holds.
+   *
+   * Otherwise the probe became the primary instance. It is dropped, which
+   * releases the name, before the keyring is read: a launch meanwhile
+   * would send its activation to the probe and wait for it forever.
+   */
+  probe = g_application_new (g_application_get_application_id (app), G_APPLICATION_FLAGS_NONE);
+  remote = g_application_register (probe, NULL, NULL) && g_application_get_is_remote (probe);
+  g_object_unref (probe);
+  if (remote) {
+    return -1;
+  }
+
+  if (g_variant_dict_lookup (options, "copy", "&s", &name)) {
+    fprintf (stderr, "gauthenticator: --copy needs a running gauthenticator\n");
+    return EXIT_FAILURE;
+  }
+  g_variant_dict_lookup (options, "code", "&s", &name);
+
+  return print_codes (name);
+}
+
+// Runs in the primary instance for every launch, local or remote.
+static int
+command_line (GApplication            *app,
+              GApplicationCommandLine *cmdline,
+              gpointer                 user_data)
+{
+  if (!has_command (g_application_command_line_get_options_dict (cmdline))) {
+    g_application_activate (app);
+    return EXIT_SUCCESS;
+  }
+
+  // The accounts are loaded along with the window.
+  if (gui.window == NULL) {
+    g_application_activate (app);
+  }
+
+  if (accounts_loading) {
+    g_queue_push_tail (&pending_commands, g_object_ref (cmdline));
+  } else {
+    answer_command (cmdline);
+  }
+
+  return g_application_command_line_get_exit_status (cmdline);
 }
 
 int main(int argc, char *argv[]) {
-  int step_size = 0;
-  char *secret;
-  unsigned long counter;
-  unsigned long tm;
-  int correct_code;
   GtkApplication *app;
   int status;
-
-  app = gtk_application_new ("org.gtk.gauthenticator", G_APPLICATION_FLAGS_NONE);
+  const GOptionEntry entries[] = {
+    { "code", 'c', 0, G_OPTION_ARG_STRING, NULL,
+      "Print the current code of account NAME and exit", "NAME" },
+    { "copy", 0, 0, G_OPTION_ARG_STRING, NULL,
+      "Copy the current code of account NAME in the running instance", "NAME" },
+    { "all", 'a', 0, G_OPTION_ARG_NONE, NULL,
+      "Print the current code of every account and exit", NULL },
+    { NULL }
+  };
+
+  mydata = g_array_new (FALSE, TRUE, sizeof (MYDATA));
+  free_slots = g_array_new (FALSE, FALSE, sizeof (guint));
+  search_index = search_index_new ();
+
+  app = gtk_application_new ("org.gtk.gauthenticator", G_APPLICATION_HANDLES_COMMAND_LINE);
+  g_application_add_main_option_entries (G_APPLICATION (app), entries);
+  g_signal_connect (app, "handle-local-options", G_CALLBACK (handle_local_options), NULL);
+  g_signal_connect (app, "command-line", G_CALLBACK (command_line), NULL);
   g_signal_connect (app, "activate", G_CALLBACK (activate), NULL);
+  g_signal_connect (app, "shutdown", G_CALLBACK (app_shutdown), NULL);
   status = g_application_run (G_APPLICATION (app), argc, argv);
   g_object_unref (app);
 
+  // Let pending stores reach the keyring before exiting.
+  keyring_shutdown ();
+
   return status;
 }
@@ -11,3 +11,7 @@ const SecretSchema * gauthenticator_get_schema_account (void) G_GNUC_CONST;
 const SecretSchema * gauthenticator_get_schema_unlock (void) G_GNUC_CONST;
 
 #define GAUTHENTICATOR_SCHEMA_UNLOCK  gauthenticator_get_schema_unlock ()
+
+const SecretSchema * gauthenticator_get_schema_token (void) G_GNUC_CONST;
+
+#define GAUTHENTICATOR_SCHEMA_TOKEN  gauthenticator_get_schema_token ()
@@ -0,0 +1,921 @@
+// TOTP verification daemon
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Verifies codes for other processes over a Unix socket (see gauthd.h for
+// the protocol). Every worker thread runs its own epoll loop and serves the
+// connections it accepted. Each wakeup reads as much as a connection has
+// sent, answers every complete request in the buffer and writes all
+// responses with one send(). A client that does not read its responses
+// stops being read until it does.
+//
+// Between requests, the first worker computes the codes of the step after
+// next for a slice of the accounts every REFRESH_MS (see steptable.h), so
+// checks within one step are answered from memory. Accepted codes go into
+// a replay cache shared by all workers (see replay.h) and are rejected if
+// they come again. At the end of every refresh pass, the codes of the step
+// after next are also indexed for reverse lookups (see reverse.h), once
+// per step, or sooner if accounts were added.
+//
+// Accounts can be added and removed while the daemon runs. The account
+// table and the reverse index are swapped in, never changed in place (see
+// accounts.h), so workers handle each round of events inside an epoch
+// critical section (see epoch.h) and never wait for a change to finish.
+//
+// Codes are looked for around the clock drift of their account first (see
+// drift.h). With -d, the drift estimates are saved every DRIFT_SAVE_SECONDS
+// at the end of a refresh pass, by a thread of their own that reads the
+// account table as the last epoch reader, and on exit.
+//
+// Counter-based accounts are checked ahead of their counter instead (see
+// hotp.h) and have neither step codes nor reverse lookups. With -c, their
+// counters are kept in a journal written by a thread of its own (see
+// journal.h), which reads the account table as the reader after the
+// workers.
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accounts.h"
+#include "drift.h"
+#include "epoch.h"
+#include "gauth.h"
+#include "gauthd.h"
+#include "hotp.h"
+#include "journal.h"
+#include "replay.h"
+#include "reverse.h"
+#include "util.h"
+
+#define BUFFER_SIZE 65536
+#define MAX_EVENTS  64
+
+// Every REFRESH_MS, at least 1 / REFRESH_SLICES of the accounts are brought
+// up to date, so a full pass takes at most five seconds.
+#define REFRESH_MS      100
+#define REFRESH_SLICES  50
+#define REFRESH_MIN     1024
+
+#define MAX_SECRET 512
+
+#define DRIFT_SAVE_SECONDS 300
+
+#define DEFAULT_WINDOW        1
+#define DEFAULT_LOOK_AHEAD    10
+#define DEFAULT_REPLAY_SLOTS  (1u << 20)
+#define MAX_THREADS           256
+
+// Largest response to any request
+#define MAX_RESPONSE (12 + GAUTHD_MAX_MATCHES * (2 + ACCOUNT_MAX_NAME))
+
+typedef struct conn {
+  int fd;
+  int reader;           // the worker that serves it
+  int epoll_fd;         // of that worker
+  struct conn *prev;    // in the list of that worker
+  struct conn *next;
+  uint32_t events;      // what epoll watches for
+  int admin;            // may add and remove accounts
+  uint32_t in_len;
+  uint32_t out_pos;
+  uint32_t out_len;
+  uint8_t in[BUFFER_SIZE];
+  uint8_t out[BUFFER_SIZE];
+} CONN;
+
+static EPOCH *epoch;
+static ACCOUNTS *accounts;
+static REPLAY_CACHE *replay;
+static REVERSE_INDEX *reverse;
+
+// Largest window a client may ask for. Accepted codes are remembered until
+// no such window reaches their step any more.
+static int max_window = DEFAULT_WINDOW;
+
+// Largest number of counters past the expected one that a client may ask
+// to accept for an HOTP account
+static int max_look_ahead = DEFAULT_LOOK_AHEAD;
+
+// Accounts are refreshed in the order of their hashes, from the cursor on.
+// The list holds the slice being refreshed, or all accounts at the end of
+// a pass.
+static uint64_t refresh_cursor;
+static ACCOUNT **refresh_list;
+static int refresh_size;
+
+static int epoll_fds[MAX_THREADS];
+
+// The open connections of each worker, only touched by that worker
+static CONN *conns[MAX_THREADS];
+
+// Set when an account was added, so that the next refresh pass indexes
+// its period if it is a new one.
+static _Atomic int accounts_added = 1;
+
+static const char *drift_path;
+static time_t drift_saved;
+static DRIFT_SAVER *drift_saver;
+
+static const char *counter_path;
+static JOURNAL *journal;
+
+// Stand-ins in the epoll data for the descriptors that are not clients.
+// stop becomes readable, for every worker at once, when a signal arrives.
+static CONN listener = { .fd = -1 };
+static CONN signals = { .fd = -1 };
+static CONN stop = { .fd = -1 };
+
+static uint32_t get_u32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+         (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put_u32(uint8_t *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+static int verify_counter(ACCOUNT *account, int look_ahead, int code,
+                          uint8_t *reply) {
+  int match;
+  switch (hotp_verify(account, look_ahead, code, &match)) {
+    case HOTP_ACCEPTED:
+      break;
+    case HOTP_REPLAYED:
+      return GAUTHD_REPLAYED;
+    default:
+      return GAUTHD_REJECTED;
+  }
+  journal_record(journal, account);
+  reply[0] = (uint8_t)match;
+  return GAUTHD_OK;
+}
+
+static int verify(const uint8_t *body, uint32_t len, time_t now,
+                  uint8_t *reply, uint32_t *reply_len) {
+  reply[0] = 0;
+  *reply_len = 1;
+  if (len < 6 || len != 6u + body[5]) {
+    return GAUTHD_BAD_REQUEST;
+  }
+  int window = body[0];
+  uint32_t code = get_u32(body + 1);
+  if (window > (max_window > max_look_ahead ? max_window : max_look_ahead) ||
+      code > INT32_MAX) {
+    return GAUTHD_BAD_REQUEST;
+  }
+  ACCOUNT *account = accounts_find(accounts, (const char *)body + 6, body[5]);
+  if (!account) {
+    return GAUTHD_NO_ACCOUNT;
+  }
+  if (account->period == ACCOUNT_HOTP) {
+    if (window > max_look_ahead) {
+      return GAUTHD_BAD_REQUEST;
+    }
+    return verify_counter(account, window, (int)code, reply);
+  }
+  if (window > max_window) {
+    return GAUTHD_BAD_REQUEST;
+  }
+
+  int match;
+  if (drift_verify(account, now, window, (int)code, &match) != 1) {
+    return GAUTHD_REJECTED;
+  }
+
+  uint64_t step = gauth_totp_step(now, account->period) + match;
+  time_t expires = (time_t)((step + max_window + 1) * account->period);
+  switch (replay_cache_mark(replay, account->id, step, (int)code, now,
+                            expires)) {
+    case 0:
+      return GAUTHD_REPLAYED;
+    case -1:
+      return GAUTHD_UNAVAILABLE;
+  }
+  drift_record(account, match);
+  reply[0] = (uint8_t)(int8_t)match;
+  return GAUTHD_OK;
+}
+
+static int lookup(const uint8_t *body, uint32_t len, time_t now,
+                  uint8_t *reply, uint32_t *reply_len) {
+  REVERSE_MATCH matches[GAUTHD_MAX_MATCHES];
+  int total = 0;
+  int returned = 0;
+
+  *reply_len = 0;
+  if (len != 5 || body[0] > 1 || get_u32(body + 1) > INT32_MAX) {
+    return GAUTHD_BAD_REQUEST;
+  }
+
+  total = reverse_index_lookup(reverse, now, body[0], (int)get_u32(body + 1),
+                               matches, GAUTHD_MAX_MATCHES);
+  if (total < 0) {
+    return GAUTHD_UNAVAILABLE;
+  }
+  returned = total < GAUTHD_MAX_MATCHES ? total : GAUTHD_MAX_MATCHES;
+
+  reply[0] = (total > 0xFFFF ? 0xFFFF : total) >> 8;
+  reply[1] = (total > 0xFFFF ? 0xFFFF : total);
+  reply[2] = returned;
+  *reply_len = 3;
+  for (int i = 0; i < returned; ++i) {
+    size_t name_len = strlen(matches[i].account->name);
+    reply[*reply_len] = (uint8_t)(int8_t)matches[i].offset;
+    reply[*reply_len + 1] = name_len;
+    memcpy(reply + *reply_len + 2, matches[i].account->name, name_len);
+    *reply_len += 2 + name_len;
+  }
+  return total ? GAUTHD_OK : GAUTHD_REJECTED;
+}
+
+static int add_account(const uint8_t *body, uint32_t len) {
+  char secret[MAX_SECRET + 1];
+
+  if (len < 6 || len < 6u + body[5] || len - 6 - body[5] > MAX_SECRET ||
+      get_u32(body) > INT32_MAX) {
+    return GAUTHD_BAD_REQUEST;
+  }
+  uint32_t secret_len = len - 6 - body[5];
+  memcpy(secret, body + 6 + body[5], secret_len);
+  secret[secret_len] = '\0';
+
+  int result = accounts_add(accounts, (const char *)body + 6, body[5],
+                            secret, (int)get_u32(body), body[4]);
+  int error = errno;
+  explicit_bzero(secret, sizeof(secret));
+  if (result == 0) {
+    atomic_store(&accounts_added, 1);
+    return GAUTHD_OK;
+  }
+  switch (error) {
+    case EEXIST:
+      return GAUTHD_EXISTS;
+    case EINVAL:
+      return GAUTHD_BAD_REQUEST;
+  }
+  return GAUTHD_UNAVAILABLE;
+}
+
+static int remove_account(const uint8_t *body, uint32_t len) {
+  if (len < 1 || len != 1u + body[0]) {
+    return GAUTHD_BAD_REQUEST;
+  }
+  if (accounts_remove(accounts, (const char *)body + 1, body[0]) == 0) {
+    return GAUTHD_OK;
+  }
+  return errno == ENOENT ? GAUTHD_NO_ACCOUNT : GAUTHD_UNAVAILABLE;
+}
+
+// Answers one request frame (without its length) into out, and returns the
+// size of the response.
+static uint32_t answer(const uint8_t *frame, uint32_t len, time_t now,
+                       int admin, uint8_t *out) {
+  uint32_t reply_len = 0;
+  int status = GAUTHD_BAD_REQUEST;
+  int op = len >= 5 ? frame[4] : 0;
+
+  if (op == GAUTHD_OP_VERIFY) {
+    status = verify(frame + 5, len - 5, now, out + 9, &reply_len);
+  } else if (op == GAUTHD_OP_LOOKUP) {
+    status = lookup(frame + 5, len - 5, now, out + 9, &reply_len);
+  } else if ((op == GAUTHD_OP_ADD || op == GAUTHD_OP_REMOVE) && !admin) {
+    status = GAUTHD_DENIED;
+  } else if (op == GAUTHD_OP_ADD) {
+    status = add_account(frame + 5, len - 5);
+  } else if (op == GAUTHD_OP_REMOVE) {
+    status = remove_account(frame + 5, len - 5);
+  }
+
+  put_u32(out, 5 + reply_len);
+  memcpy(out + 4, frame, len < 4 ? len : 4);
+  if (len < 4) {
+    memset(out + 4 + len, 0, 4 - len);
+  }
+  out[8] = status;
+  return 9 + reply_len;
+}
+
+static void conn_close(CONN *conn) {
+  if (conn->prev) {
+    conn->prev->next = conn->next;
+  } else {
+    conns[conn->reader] = conn->next;
+  }
+  if (conn->next) {
+    conn->next->prev = conn->prev;
+  }
+  close(conn->fd);
+  free(conn);
+}
+
+static int conn_watch(CONN *conn, uint32_t events) {
+  if (conn->events == events) {
+    return 0;
+  }
+  struct epoll_event ev = { .events = events, .data.ptr = conn };
+  conn->events = events;
+  return epoll_ctl(conn->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+// Answers the complete frames in the input buffer while there is room for
+// the responses. Returns how many there were, or -1 if the client sent
+// garbage.
+static int conn_process(CONN *conn, time_t now) {
+  uint32_t pos = 0;
+  int answered = 0;
+
+  while (conn->in_len - pos >= 4 &&
+         BUFFER_SIZE - conn->out_len >= MAX_RESPONSE) {
+    uint32_t len = get_u32(conn->in + pos);
+    if (len > GAUTHD_MAX_FRAME) {
+      return -1;
+    }
+    if (conn->in_len - pos - 4 < len) {
+      break;
+    }
+    conn->out_len += answer(conn->in + pos + 4, len, now, conn->admin,
+                            conn->out + conn->out_len);
+    pos += 4 + len;
+    ++answered;
+  }
+
+  memmove(conn->in, conn->in + pos, conn->in_len - pos);
+  conn->in_len -= pos;
+  return answered;
+}
+
+// Sends what is pending. Reading resumes once everything went out.
+static int conn_flush(CONN *conn) {
+  while (conn->out_pos < conn->out_len) {
+    ssize_t n = send(conn->fd, conn->out + conn->out_pos,
+                     conn->out_len - conn->out_pos, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return conn_watch(conn, EPOLLOUT);
+      }
+      return -1;
+    }
+    conn->out_pos += n;
+  }
+  conn->out_pos = conn->out_len = 0;
+  return conn_watch(conn, EPOLLIN);
+}
+
+// Answers and sends until no complete request is left, or the client does
+// not take more responses.
+static int conn_serve(CONN *conn, time_t now) {
+  int answered;
+  do {
+    answered = conn_process(conn, now);
+    if (answered < 0 || conn_flush(conn) < 0) {
+      return -1;
+    }
+  } while (answered > 0 && !conn->out_len);
+  return 0;
+}
+
+static void conn_event(CONN *conn, uint32_t events, time_t now) {
+  if (events & EPOLLERR) {
+    conn_close(conn);
+    return;
+  }
+
+  if (events & EPOLLOUT) {
+    // Requests left behind while the output buffer was full go out too.
+    if (conn_flush(conn) < 0 || (!conn->out_len && conn_serve(conn, now) < 0)) {
+      conn_close(conn);
+    }
+    return;
+  }
+
+  if (events & (EPOLLIN | EPOLLHUP)) {
+    ssize_t n = read(conn->fd, conn->in + conn->in_len,
+                     BUFFER_SIZE - conn->in_len);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+      conn_close(conn);
+      return;
+    }
+    if (n > 0) {
+      conn->in_len += n;
+    }
+    if (conn_serve(conn, now) < 0) {
+      conn_close(conn);
+    }
+  }
+}
+
+static long long monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Makes room for "size" accounts in the refresh list.
+static int refresh_reserve(int size) {
+  if (size <= refresh_size) {
+    return 0;
+  }
+  ACCOUNT **list = realloc(refresh_list, size * sizeof(ACCOUNT *));
+  if (!list) {
+    return -1;
+  }
+  refresh_list = list;
+  refresh_size = size;
+  return 0;
+}
+
+// Drops the HOTP accounts from a list, and returns how many are left.
+static int time_based(ACCOUNT **list, int count) {
+  int kept = 0;
+  for (int i = 0; i < count; ++i) {
+    if (list[i]->period != ACCOUNT_HOTP) {
+      list[kept++] = list[i];
+    }
+  }
+  return kept;
+}
+
+// Indexes the codes of all TOTP accounts for reverse lookups. Between
+// steps, when every table is there already, the accounts are not even
+// listed, unless some were added.
+static int reverse_refresh(time_t now) {
+  uint64_t cursor = 0;
+  int count = 0;
+
+  if (!atomic_exchange(&accounts_added, 0) &&
+      reverse_index_ready(reverse, now)) {
+    return 0;
+  }
+
+  while (cursor < ACCOUNTS_SCAN_END) {
+    if (refresh_reserve(count + accounts_count(accounts) / 8 + REFRESH_MIN)) {
+      atomic_store(&accounts_added, 1);
+      return -1;
+    }
+    count += time_based(refresh_list + count,
+                        accounts_scan(accounts, &cursor, refresh_list + count,
+                                      refresh_size - count));
+  }
+  step_codes_advance(refresh_list, count, now);
+  if (reverse_index_update(reverse, refresh_list, count, now) < 0) {
+    // The next pass tries the periods that did not get their tables.
+    atomic_store(&accounts_added, 1);
+    return -1;
+  }
+  return 0;
+}
+
+static int has_hotp(void) {
+  ACCOUNT *batch[REFRESH_MIN];
+  uint64_t cursor = 0;
+
+  while (cursor < ACCOUNTS_SCAN_END) {
+    int n = accounts_scan(accounts, &cursor, batch, REFRESH_MIN);
+    if (time_based(batch, n) < n) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// A failed save is only reported when the next one is asked for.
+static void save_drift(time_t now) {
+  if (drift_saver_kick(drift_saver) < 0) {
+    fprintf(stderr, "gauthenticatord: %s: %s\n", drift_path, strerror(errno));
+  }
+  drift_saved = now;
+}
+
+static void refresh(time_t now) {
+  int n = accounts_count(accounts) / REFRESH_SLICES + 1;
+  if (n < REFRESH_MIN) {
+    n = REFRESH_MIN;
+  }
+  if (refresh_reserve(n)) {
+    return;
+  }
+  n = time_based(refresh_list,
+                 accounts_scan(accounts, &refresh_cursor, refresh_list, n));
+  step_codes_advance(refresh_list, n, now);
+  if (refresh_cursor == ACCOUNTS_SCAN_END) {
+    refresh_cursor = 0;
+    if (reverse_refresh(now) < 0) {
+      fprintf(stderr, "gauthenticatord: reverse index: out of memory\n");
+    }
+    if (drift_path && now - drift_saved >= DRIFT_SAVE_SECONDS) {
+      save_drift(now);
+    }
+    if (journal && journal_check(journal) < 0) {
+      fprintf(stderr, "gauthenticatord: %s: %s\n", counter_path,
+              strerror(errno));
+    }
+  }
+}
+
+static void accept_all(int reader) {
+  int epoll_fd = epoll_fds[reader];
+
+  for (;;) {
+    int fd = accept4(listener.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+          errno != ECONNABORTED) {
+        perror("gauthenticatord: accept");
+      }
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      return;
+    }
+
+    CONN *conn = malloc(sizeof(CONN));
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (conn) {
+      conn->fd = fd;
+      conn->reader = reader;
+      conn->epoll_fd = epoll_fd;
+      conn->events = EPOLLIN;
+      conn->admin = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred,
+                               &cred_len) == 0 &&
+                    (cred.uid == 0 || cred.uid == geteuid());
+      conn->in_len = conn->out_pos = conn->out_len = 0;
+    }
+    if (!conn || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      close(fd);
+      free(conn);
+      continue;
+    }
+    conn->prev = NULL;
+    conn->next = conns[reader];
+    if (conn->next) {
+      conn->next->prev = conn;
+    }
+    conns[reader] = conn;
+  }
+}
+
+static int listen_on(const char *path, mode_t mode) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "gauthenticatord: socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("gauthenticatord: socket");
+    return -1;
+  }
+  // A socket left behind by a daemon that died refuses connections and is
+  // replaced. One that accepts them belongs to a daemon still running.
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "gauthenticatord: %s: already running\n", path);
+    close(fd);
+    return -1;
+  }
+  if (errno == ECONNREFUSED) {
+    unlink(path);
+  }
+  close(fd);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("gauthenticatord: socket");
+    return -1;
+  }
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      chmod(path, mode) < 0 || listen(fd, SOMAXCONN) < 0) {
+    fprintf(stderr, "gauthenticatord: %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Serves connections until a signal arrives. Worker 0 also takes the
+// signals and keeps the step codes up to date.
+static void serve(int reader) {
+  int epoll_fd = epoll_fds[reader];
+  int first = reader == 0;
+  long long next_refresh = monotonic_ms() + REFRESH_MS;
+  int running = 1;
+
+  while (running) {
+    struct epoll_event events[MAX_EVENTS];
+    int timeout = -1;
+    if (first) {
+      long long wait = next_refresh - monotonic_ms();
+      timeout = wait > 0 ? (int)wait : 0;
+    }
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("gauthenticatord: epoll_wait");
+      break;
+    }
+
+    // One clock reading for everything answered in this round
+    time_t now = time(NULL);
+    epoch_enter(epoch, reader);
+    for (int i = 0; i < n; ++i) {
+      CONN *conn = events[i].data.ptr;
+      if (conn == &listener) {
+        accept_all(reader);
+      } else if (conn == &signals) {
+        uint64_t one = 1;
+        if (write(stop.fd, &one, sizeof(one)) < 0) {
+          perror("gauthenticatord: eventfd");
+        }
+        running = 0;
+      } else if (conn == &stop) {
+        running = 0;
+      } else {
+        conn_event(conn, events[i].events, now);
+      }
+    }
+
+    if (first && monotonic_ms() >= next_refresh) {
+      refresh(now);
+      next_refresh = monotonic_ms() + REFRESH_MS;
+    }
+    epoch_exit(epoch, reader);
+    if (first) {
+      epoch_reclaim(epoch);
+    }
+  }
+}
+
+static void *worker(void *arg) {
+  serve((int)(intptr_t)arg);
+  return NULL;
+}
+
+// Stops the journal and the drift saver, closes the connections left open
+// and frees what main() set up, once no worker runs any more. Tables and
+// retired entries may hold the last reference to an account, in any order.
+static void release_all(void) {
+  if (journal) {
+    journal_close(journal);
+  }
+  if (drift_saver) {
+    drift_saver_stop(drift_saver);
+  }
+  for (int i = 0; i < MAX_THREADS; ++i) {
+    while (conns[i]) {
+      conn_close(conns[i]);
+    }
+  }
+  reverse_index_free(reverse);
+  epoch_free(epoch);
+  free(refresh_list);
+  replay_cache_free(replay);
+  accounts_free(accounts);
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "Usage: gauthenticatord [-s SOCKET] [-m MODE] [-j THREADS] "
+          "[-w WINDOW] [-l LOOK-AHEAD] [-r ENTRIES] [-d DRIFT-FILE]\n"
+          "                       [-c COUNTER-FILE] ACCOUNTS-FILE\n");
+}
+
+int main(int argc, char *argv[]) {
+  const char *socket_path = GAUTHD_DEFAULT_SOCKET;
+  mode_t mode = 0600;
+  int threads = 1;
+  uint32_t replay_slots = DEFAULT_REPLAY_SLOTS;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:m:j:w:l:r:d:c:h")) != -1) {
+    switch (opt) {
+      case 's':
+        socket_path = optarg;
+        break;
+      case 'm': {
+        char *end;
+        errno = 0;
+        unsigned long value = strtoul(optarg, &end, 8);
+        if (errno || end == optarg || *end || *optarg == '-' ||
+            value > 0777) {
+          usage();
+          return EXIT_FAILURE;
+        }
+        mode = (mode_t)value;
+        break;
+      }
+      case 'j':
+        threads = atoi(optarg);
+        if (threads < 1 || threads > MAX_THREADS) {
+          usage();
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'w':
+        max_window = atoi(optarg);
+        if (max_window < 0 || max_window > GAUTH_MAX_WINDOW) {
+          usage();
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'l':
+        max_look_ahead = atoi(optarg);
+        if (max_look_ahead < 0 || max_look_ahead > GAUTH_MAX_WINDOW) {
+          usage();
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'r':
+        replay_slots = (uint32_t)strtoul(optarg, NULL, 10);
+        break;
+      case 'd':
+        drift_path = optarg;
+        break;
+      case 'c':
+        counter_path = optarg;
+        break;
+      default:
+        usage();
+        return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  if (optind != argc - 1) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  // One reader per worker, one for the journal and one for the drift saver
+  epoch = epoch_new(threads + 2);
+  if (!epoch) {
+    perror("gauthenticatord");
+    return EXIT_FAILURE;
+  }
+  int line;
+  accounts = accounts_load(argv[optind], epoch, &line);
+  if (!accounts) {
+    if (line) {
+      fprintf(stderr, "gauthenticatord: %s:%d: invalid account\n",
+              argv[optind], line);
+    } else {
+      fprintf(stderr, "gauthenticatord: %s: %s\n", argv[optind],
+              strerror(errno));
+    }
+    epoch_free(epoch);
+    return EXIT_FAILURE;
+  }
+
+  // Without saved estimates every account starts without drift.
+  if (drift_path && drift_load(accounts, drift_path, &line) < 0) {
+    if (line) {
+      fprintf(stderr, "gauthenticatord: %s:%d: invalid drift, ignored\n",
+              drift_path, line);
+    } else if (errno != ENOENT) {
+      fprintf(stderr, "gauthenticatord: %s: %s\n", drift_path,
+              strerror(errno));
+    }
+  }
+  drift_saved = time(NULL);
+
+  if (!counter_path && has_hotp()) {
+    fprintf(stderr, "gauthenticatord: without -c, HOTP counters start "
+            "from 0 every time\n");
+  }
+
+  replay = replay_cache_new(replay_slots);
+  reverse = reverse_index_new(epoch);
+  if (!replay || !reverse || reverse_refresh(time(NULL)) < 0) {
+    perror("gauthenticatord");
+    release_all();
+    return EXIT_FAILURE;
+  }
+
+  // SIGINT and SIGTERM end the loops through a descriptor of their own.
+  // Blocked before any worker, the journal or the drift saver starts, so
+  // they all inherit the mask.
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  signals.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  stop.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (counter_path) {
+    journal = journal_open(accounts, epoch, threads, counter_path, &line);
+    if (!journal) {
+      if (line) {
+        fprintf(stderr, "gauthenticatord: %s:%d: invalid counter\n",
+                counter_path, line);
+      } else {
+        fprintf(stderr, "gauthenticatord: %s: %s\n", counter_path,
+                strerror(errno));
+      }
+      release_all();
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (drift_path) {
+    drift_saver = drift_saver_start(accounts, epoch, threads + 1, drift_path);
+    if (!drift_saver) {
+      perror("gauthenticatord");
+      release_all();
+      return EXIT_FAILURE;
+    }
+  }
+
+  listener.fd = listen_on(socket_path, mode);
+  int started = 0;
+  for (; started < threads; ++started) {
+    epoll_fds[started] = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fds[started] < 0) {
+      break;
+    }
+    // Only one of the workers waiting for a connection is woken for it.
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLEXCLUSIVE,
+                              .data.ptr = &listener };
+    epoll_ctl(epoll_fds[started], EPOLL_CTL_ADD, listener.fd, &ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &stop;
+    epoll_ctl(epoll_fds[started], EPOLL_CTL_ADD, stop.fd, &ev);
+  }
+  if (listener.fd < 0 || signals.fd < 0 || stop.fd < 0 || started < threads) {
+    if (listener.fd >= 0) {
+      unlink(socket_path);
+    }
+    release_all();
+    return EXIT_FAILURE;
+  }
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &signals };
+  epoll_ctl(epoll_fds[0], EPOLL_CTL_ADD, signals.fd, &ev);
+
+  // The main thread is the first worker.
+  pthread_t workers[MAX_THREADS];
+  int spawned = 1;
+  for (; spawned < threads; ++spawned) {
+    if (pthread_create(&workers[spawned], NULL, worker,
+                       (void *)(intptr_t)spawned) != 0) {
+      perror("gauthenticatord: pthread_create");
+      break;
+    }
+  }
+  serve(0);
+  for (int i = 1; i < spawned; ++i) {
+    pthread_join(workers[i], NULL);
+  }
+
+  unlink(socket_path);
+  close(listener.fd);
+  close(signals.fd);
+  close(stop.fd);
+  for (int i = 0; i < threads; ++i) {
+    close(epoll_fds[i]);
+  }
+  if (drift_saver && drift_saver_stop(drift_saver) < 0) {
+    fprintf(stderr, "gauthenticatord: %s: %s\n", drift_path, strerror(errno));
+  }
+  drift_saver = NULL;
+  if (journal && journal_close(journal) < 0) {
+    fprintf(stderr, "gauthenticatord: %s: %s\n", counter_path,
+            strerror(errno));
+  }
+  journal = NULL;
+  release_all();
+
+  return EXIT_SUCCESS;
+}
@@ -19,11 +19,11 @@
 
 #include "hmac.h"
 #include "sha1.h"
+#include "sha1_hw.h"
 #include "util.h"
 
-void hmac_sha1(const uint8_t *key, int keyLength,
-               const uint8_t *data, int dataLength,
-               uint8_t *result, int resultLength) {
+void hmac_sha1_init_key(HMAC_SHA1_KEY *hmac_key,
+                        const uint8_t *key, int keyLength) {
   SHA1_INFO ctx;
   uint8_t hashed_key[SHA1_DIGEST_LENGTH];
   if (keyLength > 64) {
@@ -46,12 +46,10 @@ void hmac_sha1(const uint8_t *key, int keyLength,
     memset(tmp_key + keyLength, 0x36, 64 - keyLength);
   }
 
-  // Compute inner digest
+  // Hash the inner key block and keep the chaining value
   sha1_init(&ctx);
   sha1_update(&ctx, tmp_key, 64);
-  sha1_update(&ctx, data, dataLength);
-  uint8_t sha[SHA1_DIGEST_LENGTH];
-  sha1_final(&ctx, sha);
+  memcpy(hmac_key->inner, ctx.digest, sizeof(hmac_key->inner));
 
   // The key for the outer digest is derived from our key, by padding the key
   // the full length of 64 bytes, and then XOR'ing each byte with 0x5C.
@@ -60,9 +58,30 @@ void hmac_sha1(const uint8_t *key, int keyLength,
   }
   memset(tmp_key + keyLength, 0x5C, 64 - keyLength);
 
-  // Compute outer digest
+  // Hash the outer key block and keep the chaining value
   sha1_init(&ctx);
   sha1_update(&ctx, tmp_key, 64);
+  memcpy(hmac_key->outer, ctx.digest, sizeof(hmac_key->outer));
+
+  // Zero out all internal data structures
+  explicit_bzero(&ctx, sizeof(ctx));
+  explicit_bzero(hashed_key, sizeof(hashed_key));
+  explicit_bzero(tmp_key, sizeof(tmp_key));
+}
+
+void hmac_sha1_with_key(const HMAC_SHA1_KEY *hmac_key,
+                        const uint8_t *data, int dataLength,
+                        uint8_t *result, int resultLength) {
+  SHA1_INFO ctx;
+
+  // Compute inner digest
+  sha1_resume(&ctx, hmac_key->inner);
+  sha1_update(&ctx, data, dataLength);
+  uint8_t sha[SHA1_DIGEST_LENGTH];
+  sha1_final(&ctx, sha);
+
+  // Compute outer digest
+  sha1_resume(&ctx, hmac_key->outer);
   sha1_update(&ctx, sha, SHA1_DIGEST_LENGTH);
   sha1_final(&ctx, sha);
 
@@ -74,7 +93,98 @@ void hmac_sha1(const uint8_t *key, int keyLength,
   memcpy(result, sha, resultLength);
 
   // Zero out all internal data structures
-  explicit_bzero(hashed_key, sizeof(hashed_key));
+  explicit_bzero(&ctx, sizeof(ctx));
   explicit_bzero(sha, sizeof(sha));
-  explicit_bzero(tmp_key, sizeof(tmp_key));
+}
+
+void hmac_sha1_counter(const HMAC_SHA1_KEY *hmac_key, uint64_t counter,
+                       uint8_t result[SHA1_DIGEST_LENGTH]) {
+  uint32_t msg[2] = { (uint32_t)(counter >> 32), (uint32_t)counter };
+  uint32_t inner[5];
+  uint32_t outer[5];
+
+  // The inner chaining value is directly the message of the outer hash
+  sha1_tail8(hmac_key->inner, msg, inner);
+  sha1_tail20(hmac_key->outer, inner, outer);
+
+  for (int i = 0; i < 5; ++i) {
+    result[4*i    ] = (uint8_t)(outer[i] >> 24);
+    result[4*i + 1] = (uint8_t)(outer[i] >> 16);
+    result[4*i + 2] = (uint8_t)(outer[i] >>  8);
+    result[4*i + 3] = (uint8_t)(outer[i]      );
+  }
+
+  // Zero out all internal data structures
+  explicit_bzero(inner, sizeof(inner));
+  explicit_bzero(outer, sizeof(outer));
+}
+
+// Dynamic truncation (RFC 4226) of a digest held as five host-order words.
+static int hmac_sha1_truncate(const uint32_t digest[5], unsigned int modulus) {
+  const int offset = digest[4] & 0xF;
+  const int word = offset / 4;
+  const int shift = 8 * (offset % 4);
+
+  uint32_t truncatedHash = digest[word] << shift;
+  if (shift) {
+    truncatedHash |= digest[word + 1] >> (32 - shift);
+  }
+  return (int)((truncatedHash & 0x7FFFFFFF) % modulus);
+}
+
+void hmac_sha1_counter_codes(const HMAC_SHA1_JOB *jobs, int count,
+                             int digits, int *codes) {
+  const int lanes = sha1_mb_lanes();
+  const uint32_t *inner_state[SHA1_MB_MAX_LANES];
+  const uint32_t *outer_state[SHA1_MB_MAX_LANES];
+  uint32_t msg[SHA1_MB_MAX_LANES][2];
+  uint32_t inner[SHA1_MB_MAX_LANES][5];
+  uint32_t outer[SHA1_MB_MAX_LANES][5];
+  unsigned int modulus = 1;
+  int i = 0;
+
+  while (digits-- > 0) {
+    modulus *= 10;
+  }
+
+  if (lanes > 1) {
+    for (; i + lanes <= count; i += lanes) {
+      for (int j = 0; j < lanes; ++j) {
+        inner_state[j] = jobs[i + j].key->inner;
+        outer_state[j] = jobs[i + j].key->outer;
+        msg[j][0] = (uint32_t)(jobs[i + j].counter >> 32);
+        msg[j][1] = (uint32_t)jobs[i + j].counter;
+      }
+      sha1_mb_tail8(inner_state, msg, inner);
+      sha1_mb_tail20(outer_state, inner, outer);
+      for (int j = 0; j < lanes; ++j) {
+        codes[i + j] = hmac_sha1_truncate(outer[j], modulus);
+      }
+    }
+  }
+
+  // Scalar tail for the jobs that do not fill a whole group
+  for (; i < count; ++i) {
+    uint32_t one_msg[2] = { (uint32_t)(jobs[i].counter >> 32),
+                            (uint32_t)jobs[i].counter };
+    sha1_tail8(jobs[i].key->inner, one_msg, inner[0]);
+    sha1_tail20(jobs[i].key->outer, inner[0], outer[0]);
+    codes[i] = hmac_sha1_truncate(outer[0], modulus);
+  }
+
+  // Zero out all internal data structures
+  explicit_bzero(inner, sizeof(inner));
+  explicit_bzero(outer, sizeof(outer));
+}
+
+void hmac_sha1(const uint8_t *key, int keyLength,
+               const uint8_t *data, int dataLength,
+               uint8_t *result, int resultLength) {
+  HMAC_SHA1_KEY hmac_key;
+
+  hmac_sha1_init_key(&hmac_key, key, keyLength);
+  hmac_sha1_with_key(&hmac_key, data, dataLength, result, resultLength);
+
+  // Zero out all internal data structures
+  explicit_bzero(&hmac_key, sizeof(hmac_key));
 }
@@ -20,6 +20,39 @@
 
 #include <stdint.h>
 
+#include "gauth.h"
+
+// SHA-1 chaining values after the 64-byte inner (key ^ 0x36) and outer
+// (key ^ 0x5C) key blocks. Computing them once per key leaves only the
+// message and the final compressions for every HMAC. This is the GAUTH_KEY
+// of the public API.
+typedef struct gauth_key HMAC_SHA1_KEY;
+
+void hmac_sha1_init_key(HMAC_SHA1_KEY *hmac_key,
+                        const uint8_t *key, int keyLength)
+ __attribute__((visibility("hidden")));
+
+void hmac_sha1_with_key(const HMAC_SHA1_KEY *hmac_key,
+                        const uint8_t *data, int dataLength,
+                        uint8_t *result, int resultLength)
+ __attribute__((visibility("hidden")));
+
+// HMAC-SHA1 of the 8-byte big-endian counter used by HOTP and TOTP. This
+// takes the fixed-shape path through sha1_tail8() and sha1_tail20().
+void hmac_sha1_counter(const HMAC_SHA1_KEY *hmac_key, uint64_t counter,
+                       uint8_t result[20])
+ __attribute__((visibility("hidden")));
+
+// One HMAC of a batch: a key state and the counter to hash with it.
+typedef struct gauth_job HMAC_SHA1_JOB;
+
+// Computes the "digits" long (6 to 8) HOTP/TOTP code of every job into
+// codes[]. Full groups of sha1_mb_lanes() jobs go through the multi-buffer
+// SHA1 backend; whatever is left over takes the scalar path.
+void hmac_sha1_counter_codes(const HMAC_SHA1_JOB *jobs, int count,
+                             int digits, int *codes)
+ __attribute__((visibility("hidden")));
+
 void hmac_sha1(const uint8_t *key, int keyLength,
                const uint8_t *data, int dataLength,
                uint8_t *result, int resultLength)
@@ -0,0 +1,68 @@
+// Counter-based (HOTP) accounts
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "config.h"
+
+#include <stdatomic.h>
+
+#include "gauth.h"
+#include "hotp.h"
+
+int hotp_verify(ACCOUNT *account, int look_ahead, int code, int *offset) {
+  // The expected counter and the look-ahead, then the counter last accepted
+  GAUTH_JOB jobs[GAUTH_MAX_WINDOW + 2];
+  int codes[GAUTH_MAX_WINDOW + 2];
+
+  if (look_ahead < 0 || look_ahead > GAUTH_MAX_WINDOW) {
+    return -1;
+  }
+
+  uint64_t counter = atomic_load_explicit(&account->counter,
+                                          memory_order_acquire);
+  for (;;) {
+    int n = 0;
+    for (int i = 0; i <= look_ahead; ++i) {
+      jobs[n].key = &account->key;
+      jobs[n].counter = counter + i;
+      ++n;
+    }
+    // Before the first code is accepted there is no counter before.
+    if (counter) {
+      jobs[n].key = &account->key;
+      jobs[n].counter = counter - 1;
+      ++n;
+    }
+    gauth_generate_many(jobs, n, account->digits, codes);
+
+    int match = 0;
+    while (match <= look_ahead && codes[match] != code) {
+      ++match;
+    }
+    if (match > look_ahead) {
+      return match < n && codes[match] == code ? HOTP_REPLAYED
+                                                 : HOTP_REJECTED;
+    }
+
+    // On failure, counter gets the value another request moved it to.
+    if (atomic_compare_exchange_strong_explicit(&account->counter, &counter,
+                                                counter + match + 1,
+                                                memory_order_acq_rel,
+                                                memory_order_acquire)) {
+      if (offset) {
+        *offset = match;
+      }
+      return HOTP_ACCEPTED;
+    }
+  }
+}
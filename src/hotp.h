@@ -0,0 +1,48 @@
+// Counter-based (HOTP) accounts
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// An HOTP token moves its counter on every time its button is pressed, so
+// it runs ahead of the server whenever a code is not used. A code is looked
+// for at the next expected counter and up to "look_ahead" counters past it
+// (RFC 4226, section 7.4), and a match moves the account to the counter
+// after it, which also makes the code and all codes before it invalid.
+//
+// Codes have only 6 to 8 digits, so the code of the counter last accepted
+// may also be the code of one ahead. The look-ahead is searched first, and
+// a code is only answered HOTP_REPLAYED when nothing ahead matches it: a
+// token that moved on must not be locked out by a collision with its last
+// code.
+//
+// The codes of the whole look-ahead are computed with one call to
+// gauth_generate_many(), several counters per SIMD instruction. The counter
+// moves with a compare-and-swap: of two requests racing on one account,
+// the one that loses checks its code again from where the winner left the
+// counter.
+
+#ifndef _HOTP_H_
+#define _HOTP_H_
+
+#include "accounts.h"
+
+#define HOTP_REJECTED 0
+#define HOTP_ACCEPTED 1
+#define HOTP_REPLAYED 2   // the code of the counter last accepted, and of
+                          // none in the look-ahead
+
+// Checks "code" of an ACCOUNT_HOTP account and moves its counter past the
+// match. On HOTP_ACCEPTED, *offset gets how many counters past the expected
+// one it was. Returns -1 if "look_ahead" is over GAUTH_MAX_WINDOW.
+int hotp_verify(ACCOUNT *account, int look_ahead, int code, int *offset);
+
+#endif /* _HOTP_H_ */
@@ -0,0 +1,387 @@
+// Journal of HOTP counters
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+// Appended bytes after which the file is rewritten
+#define JOURNAL_COMPACT_BYTES (1u << 20)
+
+// Accounts taken per accounts_scan() call
+#define SCAN_BATCH 1024
+
+struct journal {
+  ACCOUNTS *accounts;
+  EPOCH *epoch;
+  int reader;
+  char *path;
+  char *temp;
+  int fd;
+  size_t appended;      // since the file was last rewritten
+  int failed;           // a round was lost, rewrite on the next one
+  int error;            // of the last rewrite that failed, 0 if none did
+  char *buf;
+  size_t buf_len;
+  size_t buf_size;
+  _Atomic(ACCOUNT *) pending;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int closing;
+  pthread_t thread;
+};
+
+static int journal_append(JOURNAL *journal, const char *name,
+                          uint64_t counter) {
+  size_t need = strlen(name) + 24;
+  if (journal->buf_size - journal->buf_len < need) {
+    size_t size = journal->buf_size ? 2 * journal->buf_size : 4096;
+    while (size - journal->buf_len < need) {
+      size *= 2;
+    }
+    char *buf = realloc(journal->buf, size);
+    if (!buf) {
+      errno = ENOMEM;
+      return -1;
+    }
+    journal->buf = buf;
+    journal->buf_size = size;
+  }
+  journal->buf_len += sprintf(journal->buf + journal->buf_len,
+                              "%s %" PRIu64 "\n", name, counter);
+  return 0;
+}
+
+static int write_all(int fd, const char *data, size_t length) {
+  while (length) {
+    ssize_t n = write(fd, data, length);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    length -= n;
+  }
+  return 0;
+}
+
+// Makes a rename in the directory of "path" last.
+static void sync_dir(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char *dir = slash ? strndup(path, slash == path ? 1 : slash - path)
+                    : strdup(".");
+  if (!dir) {
+    return;
+  }
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+  free(dir);
+}
+
+// Replaces the file with the counters of all HOTP accounts and appends to
+// the new one from then on.
+static int journal_rewrite(JOURNAL *journal) {
+  ACCOUNT *batch[SCAN_BATCH];
+  uint64_t cursor = 0;
+  int result = 0;
+
+  journal->buf_len = 0;
+  if (journal->epoch) {
+    epoch_enter(journal->epoch, journal->reader);
+  }
+  while (cursor < ACCOUNTS_SCAN_END && result == 0) {
+    int n = accounts_scan(journal->accounts, &cursor, batch, SCAN_BATCH);
+    for (int i = 0; i < n && result == 0; ++i) {
+      uint64_t counter = atomic_load(&batch[i]->counter);
+      if (batch[i]->period == ACCOUNT_HOTP && counter) {
+        result = journal_append(journal, batch[i]->name, counter);
+      }
+    }
+  }
+  if (journal->epoch) {
+    epoch_exit(journal->epoch, journal->reader);
+  }
+  if (result) {
+    return -1;
+  }
+
+  int fd = open(journal->temp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+                O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return -1;
+  }
+  if (write_all(fd, journal->buf, journal->buf_len) || fdatasync(fd) ||
+      rename(journal->temp, journal->path)) {
+    int error = errno;
+    close(fd);
+    unlink(journal->temp);
+    errno = error;
+    return -1;
+  }
+  sync_dir(journal->path);
+
+  if (journal->fd >= 0) {
+    close(journal->fd);
+  }
+  journal->fd = fd;
+  journal->appended = 0;
+  journal->failed = 0;
+  return 0;
+}
+
+// Appends the counters of the accounts recorded since the last round.
+static void journal_flush(JOURNAL *journal) {
+  ACCOUNT *account = atomic_exchange_explicit(&journal->pending, NULL,
+                                              memory_order_acquire);
+  int result = 0;
+
+  journal->buf_len = 0;
+  while (account) {
+    ACCOUNT *next = account->journal_next;
+    // A counter that moves from here on puts the account back on the list.
+    atomic_store(&account->journaled, 0);
+    if (result == 0) {
+      result = journal_append(journal, account->name,
+                              atomic_load(&account->counter));
+    }
+    account_release(account);
+    account = next;
+  }
+
+  // After a lost round nothing is appended until the file was rewritten,
+  // so a line never continues one that was torn.
+  if (result == 0 && journal->buf_len && !journal->failed) {
+    off_t end = lseek(journal->fd, 0, SEEK_END);
+    if (end < 0) {
+      result = -1;
+    } else if (write_all(journal->fd, journal->buf, journal->buf_len)) {
+      // Cut a short write off again, so that the file still ends with a
+      // whole line if the rewrite below fails too.
+      while (ftruncate(journal->fd, end) < 0 && errno == EINTR) {
+      }
+      result = -1;
+    } else {
+      result = fdatasync(journal->fd);
+    }
+    journal->appended += journal->buf_len;
+  }
+  if (result) {
+    journal->failed = 1;
+  }
+
+  // The new file holds whatever the lost round did not write.
+  if ((journal->failed || journal->appended >= JOURNAL_COMPACT_BYTES) &&
+      journal_rewrite(journal) < 0) {
+    int error = errno;
+    pthread_mutex_lock(&journal->lock);
+    journal->error = error;
+    pthread_mutex_unlock(&journal->lock);
+  }
+}
+
+static void *journal_thread(void *arg) {
+  JOURNAL *journal = arg;
+
+  pthread_mutex_lock(&journal->lock);
+  for (;;) {
+    while (!atomic_load(&journal->pending) && !journal->closing) {
+      pthread_cond_wait(&journal->wake, &journal->lock);
+    }
+    if (!atomic_load(&journal->pending)) {
+      break;
+    }
+    pthread_mutex_unlock(&journal->lock);
+    journal_flush(journal);
+    pthread_mutex_lock(&journal->lock);
+  }
+  pthread_mutex_unlock(&journal->lock);
+  return NULL;
+}
+
+// Reads the counters of a journal. A last line without its newline was
+// cut short by a crash and is skipped.
+static int journal_load(ACCOUNTS *accounts, const char *path, int *line) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return errno == ENOENT ? 0 : -1;
+  }
+
+  char *buf = NULL;
+  size_t buf_len = 0;
+  ssize_t length;
+  int number = 0;
+  int error_line = 0;
+  while ((length = getline(&buf, &buf_len, file)) >= 0) {
+    ++number;
+    if (buf[length - 1] != '\n') {
+      break;
+    }
+
+    char *fields[3];
+    char *save;
+    int n = 0;
+    for (char *field = strtok_r(buf, " \t\r\n", &save);
+         field && n < 3; field = strtok_r(NULL, " \t\r\n", &save)) {
+      fields[n++] = field;
+    }
+    if (n == 0 || *fields[0] == '#') {
+      continue;
+    }
+
+    char *end;
+    errno = 0;
+    uint64_t counter = n == 2 ? strtoull(fields[1], &end, 10) : 0;
+    if (n != 2 || errno || *end || *fields[1] < '0' || *fields[1] > '9') {
+      error_line = number;
+      break;
+    }
+    // A later line of the same name replaces the counter of an earlier one.
+    ACCOUNT *account = accounts_find(accounts, fields[0], strlen(fields[0]));
+    if (account && account->period == ACCOUNT_HOTP) {
+      atomic_store(&account->counter, counter);
+    }
+  }
+  int read_error = !error_line && ferror(file);
+
+  free(buf);
+  fclose(file);
+
+  if (error_line || read_error) {
+    *line = error_line;
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+static void journal_free(JOURNAL *journal) {
+  if (journal->fd >= 0) {
+    close(journal->fd);
+  }
+  free(journal->buf);
+  free(journal->temp);
+  free(journal->path);
+  free(journal);
+}
+
+JOURNAL *journal_open(ACCOUNTS *accounts, EPOCH *epoch, int reader,
+                      const char *path, int *line) {
+  *line = 0;
+
+  JOURNAL *journal = calloc(1, sizeof(JOURNAL));
+  if (!journal) {
+    return NULL;
+  }
+  journal->accounts = accounts;
+  journal->epoch = epoch;
+  journal->reader = reader;
+  journal->fd = -1;
+  atomic_init(&journal->pending, NULL);
+  journal->path = strdup(path);
+  journal->temp = malloc(strlen(path) + sizeof(".tmp"));
+  if (!journal->path || !journal->temp) {
+    journal_free(journal);
+    errno = ENOMEM;
+    return NULL;
+  }
+  strcpy(journal->temp, path);
+  strcat(journal->temp, ".tmp");
+
+  if (journal_load(accounts, path, line) || journal_rewrite(journal)) {
+    int error = errno;
+    journal_free(journal);
+    errno = error;
+    return NULL;
+  }
+
+  pthread_mutex_init(&journal->lock, NULL);
+  pthread_cond_init(&journal->wake, NULL);
+  int error = pthread_create(&journal->thread, NULL, journal_thread, journal);
+  if (error) {
+    pthread_cond_destroy(&journal->wake);
+    pthread_mutex_destroy(&journal->lock);
+    journal_free(journal);
+    errno = error;
+    return NULL;
+  }
+  return journal;
+}
+
+int journal_close(JOURNAL *journal) {
+  pthread_mutex_lock(&journal->lock);
+  journal->closing = 1;
+  pthread_cond_signal(&journal->wake);
+  pthread_mutex_unlock(&journal->lock);
+  pthread_join(journal->thread, NULL);
+
+  int result = journal_rewrite(journal);
+  int error = errno;
+  pthread_cond_destroy(&journal->wake);
+  pthread_mutex_destroy(&journal->lock);
+  journal_free(journal);
+  errno = error;
+  return result;
+}
+
+int journal_check(JOURNAL *journal) {
+  pthread_mutex_lock(&journal->lock);
+  int error = journal->error;
+  journal->error = 0;
+  pthread_mutex_unlock(&journal->lock);
+
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+void journal_record(JOURNAL *journal, ACCOUNT *account) {
+  if (!journal || atomic_exchange(&account->journaled, 1)) {
+    return;
+  }
+
+  // The journal keeps the account, and its name, until it is written.
+  account_hold(account);
+  ACCOUNT *head = atomic_load_explicit(&journal->pending,
+                                       memory_order_relaxed);
+  do {
+    account->journal_next = head;
+  } while (!atomic_compare_exchange_weak_explicit(&journal->pending, &head,
+                                                  account,
+                                                  memory_order_release,
+                                                  memory_order_relaxed));
+
+  // The thread only sleeps once it found the list empty.
+  if (!head) {
+    pthread_mutex_lock(&journal->lock);
+    pthread_cond_signal(&journal->wake);
+    pthread_mutex_unlock(&journal->lock);
+  }
+}
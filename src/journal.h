@@ -0,0 +1,56 @@
+// Journal of HOTP counters
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Keeps the counters of HOTP accounts in a file of "name counter" lines,
+// where the last line of a name wins. Verifying a code never waits for the
+// disk: journal_record() puts the account on a lock-free list, once however
+// often its counter moves until it is written, and a thread of the journal
+// appends the lines of the whole list with one write() and one
+// fdatasync(). Counters that move while the disk is busy are all written
+// by the next round, so a burst of logins costs a few syncs, not one each.
+//
+// The file is rewritten with one line per account when it is opened, once
+// JOURNAL_COMPACT_BYTES were appended to it, when it is closed, and after
+// a write or sync failed. A short write is cut off again, and a line cut
+// short by a crash is ignored. Counters that had not reached the disk
+// yet are lost in a crash, and their codes are accepted once more.
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "accounts.h"
+#include "epoch.h"
+
+typedef struct journal JOURNAL;
+
+// Reads the counters in "path", if it exists, into the HOTP accounts of
+// "accounts" and starts writing to it. The thread of the journal reads the
+// table as reader "reader" of "epoch". On error returns NULL and sets
+// *line to the number of the offending line, or to 0 (see errno).
+JOURNAL *journal_open(ACCOUNTS *accounts, EPOCH *epoch, int reader,
+                      const char *path, int *line);
+
+// Writes everything recorded, rewrites the file and stops the journal.
+// Returns 0, or -1 if any counter could not be written (see errno).
+int journal_close(JOURNAL *journal);
+
+// Returns 0, or -1 if the file could not be rewritten after a lost round
+// since the last call (see errno). Until it is, nothing is appended to it,
+// and every round tries again.
+int journal_check(JOURNAL *journal);
+
+// Has the counter of "account" written. Does nothing if "journal" is NULL.
+void journal_record(JOURNAL *journal, ACCOUNT *account);
+
+#endif /* _JOURNAL_H_ */
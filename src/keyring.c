@@ -0,0 +1,399 @@
+// Keyring worker
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "config.h"
+
+#include "keyring.h"
+
+typedef enum {
+  KEYRING_STORE,
+  KEYRING_CLEAR,
+  KEYRING_LOOKUP,
+  KEYRING_SEARCH,
+  KEYRING_QUIT
+} KeyringOp;
+
+typedef struct {
+  KeyringCallback callback;
+  gpointer user_data;
+  GMainContext *context;
+} KeyringWaiter;
+
+typedef struct {
+  KeyringOp op;
+  const SecretSchema *schema;
+  GHashTable *attributes;
+  gchar *label;
+  gchar *secret;
+  SecretSearchFlags flags;
+  GSList *waiters;
+} KeyringRequest;
+
+typedef struct {
+  KeyringOp op;
+  KeyringWaiter *waiter;
+  gpointer result;
+  GError *error;
+  GSource *source;
+} KeyringReply;
+
+static GMutex queue_lock;
+static GCond queue_cond;
+static GQueue queue = G_QUEUE_INIT;
+static GThread *worker;
+
+// Replies whose callback has not run yet, oldest first, and whether
+// keyring_shutdown() was called. Both under queue_lock.
+static GQueue replies = G_QUEUE_INIT;
+static gboolean closed;
+
+static void
+keyring_request_free (KeyringRequest *request)
+{
+  if (request->attributes != NULL) {
+    g_hash_table_unref (request->attributes);
+  }
+  g_free (request->label);
+  if (request->secret != NULL) {
+    secret_password_free (request->secret);
+  }
+  g_slist_free (request->waiters);
+  g_free (request);
+}
+
+// Frees a result that no callback took.
+static void
+keyring_result_free (KeyringOp op,
+                     gpointer  result)
+{
+  if (result == NULL) {
+    return;
+  }
+  if (op == KEYRING_LOOKUP) {
+    secret_password_free (result);
+  } else if (op == KEYRING_SEARCH) {
+    g_list_free_full (result, g_object_unref);
+  }
+}
+
+static GError *
+keyring_cancelled (void)
+{
+  return g_error_new_literal (G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                              "The keyring was shut down");
+}
+
+static void
+keyring_deliver (KeyringWaiter *waiter,
+                 gpointer       result,
+                 GError        *error)
+{
+  if (waiter->callback != NULL) {
+    waiter->callback (result, error, waiter->user_data);
+  }
+
+  if (error != NULL) {
+    g_error_free (error);
+  }
+  g_main_context_unref (waiter->context);
+  g_free (waiter);
+}
+
+static gboolean
+keyring_dispatch (gpointer data)
+{
+  KeyringReply *reply = data;
+  gboolean pending;
+
+  // keyring_shutdown() may have taken the reply already.
+  g_mutex_lock (&queue_lock);
+  pending = g_queue_remove (&replies, reply);
+  g_mutex_unlock (&queue_lock);
+  if (!pending) {
+    return G_SOURCE_REMOVE;
+  }
+
+  keyring_deliver (reply->waiter, reply->result, reply->error);
+  g_source_unref (reply->source);
+  g_free (reply);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+keyring_reply (KeyringRequest *request,
+               gpointer        result,
+               GError         *error)
+{
+  // Waiters are prepended, so the oldest one is at the end of the list.
+  request->waiters = g_slist_reverse (request->waiters);
+
+  for (GSList *l = request->waiters; l != NULL; l = l->next) {
+    KeyringReply *reply = g_new0 (KeyringReply, 1);
+
+    reply->op = request->op;
+    reply->waiter = l->data;
+    reply->result = result;
+    reply->error = error ? g_error_copy (error) : NULL;
+    reply->source = g_idle_source_new ();
+    g_source_set_callback (reply->source, keyring_dispatch, reply, NULL);
+
+    g_mutex_lock (&queue_lock);
+    g_queue_push_tail (&replies, reply);
+    g_mutex_unlock (&queue_lock);
+    g_source_attach (reply->source, reply->waiter->context);
+  }
+
+  if (error != NULL) {
+    g_error_free (error);
+  }
+}
+
+static void
+keyring_run (KeyringRequest *request)
+{
+  GError *error = NULL;
+  gpointer result = NULL;
+
+  switch (request->op) {
+    case KEYRING_STORE:
+      secret_password_storev_sync (request->schema, request->attributes,
+                                   SECRET_COLLECTION_DEFAULT, request->label,
+                                   request->secret, NULL, &error);
+      break;
+
+    case KEYRING_CLEAR:
+      secret_password_clearv_sync (request->schema, request->attributes,
+                                   NULL, &error);
+      break;
+
+    case KEYRING_LOOKUP:
+      result = secret_password_lookupv_sync (request->schema, request->attributes,
+                                             NULL, &error);
+      break;
+
+    case KEYRING_SEARCH:
+      result = secret_service_search_sync (NULL, request->schema, request->attributes,
+                                           request->flags, NULL, &error);
+      break;
+
+    case KEYRING_QUIT:
+      break;
+  }
+
+  keyring_reply (request, result, error);
+}
+
+static gpointer
+keyring_worker (gpointer data)
+{
+  for (;;) {
+    KeyringRequest *request;
+
+    g_mutex_lock (&queue_lock);
+    while (g_queue_is_empty (&queue)) {
+      g_cond_wait (&queue_cond, &queue_lock);
+    }
+    request = g_queue_pop_head (&queue);
+    g_mutex_unlock (&queue_lock);
+
+    if (request->op == KEYRING_QUIT) {
+      keyring_request_free (request);
+      break;
+    }
+
+    keyring_run (request);
+    keyring_request_free (request);
+  }
+
+  return NULL;
+}
+
+static gboolean
+keyring_is_write (KeyringRequest *request)
+{
+  return request->op == KEYRING_STORE || request->op == KEYRING_CLEAR;
+}
+
+static gboolean
+keyring_same_item (KeyringRequest *a,
+                   KeyringRequest *b)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  if (a->schema != b->schema ||
+      g_hash_table_size (a->attributes) != g_hash_table_size (b->attributes)) {
+    return FALSE;
+  }
+
+  g_hash_table_iter_init (&iter, a->attributes);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    if (g_strcmp0 (value, g_hash_table_lookup (b->attributes, key)) != 0) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+static void
+keyring_queue (KeyringRequest  *request,
+               KeyringCallback  callback,
+               gpointer         user_data)
+{
+  KeyringWaiter *waiter = g_new0 (KeyringWaiter, 1);
+  KeyringRequest *tail;
+
+  waiter->callback = callback;
+  waiter->user_data = user_data;
+  waiter->context = g_main_context_ref_thread_default ();
+
+  g_mutex_lock (&queue_lock);
+
+  if (closed) {
+    g_mutex_unlock (&queue_lock);
+    keyring_request_free (request);
+    keyring_deliver (waiter, NULL, keyring_cancelled ());
+    return;
+  }
+
+  if (worker == NULL) {
+    worker = g_thread_new ("keyring", keyring_worker, NULL);
+  }
+
+  // Coalesce back-to-back writes of the same item into the last one.
+  tail = g_queue_peek_tail (&queue);
+  if (tail != NULL && keyring_is_write (tail) && keyring_is_write (request) &&
+      keyring_same_item (tail, request)) {
+    tail->op = request->op;
+    g_free (tail->label);
+    tail->label = g_steal_pointer (&request->label);
+    if (tail->secret != NULL) {
+      secret_password_free (tail->secret);
+    }
+    tail->secret = g_steal_pointer (&request->secret);
+    tail->waiters = g_slist_prepend (tail->waiters, waiter);
+    keyring_request_free (request);
+  } else {
+    request->waiters = g_slist_prepend (request->waiters, waiter);
+    g_queue_push_tail (&queue, request);
+    g_cond_signal (&queue_cond);
+  }
+
+  g_mutex_unlock (&queue_lock);
+}
+
+static KeyringRequest *
+keyring_request_new (KeyringOp           op,
+                     const SecretSchema *schema,
+                     GHashTable         *attributes)
+{
+  KeyringRequest *request = g_new0 (KeyringRequest, 1);
+
+  request->op = op;
+  request->schema = schema;
+  request->attributes = attributes;
+
+  return request;
+}
+
+void
+keyring_store (const SecretSchema *schema,
+               GHashTable         *attributes,
+               const gchar        *label,
+               const gchar        *secret,
+               KeyringCallback     callback,
+               gpointer            user_data)
+{
+  KeyringRequest *request = keyring_request_new (KEYRING_STORE, schema, attributes);
+
+  request->label = g_strdup (label);
+  request->secret = g_strdup (secret);
+  keyring_queue (request, callback, user_data);
+}
+
+void
+keyring_clear (const SecretSchema *schema,
+               GHashTable         *attributes,
+               KeyringCallback     callback,
+               gpointer            user_data)
+{
+  keyring_queue (keyring_request_new (KEYRING_CLEAR, schema, attributes),
+                 callback, user_data);
+}
+
+void
+keyring_lookup (const SecretSchema *schema,
+                GHashTable         *attributes,
+                KeyringCallback     callback,
+                gpointer            user_data)
+{
+  keyring_queue (keyring_request_new (KEYRING_LOOKUP, schema, attributes),
+                 callback, user_data);
+}
+
+void
+keyring_search (const SecretSchema *schema,
+                GHashTable         *attributes,
+                SecretSearchFlags   flags,
+                KeyringCallback     callback,
+                gpointer            user_data)
+{
+  KeyringRequest *request = keyring_request_new (KEYRING_SEARCH, schema, attributes);
+
+  request->flags = flags;
+  keyring_queue (request, callback, user_data);
+}
+
+void
+keyring_shutdown (void)
+{
+  KeyringRequest *request;
+  KeyringReply *reply;
+
+  g_mutex_lock (&queue_lock);
+  closed = TRUE;
+  if (worker == NULL) {
+    g_mutex_unlock (&queue_lock);
+    return;
+  }
+  request = keyring_request_new (KEYRING_QUIT, NULL, NULL);
+  g_queue_push_tail (&queue, request);
+  g_cond_signal (&queue_cond);
+  g_mutex_unlock (&queue_lock);
+
+  g_thread_join (worker);
+  worker = NULL;
+
+  // The main loop is over, so the replies it did not dispatch are cancelled
+  // here, which hands every waiter its user_data back.
+  for (;;) {
+    g_mutex_lock (&queue_lock);
+    reply = g_queue_pop_head (&replies);
+    g_mutex_unlock (&queue_lock);
+    if (reply == NULL) {
+      break;
+    }
+
+    g_source_destroy (reply->source);
+    g_source_unref (reply->source);
+    keyring_result_free (reply->op, reply->result);
+    if (reply->error != NULL) {
+      g_error_free (reply->error);
+    }
+    keyring_deliver (reply->waiter, NULL, keyring_cancelled ());
+    g_free (reply);
+  }
+}
@@ -0,0 +1,69 @@
+// Keyring worker header file
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// All libsecret traffic goes through a single background thread that owns a
+// queue of requests, so the GTK main loop never blocks on D-Bus. Every
+// function takes ownership of the attributes table (build it with
+// secret_attributes_build()) and returns immediately.
+//
+// The callback runs in the main context that was the thread default when the
+// request was queued. error is NULL on success. The result is transferred to
+// the callback: a lookup passes the secret text (free it with
+// secret_password_free()), a search passes a GList of SecretItem (free it with
+// g_list_free_full(items, g_object_unref)), stores and clears pass NULL.
+//
+// A store or clear queued right behind another write to the same item
+// replaces it, so only the last one reaches the keyring. The callbacks of
+// both requests are still called.
+
+#ifndef _KEYRING_H_
+#define _KEYRING_H_
+
+#include <libsecret/secret.h>
+
+typedef void (*KeyringCallback) (gpointer      result,
+                                 const GError *error,
+                                 gpointer      user_data);
+
+void keyring_store (const SecretSchema *schema,
+                    GHashTable         *attributes,
+                    const gchar        *label,
+                    const gchar        *secret,
+                    KeyringCallback     callback,
+                    gpointer            user_data);
+
+void keyring_clear (const SecretSchema *schema,
+                    GHashTable         *attributes,
+                    KeyringCallback     callback,
+                    gpointer            user_data);
+
+void keyring_lookup (const SecretSchema *schema,
+                     GHashTable         *attributes,
+                     KeyringCallback     callback,
+                     gpointer            user_data);
+
+void keyring_search (const SecretSchema *schema,
+                     GHashTable         *attributes,
+                     SecretSearchFlags   flags,
+                     KeyringCallback     callback,
+                     gpointer            user_data);
+
+// Waits until every queued request has reached the keyring and stops the
+// worker. Callbacks that the main loop has not dispatched yet are called
+// from here with a G_IO_ERROR_CANCELLED error and no result, even if their
+// request did reach the keyring, so each still gets its user_data back.
+// Requests made from then on are cancelled the same way right away.
+void keyring_shutdown (void);
+
+#endif /* _KEYRING_H_ */
@@ -0,0 +1,136 @@
+// Replay cache for accepted codes
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Slots never become empty again, only expired, so every entry of a window
+// sits before its first empty slot and scans stop there. A triple always
+// takes the first free or expired slot of its window. Two threads marking
+// the same triple at once may still claim different slots when an entry
+// expires between their scans, so after claiming a slot a thread looks for
+// a second live copy. All accesses are sequentially consistent: of two such
+// threads at least one sees the other's entry and reports a replay.
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "replay.h"
+
+#define EXPIRY_BITS 24
+#define EXPIRY_MASK ((1u << EXPIRY_BITS) - 1)
+
+struct replay_cache {
+  uint32_t mask;
+  _Atomic uint64_t *slots;
+};
+
+// splitmix64 finalizer
+static uint64_t replay_mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xBF58476D1CE4E5B9ull;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EBull;
+  x ^= x >> 31;
+  return x;
+}
+
+// Expiry times wrap every 2^24 seconds; an entry is live during the half of
+// that range after now.
+static int replay_live(uint64_t entry, uint32_t now) {
+  uint32_t left = ((uint32_t)entry - now) & EXPIRY_MASK;
+  return left != 0 && left < (1u << (EXPIRY_BITS - 1));
+}
+
+REPLAY_CACHE *replay_cache_new(uint32_t entries) {
+  uint32_t size = REPLAY_PROBES;
+  while (size < entries && size < (1u << 31)) {
+    size <<= 1;
+  }
+
+  REPLAY_CACHE *cache = malloc(sizeof(REPLAY_CACHE));
+  if (!cache) {
+    return NULL;
+  }
+  cache->mask = size - 1;
+  cache->slots = aligned_alloc(64, (size_t)size * sizeof(uint64_t));
+  if (!cache->slots) {
+    free(cache);
+    return NULL;
+  }
+  for (uint32_t i = 0; i < size; ++i) {
+    atomic_init(&cache->slots[i], 0);
+  }
+  return cache;
+}
+
+void replay_cache_free(REPLAY_CACHE *cache) {
+  if (cache) {
+    free(cache->slots);
+    free(cache);
+  }
+}
+
+int replay_cache_mark(REPLAY_CACHE *cache, uint64_t account, uint64_t step,
+                      int code, time_t now, time_t expires) {
+  uint64_t hash = replay_mix(replay_mix(account ^ replay_mix(step)) ^
+                             (uint32_t)code);
+  uint64_t fingerprint = hash >> EXPIRY_BITS;
+  if (!fingerprint) {
+    fingerprint = 1;
+  }
+  uint64_t entry = fingerprint << EXPIRY_BITS | ((uint64_t)expires & EXPIRY_MASK);
+  uint32_t now_bits = (uint32_t)now & EXPIRY_MASK;
+  _Atomic uint64_t *window =
+      cache->slots + ((uint32_t)hash & cache->mask & ~(REPLAY_PROBES - 1u));
+
+  for (;;) {
+    int claim = -1;
+    uint64_t seen = 0;
+
+    for (int i = 0; i < REPLAY_PROBES; ++i) {
+      uint64_t slot = atomic_load(&window[i]);
+      if (slot && replay_live(slot, now_bits)) {
+        if (slot >> EXPIRY_BITS == fingerprint) {
+          return 0;
+        }
+        continue;
+      }
+      if (claim < 0) {
+        claim = i;
+        seen = slot;
+      }
+      if (!slot) {
+        break;
+      }
+    }
+    if (claim < 0) {
+      return -1;
+    }
+
+    // Somebody else took the slot first: look again.
+    if (!atomic_compare_exchange_strong(&window[claim], &seen, entry)) {
+      continue;
+    }
+
+    for (int i = 0; i < REPLAY_PROBES; ++i) {
+      uint64_t slot = atomic_load(&window[i]);
+      if (!slot) {
+        break;
+      }
+      if (i != claim && slot >> EXPIRY_BITS == fingerprint &&
+          replay_live(slot, now_bits)) {
+        return 0;
+      }
+    }
+    return 1;
+  }
+}
@@ -0,0 +1,48 @@
+// Replay cache for accepted codes
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Remembers which (account, step, code) triples were accepted until they
+// expire, so the same code cannot be used twice. The table has a fixed
+// size and never allocates. Every entry is one 64-bit word: a 40-bit
+// fingerprint of the triple and the low 24 bits of its expiry time. Entries
+// are claimed with a compare-and-swap and are reused once expired, so any
+// number of threads may mark codes at once without a lock.
+//
+// A triple probes one window of REPLAY_PROBES slots, two cache lines, so a
+// mark costs the same however full or contended the table is. Two
+// different triples with the same fingerprint (one chance in 2^40 per
+// live entry in the window) make the second look like a replay.
+
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#define REPLAY_PROBES 16
+
+typedef struct replay_cache REPLAY_CACHE;
+
+// A cache of at least "entries" slots, rounded up to a power of two.
+REPLAY_CACHE *replay_cache_new(uint32_t entries);
+
+void replay_cache_free(REPLAY_CACHE *cache);
+
+// Marks the triple as used until "expires". Returns 1 if it was not marked
+// yet, 0 if it was (a replay), or -1 if its window holds no free or expired
+// slot. Expiry times further than about 97 days from now are not supported.
+int replay_cache_mark(REPLAY_CACHE *cache, uint64_t account, uint64_t step,
+                      int code, time_t now, time_t expires);
+
+#endif /* _REPLAY_H_ */
@@ -0,0 +1,370 @@
+// Reverse lookup from codes to accounts
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// A table is built with a counting sort: count the codes of every bucket,
+// turn the counts into bucket starts, then drop every (code, account) pair
+// into its bucket. The tables of a period sit in a ring indexed by step.
+// The list of periods is copied and swapped when a period is added;
+// periods are never dropped, they keep getting empty tables.
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "accounts.h"
+#include "gauth.h"
+#include "reverse.h"
+
+// Tables of t - 1 .. t + 2, and the one of t - 2 that is replaced next
+#define REVERSE_TABLES 5
+
+typedef struct step_table {
+  EPOCH_ENTRY retire;
+  uint64_t step;
+  uint32_t count;
+  int shift;                    // 32 - log2 of the number of buckets
+  ACCOUNT **account;
+  uint32_t *start;              // first entry of each bucket, and the end
+  uint32_t *code;
+} STEP_TABLE;
+
+typedef struct period_tables {
+  int period;
+  _Atomic(STEP_TABLE *) table[REVERSE_TABLES];
+} PERIOD_TABLES;
+
+// Sorted by period
+typedef struct period_list {
+  EPOCH_ENTRY retire;
+  int count;
+  PERIOD_TABLES *periods[];
+} PERIOD_LIST;
+
+struct reverse_index {
+  EPOCH *epoch;
+  _Atomic(PERIOD_LIST *) list;
+  // Scratch space for building
+  uint32_t *fill;
+  uint32_t fill_size;
+  uint32_t *codes;
+  uint32_t codes_size;
+};
+
+static uint32_t reverse_bucket(int shift, uint32_t code) {
+  return (uint32_t)(code * 2654435761u) >> shift;
+}
+
+static void step_table_retired(EPOCH_ENTRY *entry) {
+  STEP_TABLE *table = (STEP_TABLE *)entry;
+  for (uint32_t i = 0; i < table->count; ++i) {
+    account_release(table->account[i]);
+  }
+  free(table);
+}
+
+static void period_list_retired(EPOCH_ENTRY *entry) {
+  free(entry);
+}
+
+REVERSE_INDEX *reverse_index_new(EPOCH *epoch) {
+  REVERSE_INDEX *index = calloc(1, sizeof(REVERSE_INDEX));
+  if (!index) {
+    return NULL;
+  }
+  index->epoch = epoch;
+  atomic_init(&index->list, NULL);
+  return index;
+}
+
+void reverse_index_free(REVERSE_INDEX *index) {
+  if (!index) {
+    return;
+  }
+  PERIOD_LIST *list = atomic_load(&index->list);
+  for (int p = 0; list && p < list->count; ++p) {
+    for (int t = 0; t < REVERSE_TABLES; ++t) {
+      STEP_TABLE *table = atomic_load(&list->periods[p]->table[t]);
+      if (table) {
+        step_table_retired(&table->retire);
+      }
+    }
+    free(list->periods[p]);
+  }
+  free(list);
+  free(index->fill);
+  free(index->codes);
+  free(index);
+}
+
+// Grows a scratch array to at least "size" entries.
+static int reserve(uint32_t **array, uint32_t *size, uint32_t needed) {
+  if (*size >= needed) {
+    return 0;
+  }
+  uint32_t *grown = realloc(*array, needed * sizeof(uint32_t));
+  if (!grown) {
+    return -1;
+  }
+  *array = grown;
+  *size = needed;
+  return 0;
+}
+
+// The code of an account at "step", from its ring if the ring has it.
+static uint32_t reverse_code(const ACCOUNT *account, uint64_t step) {
+  uint64_t last = atomic_load_explicit(&account->codes.last,
+                                       memory_order_acquire);
+  if (last >= step && last < step + STEP_SLOTS) {
+    return atomic_load_explicit(&account->codes.code[step % STEP_SLOTS],
+                                memory_order_relaxed);
+  }
+  return gauth_generate(&account->key, step, account->digits);
+}
+
+static STEP_TABLE *step_table_new(REVERSE_INDEX *index,
+                                  ACCOUNT *const accounts[], uint32_t count,
+                                  uint64_t step) {
+  int bits = 1;
+  while ((1u << bits) < count && bits < 31) {
+    ++bits;
+  }
+  uint32_t buckets = 1u << bits;
+
+  if (reserve(&index->fill, &index->fill_size, buckets) ||
+      reserve(&index->codes, &index->codes_size, count)) {
+    return NULL;
+  }
+  STEP_TABLE *table = malloc(sizeof(STEP_TABLE) +
+                             count * sizeof(ACCOUNT *) +
+                             (buckets + 1 + count) * sizeof(uint32_t));
+  if (!table) {
+    return NULL;
+  }
+  table->retire.release = step_table_retired;
+  table->step = step;
+  table->count = count;
+  table->shift = 32 - bits;
+  table->account = (ACCOUNT **)(table + 1);
+  table->start = (uint32_t *)(table->account + count);
+  table->code = table->start + buckets + 1;
+
+  memset(table->start, 0, (buckets + 1) * sizeof(uint32_t));
+  for (uint32_t i = 0; i < count; ++i) {
+    index->codes[i] = reverse_code(accounts[i], step);
+    ++table->start[reverse_bucket(table->shift, index->codes[i]) + 1];
+  }
+  for (uint32_t b = 0; b < buckets; ++b) {
+    table->start[b + 1] += table->start[b];
+    index->fill[b] = table->start[b];
+  }
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t pos = index->fill[reverse_bucket(table->shift,
+                                              index->codes[i])]++;
+    table->code[pos] = index->codes[i];
+    table->account[pos] = accounts[i];
+    account_hold(accounts[i]);
+  }
+  return table;
+}
+
+// Publishes the table of "step", unless it is there already.
+static int reverse_build(REVERSE_INDEX *index, PERIOD_TABLES *tables,
+                         ACCOUNT *const accounts[], uint32_t count,
+                         uint64_t step) {
+  _Atomic(STEP_TABLE *) *slot = &tables->table[step % REVERSE_TABLES];
+  STEP_TABLE *old = atomic_load_explicit(slot, memory_order_relaxed);
+  if (old && old->step == step) {
+    return 0;
+  }
+  STEP_TABLE *table = step_table_new(index, accounts, count, step);
+  if (!table) {
+    return -1;
+  }
+  atomic_store_explicit(slot, table, memory_order_release);
+  if (old) {
+    epoch_retire(index->epoch, &old->retire);
+  }
+  return 0;
+}
+
+static int compare_account_period(const void *a, const void *b) {
+  return (*(ACCOUNT *const *)a)->period - (*(ACCOUNT *const *)b)->period;
+}
+
+static int compare_tables_period(const void *a, const void *b) {
+  return (*(PERIOD_TABLES *const *)a)->period -
+         (*(PERIOD_TABLES *const *)b)->period;
+}
+
+static int reverse_has_period(const PERIOD_LIST *list, int period) {
+  for (int p = 0; list && p < list->count; ++p) {
+    if (list->periods[p]->period == period) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Starts the tables of the periods of "accounts" (sorted by period) that
+// have none yet, and swaps in a list with them.
+static int reverse_add_periods(REVERSE_INDEX *index, ACCOUNT *accounts[],
+                               int count, time_t now) {
+  PERIOD_LIST *list = atomic_load_explicit(&index->list,
+                                           memory_order_relaxed);
+  int old_count = list ? list->count : 0;
+  int added = 0;
+
+  for (int i = 0; i < count; ++i) {
+    if ((i == 0 || accounts[i]->period != accounts[i - 1]->period) &&
+        !reverse_has_period(list, accounts[i]->period)) {
+      ++added;
+    }
+  }
+  if (!added) {
+    return 0;
+  }
+
+  PERIOD_LIST *grown = malloc(sizeof(PERIOD_LIST) +
+                              (old_count + added) * sizeof(PERIOD_TABLES *));
+  if (!grown) {
+    return -1;
+  }
+  grown->retire.release = period_list_retired;
+  grown->count = old_count;
+  for (int p = 0; p < old_count; ++p) {
+    grown->periods[p] = list->periods[p];
+  }
+
+  int result = 0;
+  for (int i = 0, j; i < count; i = j) {
+    int period = accounts[i]->period;
+    for (j = i; j < count && accounts[j]->period == period;) {
+      ++j;
+    }
+    if (reverse_has_period(list, period)) {
+      continue;
+    }
+    PERIOD_TABLES *tables = calloc(1, sizeof(PERIOD_TABLES));
+    uint64_t step = gauth_totp_step(now, period);
+    for (int k = -1; k <= 2 && tables; ++k) {
+      if (reverse_build(index, tables, accounts + i, j - i, step + k)) {
+        for (int t = 0; t < REVERSE_TABLES; ++t) {
+          STEP_TABLE *table = atomic_load(&tables->table[t]);
+          if (table) {
+            step_table_retired(&table->retire);
+          }
+        }
+        free(tables);
+        tables = NULL;
+      }
+    }
+    if (!tables) {
+      result = -1;
+      continue;
+    }
+    tables->period = period;
+    grown->periods[grown->count++] = tables;
+  }
+
+  qsort(grown->periods, grown->count, sizeof(PERIOD_TABLES *),
+        compare_tables_period);
+  atomic_store_explicit(&index->list, grown, memory_order_release);
+  if (list) {
+    epoch_retire(index->epoch, &list->retire);
+  }
+  return result;
+}
+
+int reverse_index_update(REVERSE_INDEX *index, ACCOUNT *accounts[],
+                         int count, time_t now) {
+  qsort(accounts, count, sizeof(ACCOUNT *), compare_account_period);
+  int result = reverse_add_periods(index, accounts, count, now);
+
+  // Both sorted by period: every period gets its run of accounts.
+  PERIOD_LIST *list = atomic_load_explicit(&index->list,
+                                           memory_order_relaxed);
+  int i = 0;
+  for (int p = 0; list && p < list->count; ++p) {
+    PERIOD_TABLES *tables = list->periods[p];
+    while (i < count && accounts[i]->period < tables->period) {
+      ++i;
+    }
+    int j = i;
+    while (j < count && accounts[j]->period == tables->period) {
+      ++j;
+    }
+    if (reverse_build(index, tables, accounts + i, j - i,
+                      gauth_totp_step(now, tables->period) + 2)) {
+      result = -1;
+    }
+    i = j;
+  }
+  return result;
+}
+
+int reverse_index_ready(const REVERSE_INDEX *index, time_t now) {
+  const PERIOD_LIST *list = atomic_load_explicit(&index->list,
+                                                 memory_order_relaxed);
+  for (int p = 0; list && p < list->count; ++p) {
+    const PERIOD_TABLES *tables = list->periods[p];
+    uint64_t step = gauth_totp_step(now, tables->period) + 2;
+    const STEP_TABLE *table = atomic_load_explicit(
+        &tables->table[step % REVERSE_TABLES], memory_order_relaxed);
+    if (!table || table->step != step) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int reverse_index_lookup(const REVERSE_INDEX *index, time_t now, int window,
+                         int code, REVERSE_MATCH *matches, int max) {
+  static const int offsets[] = { 0, -1, 1 };
+  const PERIOD_LIST *list = atomic_load_explicit(&index->list,
+                                                 memory_order_acquire);
+  int total = 0;
+
+  if (window < 0 || window > 1) {
+    return -1;
+  }
+
+  for (int p = 0; list && p < list->count; ++p) {
+    const PERIOD_TABLES *tables = list->periods[p];
+    uint64_t now_step = gauth_totp_step(now, tables->period);
+    for (int k = 0; k < 2 * window + 1; ++k) {
+      uint64_t step = now_step + offsets[k];
+      const STEP_TABLE *table = atomic_load_explicit(
+          &tables->table[step % REVERSE_TABLES], memory_order_acquire);
+      if (!table || table->step != step) {
+        return -1;
+      }
+
+      uint32_t bucket = reverse_bucket(table->shift, (uint32_t)code);
+      for (uint32_t pos = table->start[bucket];
+           pos < table->start[bucket + 1]; ++pos) {
+        const ACCOUNT *account = table->account[pos];
+        if (table->code[pos] != (uint32_t)code ||
+            atomic_load_explicit(&account->removed, memory_order_relaxed)) {
+          continue;
+        }
+        if (total < max) {
+          matches[total].account = account;
+          matches[total].offset = offsets[k];
+        }
+        ++total;
+      }
+    }
+  }
+  return total;
+}
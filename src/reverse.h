@@ -0,0 +1,73 @@
+// Reverse lookup from codes to accounts
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// For the accounts of every period, maps the code of every account at a step
+// to the accounts that produce it. There is one table per step, built from
+// the step codes of the accounts (see steptable.h) once, when the step is
+// two ahead, so the tables of t - 1 .. t + 1 are always ready. Each table
+// is a bucket array over the codes: finding the accounts of a code is one
+// hash and a scan of a bucket, about one entry long.
+//
+// Different accounts can produce the same code at the same step. A lookup
+// returns all of them, so the caller sees such collisions.
+//
+// One thread builds, any number of threads look up from inside an epoch
+// critical section (see epoch.h). A table never changes once published;
+// the table it replaces is retired, and holds on to its accounts until it
+// is freed. Accounts added after a table was built are missing from it,
+// so lookups find them within three steps; removed ones are skipped at
+// once.
+
+#ifndef _REVERSE_H_
+#define _REVERSE_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include "epoch.h"
+
+struct account;
+
+typedef struct reverse_index REVERSE_INDEX;
+
+typedef struct reverse_match {
+  const struct account *account;
+  int offset;                   // step offset of the match
+} REVERSE_MATCH;
+
+REVERSE_INDEX *reverse_index_new(EPOCH *epoch);
+
+// Frees all tables. No reader may be inside a critical section.
+void reverse_index_free(REVERSE_INDEX *index);
+
+// Indexes the codes of "count" accounts, in any order, at the step after
+// next of their period, and from the step before the current one for a
+// period not seen before. Codes missing from the step rings are computed.
+// Sorts "accounts" by period. Returns -1 if out of memory.
+int reverse_index_update(REVERSE_INDEX *index, struct account *accounts[],
+                         int count, time_t now);
+
+// Whether every period indexed so far has its table of the step after
+// next, so that reverse_index_update() would only start new periods. Only
+// for the thread that builds.
+int reverse_index_ready(const REVERSE_INDEX *index, time_t now);
+
+// Finds the accounts whose code at the current step, or within "window"
+// (0 or 1) steps of it, is "code". Stores up to "max" matches, closest step
+// first for each period, and returns the number of matches there are, or
+// -1 if the tables for the window are not ready.
+int reverse_index_lookup(const REVERSE_INDEX *index, time_t now, int window,
+                         int code, REVERSE_MATCH *matches, int max);
+
+#endif /* _REVERSE_H_ */
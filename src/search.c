@@ -0,0 +1,283 @@
+// Account name search index
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "config.h"
+
+#include <string.h>
+
+#include "search.h"
+
+#define TRIGRAM_LEN 3
+
+// A slot in the list of a trigram, and which of its entries points back
+typedef struct posting {
+  guint slot;
+  guint entry;
+} POSTING;
+
+// A trigram of a slot, and where the slot sits in its list
+typedef struct entry {
+  gpointer trigram;
+  guint position;
+} ENTRY;
+
+struct search_index {
+  GPtrArray *names;       // case-folded name of each slot, NULL when free
+  GPtrArray *entries;     // GArray of ENTRY for each slot
+  GHashTable *trigrams;   // packed trigram -> GArray of POSTING
+  gchar *query;           // case-folded, NULL when every slot matches
+  GArray *matched;        // one bit per slot
+  GArray *hits;           // slots whose bit may be set, some more than once
+};
+
+static gpointer
+trigram_at (const gchar *text)
+{
+  guint32 trigram = (guchar) text[0] << 16 | (guchar) text[1] << 8 | (guchar) text[2];
+
+  return GUINT_TO_POINTER (trigram);
+}
+
+static gboolean
+slot_marked (SEARCH_INDEX *index,
+             guint         slot)
+{
+  return slot / 32 < index->matched->len &&
+         (g_array_index (index->matched, guint32, slot / 32) >> slot % 32 & 1);
+}
+
+static void
+unmark_slot (SEARCH_INDEX *index,
+             guint         slot)
+{
+  if (slot / 32 < index->matched->len) {
+    g_array_index (index->matched, guint32, slot / 32) &= ~(1u << slot % 32);
+  }
+}
+
+/*
+ * Slots removed while a query is active stay in hits, and come again if
+ * they match once reused. Keeps only the marked slots, each once: its bit
+ * is cleared when it is kept, so later copies are dropped, and set again.
+ */
+static void
+compact_hits (SEARCH_INDEX *index)
+{
+  guint kept = 0;
+
+  for (guint i = 0; i < index->hits->len; i++) {
+    guint slot = g_array_index (index->hits, guint, i);
+
+    if (slot_marked (index, slot)) {
+      unmark_slot (index, slot);
+      g_array_index (index->hits, guint, kept++) = slot;
+    }
+  }
+  g_array_set_size (index->hits, kept);
+  for (guint i = 0; i < kept; i++) {
+    guint slot = g_array_index (index->hits, guint, i);
+
+    g_array_index (index->matched, guint32, slot / 32) |= 1u << slot % 32;
+  }
+}
+
+static void
+mark_slot (SEARCH_INDEX *index,
+           guint         slot)
+{
+  guint word = slot / 32;
+
+  if (slot_marked (index, slot)) {
+    return;
+  }
+  // Twice as many hits as slots: at least half of them are stale.
+  if (index->hits->len >= 2 * index->names->len) {
+    compact_hits (index);
+  }
+  if (word >= index->matched->len) {
+    g_array_set_size (index->matched, word + 1);
+  }
+  g_array_index (index->matched, guint32, word) |= 1u << slot % 32;
+  g_array_append_val (index->hits, slot);
+}
+
+SEARCH_INDEX *
+search_index_new (void)
+{
+  SEARCH_INDEX *index = g_new0 (SEARCH_INDEX, 1);
+
+  index->names = g_ptr_array_new_with_free_func (g_free);
+  index->entries = g_ptr_array_new_with_free_func ((GDestroyNotify) g_array_unref);
+  index->trigrams = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                           (GDestroyNotify) g_array_unref);
+  index->matched = g_array_new (FALSE, TRUE, sizeof (guint32));
+  index->hits = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  return index;
+}
+
+void
+search_index_free (SEARCH_INDEX *index)
+{
+  g_ptr_array_unref (index->names);
+  g_ptr_array_unref (index->entries);
+  g_hash_table_unref (index->trigrams);
+  g_free (index->query);
+  g_array_unref (index->matched);
+  g_array_unref (index->hits);
+  g_free (index);
+}
+
+void
+search_index_add (SEARCH_INDEX *index,
+                  guint         slot,
+                  const gchar  *name)
+{
+  gchar *folded = g_utf8_casefold (name, -1);
+  size_t length = strlen (folded);
+  GArray *entries;
+
+  search_index_remove (index, slot);
+  if (slot >= index->names->len) {
+    g_ptr_array_set_size (index->names, slot + 1);
+    g_ptr_array_set_size (index->entries, slot + 1);
+  }
+  entries = g_array_new (FALSE, FALSE, sizeof (ENTRY));
+  g_ptr_array_index (index->names, slot) = folded;
+  g_ptr_array_index (index->entries, slot) = entries;
+
+  for (size_t i = 0; i + TRIGRAM_LEN <= length; i++) {
+    gpointer trigram = trigram_at (folded + i);
+    GArray *postings = g_hash_table_lookup (index->trigrams, trigram);
+    POSTING posting = { slot, entries->len };
+    ENTRY entry = { trigram, 0 };
+
+    if (postings == NULL) {
+      postings = g_array_new (FALSE, FALSE, sizeof (POSTING));
+      g_hash_table_insert (index->trigrams, trigram, postings);
+    }
+
+    // A trigram that repeats within the name was just added for this slot.
+    if (postings->len > 0 &&
+        g_array_index (postings, POSTING, postings->len - 1).slot == slot) {
+      continue;
+    }
+    entry.position = postings->len;
+    g_array_append_val (postings, posting);
+    g_array_append_val (entries, entry);
+  }
+
+  if (index->query != NULL && strstr (folded, index->query) != NULL) {
+    mark_slot (index, slot);
+  }
+}
+
+void
+search_index_remove (SEARCH_INDEX *index,
+                     guint         slot)
+{
+  GArray *entries;
+
+  if (slot >= index->names->len || g_ptr_array_index (index->names, slot) == NULL) {
+    return;
+  }
+
+  // Each entry knows the position of the slot in its list, so removing it
+  // never scans a list, however common the trigram.
+  entries = g_ptr_array_index (index->entries, slot);
+  for (guint i = 0; i < entries->len; i++) {
+    const ENTRY *entry = &g_array_index (entries, ENTRY, i);
+    GArray *postings = g_hash_table_lookup (index->trigrams, entry->trigram);
+    POSTING last = g_array_index (postings, POSTING, postings->len - 1);
+
+    // The last posting moves into the hole and its entry follows it.
+    g_array_index (postings, POSTING, entry->position) = last;
+    g_array_set_size (postings, postings->len - 1);
+    if (entry->position < postings->len) {
+      GArray *moved = g_ptr_array_index (index->entries, last.slot);
+
+      g_array_index (moved, ENTRY, last.entry).position = entry->position;
+    }
+    if (postings->len == 0) {
+      g_hash_table_remove (index->trigrams, entry->trigram);
+    }
+  }
+
+  unmark_slot (index, slot);
+  g_array_unref (entries);
+  g_ptr_array_index (index->entries, slot) = NULL;
+  g_free (g_ptr_array_index (index->names, slot));
+  g_ptr_array_index (index->names, slot) = NULL;
+}
+
+void
+search_index_set_query (SEARCH_INDEX *index,
+                        const gchar  *query)
+{
+  gchar *folded = *query != '\0' ? g_utf8_casefold (query, -1) : NULL;
+  size_t length = folded != NULL ? strlen (folded) : 0;
+
+  // Only the bits of the last matches are set, so clearing them is cheap.
+  for (guint i = 0; i < index->hits->len; i++) {
+    unmark_slot (index, g_array_index (index->hits, guint, i));
+  }
+  g_array_set_size (index->hits, 0);
+  g_free (index->query);
+  index->query = folded;
+
+  if (folded == NULL) {
+    return;
+  }
+
+  if (length < TRIGRAM_LEN) {
+    for (guint slot = 0; slot < index->names->len; slot++) {
+      const gchar *name = g_ptr_array_index (index->names, slot);
+
+      if (name != NULL && strstr (name, folded) != NULL) {
+        mark_slot (index, slot);
+      }
+    }
+  } else {
+    GArray *rarest = NULL;
+
+    // Every match contains all trigrams of the query, so the shortest list
+    // holds all candidates.
+    for (size_t i = 0; i + TRIGRAM_LEN <= length; i++) {
+      GArray *postings = g_hash_table_lookup (index->trigrams, trigram_at (folded + i));
+
+      if (postings == NULL) {
+        rarest = NULL;
+        break;
+      }
+      if (rarest == NULL || postings->len < rarest->len) {
+        rarest = postings;
+      }
+    }
+
+    for (guint j = 0; rarest != NULL && j < rarest->len; j++) {
+      guint slot = g_array_index (rarest, POSTING, j).slot;
+
+      if (strstr (g_ptr_array_index (index->names, slot), folded) != NULL) {
+        mark_slot (index, slot);
+      }
+    }
+  }
+}
+
+gboolean
+search_index_matches (SEARCH_INDEX *index,
+                      guint         slot)
+{
+  return index->query == NULL || slot_marked (index, slot);
+}
@@ -0,0 +1,52 @@
+// Account name search index header file
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Case-insensitive substring search over account names, keyed by the slot
+// of each account. Every trigram (three consecutive bytes of the case-folded
+// name) maps to the slots whose name contains it. A query of three bytes or
+// more only checks the slots of its rarest trigram; shorter queries scan all
+// names. The result is a bitmap of the matching slots, kept up to date as
+// names come and go, which a GtkTreeModelFilter over the full list tests
+// row by row. Adding and removing a name only touches the lists of its own
+// trigrams, and each slot remembers where it sits in them, so removing it
+// costs the same however common its trigrams are.
+
+#ifndef _SEARCH_H_
+#define _SEARCH_H_
+
+#include <glib.h>
+
+typedef struct search_index SEARCH_INDEX;
+
+SEARCH_INDEX *search_index_new (void);
+
+void search_index_free (SEARCH_INDEX *index);
+
+void search_index_add (SEARCH_INDEX *index,
+                       guint         slot,
+                       const gchar  *name);
+
+void search_index_remove (SEARCH_INDEX *index,
+                          guint         slot);
+
+// Makes query the current search. An empty query matches every slot.
+void search_index_set_query (SEARCH_INDEX *index,
+                             const gchar  *query);
+
+// Whether the name of slot contains the current query. Names added and
+// removed after search_index_set_query() are taken into account.
+gboolean search_index_matches (SEARCH_INDEX *index,
+                               guint         slot);
+
+#endif /* _SEARCH_H_ */
@@ -46,6 +46,7 @@
 #include <string.h>
 
 #include "sha1.h"
+#include "sha1_hw.h"
 
 #if !defined(BYTE_ORDER)
 #if defined(_BIG_ENDIAN)
@@ -104,12 +105,126 @@
     A = T32(R32(B,5) + f##n(C,D,E) + T + *WP++ + CONST##n); C = R32(C,30)
 
 
+static void
+sha1_rounds(uint32_t *digest, const uint32_t *W)
+{
+#if !defined(UNRAVEL) && !defined(UNROLL_LOOPS)
+    int i;
+#endif
+    uint32_t T, A, B, C, D, E;
+    const uint32_t *WP;
+
+    A = digest[0];
+    B = digest[1];
+    C = digest[2];
+    D = digest[3];
+    E = digest[4];
+    WP = W;
+#ifdef UNRAVEL
+    FA(1); FB(1); FC(1); FD(1); FE(1); FT(1); FA(1); FB(1); FC(1); FD(1);
+    FE(1); FT(1); FA(1); FB(1); FC(1); FD(1); FE(1); FT(1); FA(1); FB(1);
+    FC(2); FD(2); FE(2); FT(2); FA(2); FB(2); FC(2); FD(2); FE(2); FT(2);
+    FA(2); FB(2); FC(2); FD(2); FE(2); FT(2); FA(2); FB(2); FC(2); FD(2);
+    FE(3); FT(3); FA(3); FB(3); FC(3); FD(3); FE(3); FT(3); FA(3); FB(3);
+    FC(3); FD(3); FE(3); FT(3); FA(3); FB(3); FC(3); FD(3); FE(3); FT(3);
+    FA(4); FB(4); FC(4); FD(4); FE(4); FT(4); FA(4); FB(4); FC(4); FD(4);
+    FE(4); FT(4); FA(4); FB(4); FC(4); FD(4); FE(4); FT(4); FA(4); FB(4);
+    digest[0] = T32(digest[0] + E);
+    digest[1] = T32(digest[1] + T);
+    digest[2] = T32(digest[2] + A);
+    digest[3] = T32(digest[3] + B);
+    digest[4] = T32(digest[4] + C);
+#else /* !UNRAVEL */
+#ifdef UNROLL_LOOPS
+    FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1);
+    FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1);
+    FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2);
+    FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2);
+    FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3);
+    FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3);
+    FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4);
+    FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4);
+#else /* !UNROLL_LOOPS */
+    for (i =  0; i < 20; ++i) { FG(1); }
+    for (i = 20; i < 40; ++i) { FG(2); }
+    for (i = 40; i < 60; ++i) { FG(3); }
+    for (i = 60; i < 80; ++i) { FG(4); }
+#endif /* !UNROLL_LOOPS */
+    digest[0] = T32(digest[0] + A);
+    digest[1] = T32(digest[1] + B);
+    digest[2] = T32(digest[2] + C);
+    digest[3] = T32(digest[3] + D);
+    digest[4] = T32(digest[4] + E);
+#endif /* !UNRAVEL */
+}
+
+/* expand the message schedule and run the rounds in portable C */
+
+static void
+sha1_compress_portable(uint32_t digest[5], const uint32_t block[16])
+{
+    int i;
+    uint32_t W[80];
+
+    for (i = 0; i < 16; ++i) {
+    W[i] = block[i];
+    }
+    for (i = 16; i < 80; ++i) {
+    W[i] = W[i-3] ^ W[i-8] ^ W[i-14] ^ W[i-16];
+    W[i] = R32(W[i], 1);
+    }
+    sha1_rounds(digest, W);
+}
+
+/*
+ * Block compression backend. The portable code is the fallback; a hardware
+ * implementation is selected once, before main() runs, if the CPU has one.
+ */
+static void (*sha1_compress)(uint32_t digest[5], const uint32_t block[16]) =
+    sha1_compress_portable;
+
+/*
+ * Multi-buffer backend, compressing sha1_mb_width independent blocks per
+ * call. Without one, sha1_mb_width is 1 and the tails run one at a time.
+ */
+static void (*sha1_mb_compress)(uint32_t *state, const uint32_t *block);
+static int sha1_mb_width = 1;
+
+__attribute__((constructor))
+static void
+sha1_select_backend(void)
+{
+#ifdef SHA1_HAVE_SHANI
+    if (sha1_shani_supported()) {
+        sha1_compress = sha1_compress_shani;
+    }
+#endif
+#ifdef SHA1_HAVE_ARMV8
+    if (sha1_armv8_supported()) {
+        sha1_compress = sha1_compress_armv8;
+    }
+#endif
+#ifdef SHA1_HAVE_MB
+    if (sha1_mb_supported(16)) {
+        sha1_mb_compress = sha1_mb_compress_avx512;
+        sha1_mb_width = 16;
+    } else if (sha1_mb_supported(8)) {
+        sha1_mb_compress = sha1_mb_compress_avx2;
+        sha1_mb_width = 8;
+    } else if (sha1_mb_supported(4) && sha1_compress == sha1_compress_portable) {
+        // Four SSE lanes do not beat one block through SHA-NI.
+        sha1_mb_compress = sha1_mb_compress_sse41;
+        sha1_mb_width = 4;
+    }
+#endif
+}
+
 static void
 sha1_transform(SHA1_INFO *sha1_info)
 {
     int i;
     uint8_t *dp;
-    uint32_t T, A, B, C, D, E, W[80], *WP;
+    uint32_t T, W[16];
 
     dp = sha1_info->data;
 
@@ -168,52 +283,7 @@ sha1_transform(SHA1_INFO *sha1_info)
     }
 #endif /* SWAP_DONE */
 
-    for (i = 16; i < 80; ++i) {
-    W[i] = W[i-3] ^ W[i-8] ^ W[i-14] ^ W[i-16];
-    W[i] = R32(W[i], 1);
-    }
-    A = sha1_info->digest[0];
-    B = sha1_info->digest[1];
-    C = sha1_info->digest[2];
-    D = sha1_info->digest[3];
-    E = sha1_info->digest[4];
-    WP = W;
-#ifdef UNRAVEL
-    FA(1); FB(1); FC(1); FD(1); FE(1); FT(1); FA(1); FB(1); FC(1); FD(1);
-    FE(1); FT(1); FA(1); FB(1); FC(1); FD(1); FE(1); FT(1); FA(1); FB(1);
-    FC(2); FD(2); FE(2); FT(2); FA(2); FB(2); FC(2); FD(2); FE(2); FT(2);
-    FA(2); FB(2); FC(2); FD(2); FE(2); FT(2); FA(2); FB(2); FC(2); FD(2);
-    FE(3); FT(3); FA(3); FB(3); FC(3); FD(3); FE(3); FT(3); FA(3); FB(3);
-    FC(3); FD(3); FE(3); FT(3); FA(3); FB(3); FC(3); FD(3); FE(3); FT(3);
-    FA(4); FB(4); FC(4); FD(4); FE(4); FT(4); FA(4); FB(4); FC(4); FD(4);
-    FE(4); FT(4); FA(4); FB(4); FC(4); FD(4); FE(4); FT(4); FA(4); FB(4);
-    sha1_info->digest[0] = T32(sha1_info->digest[0] + E);
-    sha1_info->digest[1] = T32(sha1_info->digest[1] + T);
-    sha1_info->digest[2] = T32(sha1_info->digest[2] + A);
-    sha1_info->digest[3] = T32(sha1_info->digest[3] + B);
-    sha1_info->digest[4] = T32(sha1_info->digest[4] + C);
-#else /* !UNRAVEL */
-#ifdef UNROLL_LOOPS
-    FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1);
-    FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1);
-    FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2);
-    FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2);
-    FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3);
-    FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3);
-    FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4);
-    FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4);
-#else /* !UNROLL_LOOPS */
-    for (i =  0; i < 20; ++i) { FG(1); }
-    for (i = 20; i < 40; ++i) { FG(2); }
-    for (i = 40; i < 60; ++i) { FG(3); }
-    for (i = 60; i < 80; ++i) { FG(4); }
-#endif /* !UNROLL_LOOPS */
-    sha1_info->digest[0] = T32(sha1_info->digest[0] + A);
-    sha1_info->digest[1] = T32(sha1_info->digest[1] + B);
-    sha1_info->digest[2] = T32(sha1_info->digest[2] + C);
-    sha1_info->digest[3] = T32(sha1_info->digest[3] + D);
-    sha1_info->digest[4] = T32(sha1_info->digest[4] + E);
-#endif /* !UNRAVEL */
+    sha1_compress(sha1_info->digest, W);
 }
 
 /* initialize the SHA digest */
@@ -231,6 +301,21 @@ sha1_init(SHA1_INFO *sha1_info)
     sha1_info->local = 0;
 }
 
+/* resume a SHA digest after one full block with the given chaining value */
+
+void
+sha1_resume(SHA1_INFO *sha1_info, const uint32_t midstate[5])
+{
+    sha1_info->digest[0] = midstate[0];
+    sha1_info->digest[1] = midstate[1];
+    sha1_info->digest[2] = midstate[2];
+    sha1_info->digest[3] = midstate[3];
+    sha1_info->digest[4] = midstate[4];
+    sha1_info->count_lo = SHA1_BLOCKSIZE << 3;
+    sha1_info->count_hi = 0L;
+    sha1_info->local = 0;
+}
+
 /* update the SHA digest */
 
 void
@@ -296,6 +381,176 @@ sha1_transform_and_copy(unsigned char digest[20], SHA1_INFO *sha1_info)
     digest[19] = (unsigned char) ((sha1_info->digest[4]      ) & 0xff);
 }
 
+/*
+ * Message schedules of the padding of the last block of HMAC-SHA1 over an
+ * 8-byte message (72 bytes in total after the key block) and of the outer
+ * hash over a 20-byte digest (84 bytes in total). Only the 0x80 byte and the
+ * bit length are non-zero, so their contribution to W[] is the same for
+ * every key and message and the schedule is linear in its input.
+ */
+static const uint32_t sha1_tail8_w[80] = {
+    0x00000000, 0x00000000, 0x80000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000240,
+    0x00000001, 0x00000000, 0x00000481, 0x00000002,
+    0x00000000, 0x00000902, 0x00000004, 0x00000480,
+    0x00001206, 0x00000008, 0x00000002, 0x00002408,
+    0x00000010, 0x00001680, 0x0000481a, 0x00000da0,
+    0x0000000c, 0x00009020, 0x00001246, 0x00005a08,
+    0x00012068, 0x00001288, 0x00000020, 0x00025280,
+    0x00000100, 0x00016800, 0x000481a8, 0x0000d300,
+    0x000000c4, 0x00091000, 0x0001366c, 0x00059f88,
+    0x00120694, 0x00012888, 0x0000581c, 0x00253a28,
+    0x00001008, 0x00161028, 0x00481ac8, 0x000d6a00,
+    0x00012c28, 0x00911280, 0x001366e0, 0x005baa00,
+    0x01206840, 0x0013f280, 0x00010060, 0x02536a80,
+    0x00010040, 0x01680080, 0x048088e8, 0x00d30080,
+    0x0000c400, 0x09100080, 0x01366c00, 0x059fac00,
+    0x12069410, 0x0129a800, 0x00585490, 0x253b9820,
+    0x00100840, 0x16119820, 0x481be800, 0x0d699c80,
+};
+static const uint32_t sha1_tail20_w[80] = {
+    0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x80000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x000002a0,
+    0x00000000, 0x00000000, 0x00000540, 0x00000001,
+    0x00000000, 0x00000a81, 0x00000002, 0x00000540,
+    0x00001502, 0x00000004, 0x00000000, 0x00002a06,
+    0x00000008, 0x00001042, 0x00005408, 0x00000fd0,
+    0x00000000, 0x0000a81a, 0x00001520, 0x0000410c,
+    0x00015020, 0x00001546, 0x00000008, 0x0002b568,
+    0x00000088, 0x00010420, 0x00054080, 0x0000f780,
+    0x00000000, 0x000a94a8, 0x00014700, 0x00042544,
+    0x00150200, 0x0001546c, 0x00004188, 0x002b4394,
+    0x00000888, 0x0010ea1c, 0x00540828, 0x000f3908,
+    0x00015028, 0x00a95fc8, 0x00147000, 0x0040e128,
+    0x01502080, 0x001457e0, 0x00015800, 0x02b4d140,
+    0x00008880, 0x01042060, 0x0541d080, 0x00f78040,
+    0x00000080, 0x0a94a8e8, 0x01470080, 0x04256e00,
+    0x15020080, 0x01553c00, 0x0041dc00, 0x2b426c10,
+    0x00088800, 0x10ebe490, 0x54097820, 0x0f3a2e40,
+};
+
+/*
+ * Compress the last block of a message made of one 64-byte block, whose
+ * chaining value is midstate, followed by "words" message words. The
+ * padding is already expanded in pad_w, so only the message words have to
+ * go through the schedule. The loops are fully unrolled so that the zero
+ * words and the pad_w entries fold into constants. Hardware backends do
+ * their own schedule and just get the padded block.
+ */
+static inline void
+sha1_tail(const uint32_t midstate[5], const uint32_t *msg, int words,
+          const uint32_t pad_w[80], uint32_t digest[5])
+{
+    int i;
+    uint32_t V[80], W[80];
+
+    if (sha1_compress != sha1_compress_portable) {
+        for (i = 0; i < 16; ++i) {
+            W[i] = i < words ? msg[i] : pad_w[i];
+        }
+        for (i = 0; i < 5; ++i) {
+            digest[i] = midstate[i];
+        }
+        sha1_compress(digest, W);
+        return;
+    }
+
+#pragma GCC unroll 16
+    for (i = 0; i < 16; ++i) {
+        V[i] = i < words ? msg[i] : 0;
+        W[i] = V[i] ^ pad_w[i];
+    }
+#pragma GCC unroll 64
+    for (i = 16; i < 80; ++i) {
+        V[i] = V[i-3] ^ V[i-8] ^ V[i-14] ^ V[i-16];
+        V[i] = R32(V[i], 1);
+        W[i] = V[i] ^ pad_w[i];
+    }
+    for (i = 0; i < 5; ++i) {
+        digest[i] = midstate[i];
+    }
+    sha1_rounds(digest, W);
+}
+
+/* last block of a 64-byte block followed by an 8-byte message */
+void
+sha1_tail8(const uint32_t midstate[5], const uint32_t msg[2],
+           uint32_t digest[5])
+{
+    sha1_tail(midstate, msg, 2, sha1_tail8_w, digest);
+}
+
+/* last block of a 64-byte block followed by a 20-byte message */
+void
+sha1_tail20(const uint32_t midstate[5], const uint32_t msg[5],
+            uint32_t digest[5])
+{
+    sha1_tail(midstate, msg, 5, sha1_tail20_w, digest);
+}
+
+/* number of messages that sha1_mb_tail8() and sha1_mb_tail20() take */
+int
+sha1_mb_lanes(void)
+{
+    return sha1_mb_width;
+}
+
+/*
+ * sha1_tail() for sha1_mb_width messages at once. msg holds "words" words
+ * per message and digest 5 words per message, one message after another.
+ */
+static void
+sha1_mb_tail(const uint32_t *const midstate[], const uint32_t *msg, int words,
+             const uint32_t pad_w[80], uint32_t *digest)
+{
+    int i, j;
+    int lanes = sha1_mb_width;
+    uint32_t state[5 * SHA1_MB_MAX_LANES];
+    uint32_t block[16 * SHA1_MB_MAX_LANES];
+
+    if (sha1_mb_compress == NULL) {
+        for (j = 0; j < lanes; ++j) {
+            sha1_tail(midstate[j], msg + j * words, words, pad_w, digest + 5 * j);
+        }
+        return;
+    }
+
+    for (i = 0; i < 5; ++i) {
+        for (j = 0; j < lanes; ++j) {
+            state[i * lanes + j] = midstate[j][i];
+        }
+    }
+    for (i = 0; i < 16; ++i) {
+        for (j = 0; j < lanes; ++j) {
+            block[i * lanes + j] = i < words ? msg[j * words + i] : pad_w[i];
+        }
+    }
+    sha1_mb_compress(state, block);
+    for (j = 0; j < lanes; ++j) {
+        for (i = 0; i < 5; ++i) {
+            digest[5 * j + i] = state[i * lanes + j];
+        }
+    }
+}
+
+void
+sha1_mb_tail8(const uint32_t *const midstate[], const uint32_t msg[][2],
+              uint32_t digest[][5])
+{
+    sha1_mb_tail(midstate, msg[0], 2, sha1_tail8_w, digest[0]);
+}
+
+void
+sha1_mb_tail20(const uint32_t *const midstate[], const uint32_t msg[][5],
+               uint32_t digest[][5])
+{
+    sha1_mb_tail(midstate, msg[0], 5, sha1_tail20_w, digest[0]);
+}
+
 /* finish computing the SHA digest */
 void
 sha1_final(SHA1_INFO *sha1_info, uint8_t digest[20])
@@ -31,9 +31,32 @@ typedef struct {
 } SHA1_INFO;
 
 void sha1_init(SHA1_INFO *sha1_info) __attribute__((visibility("hidden")));
+void sha1_resume(SHA1_INFO *sha1_info, const uint32_t midstate[5])
+  __attribute__((visibility("hidden")));
 void sha1_update(SHA1_INFO *sha1_info, const uint8_t *buffer, int count)
   __attribute__((visibility("hidden")));
 void sha1_final(SHA1_INFO *sha1_info, uint8_t digest[20])
   __attribute__((visibility("hidden")));
 
+// Fixed-shape last blocks for HMAC-SHA1 over an 8-byte counter: resume from
+// the chaining value of a 64-byte key block and hash 2 (or 5) big-endian
+// message words. The result is the chaining value, not serialized.
+void sha1_tail8(const uint32_t midstate[5], const uint32_t msg[2],
+                uint32_t digest[5])
+  __attribute__((visibility("hidden")));
+void sha1_tail20(const uint32_t midstate[5], const uint32_t msg[5],
+                 uint32_t digest[5])
+  __attribute__((visibility("hidden")));
+
+// The same for sha1_mb_lanes() independent messages at once, spread over
+// SIMD lanes when the CPU supports it. Every call takes exactly
+// sha1_mb_lanes() midstates, messages and digests.
+int sha1_mb_lanes(void) __attribute__((visibility("hidden")));
+void sha1_mb_tail8(const uint32_t *const midstate[], const uint32_t msg[][2],
+                   uint32_t digest[][5])
+  __attribute__((visibility("hidden")));
+void sha1_mb_tail20(const uint32_t *const midstate[], const uint32_t msg[][5],
+                    uint32_t digest[][5])
+  __attribute__((visibility("hidden")));
+
 #endif
@@ -0,0 +1,124 @@
+// SHA1 block compression with the ARMv8 cryptography extensions
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// The function is compiled for the crypto extensions through the target
+// attribute, so the rest of the program still runs on cores without them.
+
+#include "sha1_hw.h"
+
+#ifdef SHA1_HAVE_ARMV8
+
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#if defined(__clang__)
+#define ARMV8_TARGET __attribute__((target("crypto")))
+#else
+#define ARMV8_TARGET __attribute__((target("+crypto")))
+#endif
+
+#include <arm_neon.h>
+
+int
+sha1_armv8_supported(void)
+{
+#if defined(__linux__) && defined(HWCAP_SHA1)
+    return (getauxval(AT_HWCAP) & HWCAP_SHA1) != 0;
+#elif defined(__APPLE__)
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+#define K1 0x5a827999
+#define K2 0x6ed9eba1
+#define K3 0x8f1bbcdc
+#define K4 0xca62c1d6
+
+/*
+ * Rounds 4*n .. 4*n+3: run the group whose message plus constant is in Ta,
+ * prepare the group two steps ahead in Ta, and advance the schedule.
+ */
+#define ARMV8_ROUNDS(op, Ea, Eb, Ta, M0, M1, M2, M3, K) \
+    Eb = vsha1h_u32(vgetq_lane_u32(ABCD, 0));           \
+    ABCD = op(ABCD, Ea, Ta);                             \
+    Ta = vaddq_u32(M2, vdupq_n_u32(K));                  \
+    M3 = vsha1su1q_u32(M3, M2);                          \
+    M0 = vsha1su0q_u32(M0, M1, M2)
+
+ARMV8_TARGET void
+sha1_compress_armv8(uint32_t digest[5], const uint32_t block[16])
+{
+    uint32x4_t ABCD, ABCD_SAVE, TMP0, TMP1;
+    uint32x4_t MSG0, MSG1, MSG2, MSG3;
+    uint32_t E0, E0_SAVE, E1;
+
+    ABCD = vld1q_u32(digest);
+    E0 = digest[4];
+    ABCD_SAVE = ABCD;
+    E0_SAVE = E0;
+
+    MSG0 = vld1q_u32(block +  0);
+    MSG1 = vld1q_u32(block +  4);
+    MSG2 = vld1q_u32(block +  8);
+    MSG3 = vld1q_u32(block + 12);
+
+    TMP0 = vaddq_u32(MSG0, vdupq_n_u32(K1));
+    TMP1 = vaddq_u32(MSG1, vdupq_n_u32(K1));
+
+    /* Rounds 0-3 */
+    E1 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+    ABCD = vsha1cq_u32(ABCD, E0, TMP0);
+    TMP0 = vaddq_u32(MSG2, vdupq_n_u32(K1));
+    MSG0 = vsha1su0q_u32(MSG0, MSG1, MSG2);
+
+    /* Rounds 4-71 */
+    ARMV8_ROUNDS(vsha1cq_u32, E1, E0, TMP1, MSG1, MSG2, MSG3, MSG0, K1);
+    ARMV8_ROUNDS(vsha1cq_u32, E0, E1, TMP0, MSG2, MSG3, MSG0, MSG1, K1);
+    ARMV8_ROUNDS(vsha1cq_u32, E1, E0, TMP1, MSG3, MSG0, MSG1, MSG2, K2);
+    ARMV8_ROUNDS(vsha1cq_u32, E0, E1, TMP0, MSG0, MSG1, MSG2, MSG3, K2);
+    ARMV8_ROUNDS(vsha1pq_u32, E1, E0, TMP1, MSG1, MSG2, MSG3, MSG0, K2);
+    ARMV8_ROUNDS(vsha1pq_u32, E0, E1, TMP0, MSG2, MSG3, MSG0, MSG1, K2);
+    ARMV8_ROUNDS(vsha1pq_u32, E1, E0, TMP1, MSG3, MSG0, MSG1, MSG2, K2);
+    ARMV8_ROUNDS(vsha1pq_u32, E0, E1, TMP0, MSG0, MSG1, MSG2, MSG3, K3);
+    ARMV8_ROUNDS(vsha1pq_u32, E1, E0, TMP1, MSG1, MSG2, MSG3, MSG0, K3);
+    ARMV8_ROUNDS(vsha1mq_u32, E0, E1, TMP0, MSG2, MSG3, MSG0, MSG1, K3);
+    ARMV8_ROUNDS(vsha1mq_u32, E1, E0, TMP1, MSG3, MSG0, MSG1, MSG2, K3);
+    ARMV8_ROUNDS(vsha1mq_u32, E0, E1, TMP0, MSG0, MSG1, MSG2, MSG3, K3);
+    ARMV8_ROUNDS(vsha1mq_u32, E1, E0, TMP1, MSG1, MSG2, MSG3, MSG0, K4);
+    ARMV8_ROUNDS(vsha1mq_u32, E0, E1, TMP0, MSG2, MSG3, MSG0, MSG1, K4);
+    ARMV8_ROUNDS(vsha1pq_u32, E1, E0, TMP1, MSG3, MSG0, MSG1, MSG2, K4);
+    ARMV8_ROUNDS(vsha1pq_u32, E0, E1, TMP0, MSG0, MSG1, MSG2, MSG3, K4);
+    ARMV8_ROUNDS(vsha1pq_u32, E1, E0, TMP1, MSG1, MSG2, MSG3, MSG0, K4);
+
+    /* Rounds 72-75 */
+    E1 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+    ABCD = vsha1pq_u32(ABCD, E0, TMP0);
+
+    /* Rounds 76-79 */
+    E0 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+    ABCD = vsha1pq_u32(ABCD, E1, TMP1);
+
+    /* Add the chaining value */
+    E0 += E0_SAVE;
+    ABCD = vaddq_u32(ABCD_SAVE, ABCD);
+
+    vst1q_u32(digest, ABCD);
+    digest[4] = E0;
+}
+
+#endif /* SHA1_HAVE_ARMV8 */
@@ -0,0 +1,57 @@
+// SHA1 hardware backends header file
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Every backend compresses one block given as 16 message words that are
+// already in host order (the big-endian decoding of the 64 input bytes), and
+// must produce exactly the same chaining value as the portable code in
+// sha1.c. sha1.c picks one once at startup.
+
+#ifndef SHA1_HW_H__
+#define SHA1_HW_H__
+
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHA1_HAVE_SHANI 1
+
+int sha1_shani_supported(void) __attribute__((visibility("hidden")));
+void sha1_compress_shani(uint32_t digest[5], const uint32_t block[16])
+  __attribute__((visibility("hidden")));
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__)
+#define SHA1_HAVE_ARMV8 1
+
+int sha1_armv8_supported(void) __attribute__((visibility("hidden")));
+void sha1_compress_armv8(uint32_t digest[5], const uint32_t block[16])
+  __attribute__((visibility("hidden")));
+#endif
+
+// Multi-buffer backends compress 4, 8 or 16 blocks at once, stored lane by
+// lane: word i of block j is block[i * lanes + j], and the same for state.
+#define SHA1_MB_MAX_LANES 16
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHA1_HAVE_MB 1
+
+int sha1_mb_supported(int lanes) __attribute__((visibility("hidden")));
+void sha1_mb_compress_sse41(uint32_t *state, const uint32_t *block)
+  __attribute__((visibility("hidden")));
+void sha1_mb_compress_avx2(uint32_t *state, const uint32_t *block)
+  __attribute__((visibility("hidden")));
+void sha1_mb_compress_avx512(uint32_t *state, const uint32_t *block)
+  __attribute__((visibility("hidden")));
+#endif
+
+#endif
@@ -0,0 +1,66 @@
+// Multi-buffer SHA1 block compression with SSE4.1, AVX2 and AVX-512
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// The same template is compiled once per instruction set with the target
+// attribute, using GCC vector extensions, so the lanes are plain C
+// arithmetic and the rest of the program needs no special compiler flags.
+
+#include <string.h>
+
+#include "sha1_hw.h"
+
+#ifdef SHA1_HAVE_MB
+
+#define MB_LANES   4
+#define MB_TARGET  __attribute__((target("sse4.1")))
+#define MB_NAME(x) x##_sse41
+#include "sha1_mb_impl.h"
+#undef MB_LANES
+#undef MB_TARGET
+#undef MB_NAME
+
+#define MB_LANES   8
+#define MB_TARGET  __attribute__((target("avx2")))
+#define MB_NAME(x) x##_avx2
+#include "sha1_mb_impl.h"
+#undef MB_LANES
+#undef MB_TARGET
+#undef MB_NAME
+
+#define MB_LANES   16
+#define MB_TARGET  __attribute__((target("avx512f")))
+#define MB_NAME(x) x##_avx512
+#include "sha1_mb_impl.h"
+#undef MB_LANES
+#undef MB_TARGET
+#undef MB_NAME
+
+int
+sha1_mb_supported(int lanes)
+{
+    __builtin_cpu_init();
+
+    switch (lanes) {
+    case 4:
+        return __builtin_cpu_supports("sse4.1");
+    case 8:
+        return __builtin_cpu_supports("avx2");
+    case 16:
+        return __builtin_cpu_supports("avx512f");
+    default:
+        return 0;
+    }
+}
+
+#endif /* SHA1_HAVE_MB */
@@ -0,0 +1,89 @@
+// Multi-buffer SHA1 compression template
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Included by sha1_mb.c once per instruction set, with
+//   MB_LANES     number of 32-bit lanes per vector
+//   MB_TARGET    target attribute for the instruction set
+//   MB_NAME(x)   suffixes x with the instruction set name
+// It defines MB_NAME(sha1_mb_compress)(), which runs MB_LANES independent
+// SHA1 block compressions side by side. Lane j of every vector belongs to
+// the j-th message: state[i * MB_LANES + j] is word i of the chaining value
+// of message j and block[i * MB_LANES + j] word i of its (already big-endian
+// decoded) block.
+
+typedef uint32_t MB_NAME(mb_vec) __attribute__((vector_size(4 * MB_LANES)));
+
+#define MB_V        MB_NAME(mb_vec)
+#define MB_ROL(x,n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define MB_F1(x,y,z) (((x) & (y)) | (~(x) & (z)))
+#define MB_F2(x,y,z) ((x) ^ (y) ^ (z))
+#define MB_F3(x,y,z) (((x) & (y)) | ((x) & (z)) | ((y) & (z)))
+#define MB_F4(x,y,z) ((x) ^ (y) ^ (z))
+
+#define MB_ROUND(n, K)                                                  \
+    if (i >= 16) {                                                      \
+        W[i & 15] = W[(i - 3) & 15] ^ W[(i - 8) & 15] ^                 \
+                    W[(i - 14) & 15] ^ W[i & 15];                       \
+        W[i & 15] = MB_ROL(W[i & 15], 1);                               \
+    }                                                                   \
+    T = MB_ROL(A, 5) + MB_F##n(B, C, D) + E + W[i & 15] + K;            \
+    E = D; D = C; C = MB_ROL(B, 30); B = A; A = T
+
+MB_TARGET void
+MB_NAME(sha1_mb_compress)(uint32_t *state, const uint32_t *block)
+{
+    int i;
+    MB_V A, B, C, D, E, T, W[16], S[5];
+
+    for (i = 0; i < 5; ++i) {
+        memcpy(&S[i], state + i * MB_LANES, sizeof(MB_V));
+    }
+    for (i = 0; i < 16; ++i) {
+        memcpy(&W[i], block + i * MB_LANES, sizeof(MB_V));
+    }
+
+    A = S[0];
+    B = S[1];
+    C = S[2];
+    D = S[3];
+    E = S[4];
+
+#pragma GCC unroll 20
+    for (i =  0; i < 20; ++i) { MB_ROUND(1, 0x5a827999); }
+#pragma GCC unroll 20
+    for (i = 20; i < 40; ++i) { MB_ROUND(2, 0x6ed9eba1); }
+#pragma GCC unroll 20
+    for (i = 40; i < 60; ++i) { MB_ROUND(3, 0x8f1bbcdc); }
+#pragma GCC unroll 20
+    for (i = 60; i < 80; ++i) { MB_ROUND(4, 0xca62c1d6); }
+
+    S[0] += A;
+    S[1] += B;
+    S[2] += C;
+    S[3] += D;
+    S[4] += E;
+
+    for (i = 0; i < 5; ++i) {
+        memcpy(state + i * MB_LANES, &S[i], sizeof(MB_V));
+    }
+}
+
+#undef MB_V
+#undef MB_ROL
+#undef MB_F1
+#undef MB_F2
+#undef MB_F3
+#undef MB_F4
+#undef MB_ROUND
@@ -0,0 +1,131 @@
+// SHA1 block compression with the x86 SHA extensions (SHA-NI)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// The round sequence follows Intel's reference code for the SHA extensions.
+// The function is compiled for the SHA, SSSE3 and SSE4.1 instruction sets
+// through the target attribute, so the rest of the program does not need
+// any special compiler flags and still runs on CPUs without them.
+
+#include "sha1_hw.h"
+
+#ifdef SHA1_HAVE_SHANI
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define SHANI_TARGET __attribute__((target("sha,ssse3,sse4.1")))
+
+int
+sha1_shani_supported(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return 0;
+    }
+
+    // SSSE3 and SSE4.1 in leaf 1, SHA in leaf 7
+    __cpuid(1, eax, ebx, ecx, edx);
+    if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) {
+        return 0;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1u << 29)) != 0;
+}
+
+/*
+ * Rounds 4*n .. 4*n+3 once the message schedule runs on its own: E0/E1 and
+ * MSG0..MSG3 rotate roles from one group to the next.
+ */
+#define SHANI_ROUNDS(Ea, Eb, Mcur, Mnext, Mlast, Mprev, f)  \
+    Ea = _mm_sha1nexte_epu32(Ea, Mcur);                     \
+    Eb = ABCD;                                              \
+    Mnext = _mm_sha1msg2_epu32(Mnext, Mcur);                \
+    ABCD = _mm_sha1rnds4_epu32(ABCD, Ea, f);                \
+    Mprev = _mm_sha1msg1_epu32(Mprev, Mcur);                \
+    Mlast = _mm_xor_si128(Mlast, Mcur)
+
+SHANI_TARGET void
+sha1_compress_shani(uint32_t digest[5], const uint32_t block[16])
+{
+    __m128i ABCD, ABCD_SAVE, E0, E0_SAVE, E1;
+    __m128i MSG0, MSG1, MSG2, MSG3;
+
+    // The instructions want A in the highest lane, and so the first
+    // message word of each group of four.
+    ABCD = _mm_loadu_si128((const __m128i *) digest);
+    ABCD = _mm_shuffle_epi32(ABCD, 0x1B);
+    E0 = _mm_set_epi32((int) digest[4], 0, 0, 0);
+    ABCD_SAVE = ABCD;
+    E0_SAVE = E0;
+
+    MSG0 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (block +  0)), 0x1B);
+    MSG1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (block +  4)), 0x1B);
+    MSG2 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (block +  8)), 0x1B);
+    MSG3 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (block + 12)), 0x1B);
+
+    /* Rounds 0-3 */
+    E0 = _mm_add_epi32(E0, MSG0);
+    E1 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+
+    /* Rounds 4-7 */
+    E1 = _mm_sha1nexte_epu32(E1, MSG1);
+    E0 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 0);
+    MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+
+    /* Rounds 8-11 */
+    E0 = _mm_sha1nexte_epu32(E0, MSG2);
+    E1 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+    MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+    MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+    /* Rounds 12-15 */
+    E1 = _mm_sha1nexte_epu32(E1, MSG3);
+    E0 = ABCD;
+    MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 0);
+    MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+    MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+    /* Rounds 16-79 */
+    SHANI_ROUNDS(E0, E1, MSG0, MSG1, MSG2, MSG3, 0);
+    SHANI_ROUNDS(E1, E0, MSG1, MSG2, MSG3, MSG0, 1);
+    SHANI_ROUNDS(E0, E1, MSG2, MSG3, MSG0, MSG1, 1);
+    SHANI_ROUNDS(E1, E0, MSG3, MSG0, MSG1, MSG2, 1);
+    SHANI_ROUNDS(E0, E1, MSG0, MSG1, MSG2, MSG3, 1);
+    SHANI_ROUNDS(E1, E0, MSG1, MSG2, MSG3, MSG0, 1);
+    SHANI_ROUNDS(E0, E1, MSG2, MSG3, MSG0, MSG1, 2);
+    SHANI_ROUNDS(E1, E0, MSG3, MSG0, MSG1, MSG2, 2);
+    SHANI_ROUNDS(E0, E1, MSG0, MSG1, MSG2, MSG3, 2);
+    SHANI_ROUNDS(E1, E0, MSG1, MSG2, MSG3, MSG0, 2);
+    SHANI_ROUNDS(E0, E1, MSG2, MSG3, MSG0, MSG1, 2);
+    SHANI_ROUNDS(E1, E0, MSG3, MSG0, MSG1, MSG2, 3);
+    SHANI_ROUNDS(E0, E1, MSG0, MSG1, MSG2, MSG3, 3);
+    SHANI_ROUNDS(E1, E0, MSG1, MSG2, MSG3, MSG0, 3);
+    SHANI_ROUNDS(E0, E1, MSG2, MSG3, MSG0, MSG1, 3);
+    SHANI_ROUNDS(E1, E0, MSG3, MSG0, MSG1, MSG2, 3);
+
+    /* Add the chaining value */
+    E0 = _mm_sha1nexte_epu32(E0, E0_SAVE);
+    ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+
+    ABCD = _mm_shuffle_epi32(ABCD, 0x1B);
+    _mm_storeu_si128((__m128i *) digest, ABCD);
+    digest[4] = (uint32_t) _mm_extract_epi32(E0, 3);
+}
+
+#endif /* SHA1_HAVE_SHANI */
@@ -0,0 +1,158 @@
+// Precomputed codes around the current step
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// The ring is updated like a sequence lock: "last" drops to 0 while codes
+// are stored, so a verifier that overlaps the store sees "last" change and
+// falls back to computing its codes.
+
+#include <stdatomic.h>
+
+#include "accounts.h"
+#include "gauth.h"
+#include "steptable.h"
+
+// Jobs handed to gauth_generate_many() at once
+#define ADVANCE_JOBS 256
+
+// Steps computed ahead of the current one
+#define AHEAD 2
+
+typedef struct {
+  GAUTH_JOB jobs[ADVANCE_JOBS];
+  ACCOUNT *owner[ADVANCE_JOBS];
+  int count;
+} ADVANCE_BATCH;
+
+static void advance_flush(ADVANCE_BATCH *batch, int digits) {
+  int codes[ADVANCE_JOBS];
+
+  gauth_generate_many(batch->jobs, batch->count, digits, codes);
+
+  // The jobs of one account are next to each other, oldest step first.
+  for (int i = 0; i < batch->count;) {
+    STEP_CODES *ring = &batch->owner[i]->codes;
+    int j = i;
+
+    atomic_store_explicit(&ring->last, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (; j < batch->count && batch->owner[j] == batch->owner[i]; ++j) {
+      atomic_store_explicit(&ring->code[batch->jobs[j].counter % STEP_SLOTS],
+                            codes[j], memory_order_relaxed);
+    }
+    atomic_store_explicit(&ring->last, batch->jobs[j - 1].counter,
+                          memory_order_release);
+    i = j;
+  }
+  batch->count = 0;
+}
+
+void step_codes_advance(ACCOUNT *const accounts[], int count, time_t now) {
+  // One batch per digits value
+  ADVANCE_BATCH batches[GAUTH_MAX_DIGITS - GAUTH_MIN_DIGITS + 1];
+
+  for (int d = 0; d <= GAUTH_MAX_DIGITS - GAUTH_MIN_DIGITS; ++d) {
+    batches[d].count = 0;
+  }
+
+  for (int i = 0; i < count; ++i) {
+    ACCOUNT *account = accounts[i];
+    uint64_t step = gauth_totp_step(now, account->period);
+    uint64_t last = atomic_load_explicit(&account->codes.last,
+                                         memory_order_relaxed);
+    if (last >= step + AHEAD) {
+      continue;
+    }
+
+    // Normally only step + AHEAD is missing. After a pause, or the first
+    // time, everything from the previous step on is.
+    uint64_t first = last + 1;
+    if (last == 0 || last + STEP_SLOTS < step + AHEAD + 1) {
+      first = step ? step - 1 : 0;
+    }
+
+    ADVANCE_BATCH *batch = &batches[account->digits - GAUTH_MIN_DIGITS];
+    if (batch->count + STEP_SLOTS > ADVANCE_JOBS) {
+      advance_flush(batch, account->digits);
+    }
+    for (uint64_t s = first; s <= step + AHEAD; ++s) {
+      batch->jobs[batch->count].key = &account->key;
+      batch->jobs[batch->count].counter = s;
+      batch->owner[batch->count] = account;
+      ++batch->count;
+    }
+  }
+
+  for (int d = 0; d <= GAUTH_MAX_DIGITS - GAUTH_MIN_DIGITS; ++d) {
+    if (batches[d].count) {
+      advance_flush(&batches[d], GAUTH_MIN_DIGITS + d);
+    }
+  }
+}
+
+int step_codes_verify(const ACCOUNT *account, time_t now,
+                      int window, int code, int *offset) {
+  const STEP_CODES *ring = &account->codes;
+  uint64_t step = gauth_totp_step(now, account->period);
+
+  if (window < 0 || window > 1 || step < (uint64_t)window) {
+    return -1;
+  }
+
+  // The ring holds last - 3 .. last.
+  uint64_t last = atomic_load_explicit(&ring->last, memory_order_acquire);
+  if (last < step + window || last + window + 1 > step + STEP_SLOTS) {
+    return -1;
+  }
+
+  int current = atomic_load_explicit(&ring->code[step % STEP_SLOTS],
+                                     memory_order_relaxed);
+  int before = atomic_load_explicit(&ring->code[(step - window) % STEP_SLOTS],
+                                    memory_order_relaxed);
+  int after = atomic_load_explicit(&ring->code[(step + window) % STEP_SLOTS],
+                                   memory_order_relaxed);
+
+  atomic_thread_fence(memory_order_acquire);
+  if (atomic_load_explicit(&ring->last, memory_order_relaxed) != last) {
+    return -1;
+  }
+
+  // All compares are done whichever matches.
+  int hit_current = current == code;
+  int hit_before = before == code;
+  int hit_after = after == code;
+  if (!(hit_current | hit_before | hit_after)) {
+    return 0;
+  }
+  if (offset) {
+    *offset = hit_current ? 0 : hit_before ? -window : window;
+  }
+  return 1;
+}
+
+int step_codes_get(const ACCOUNT *account, uint64_t step, int *code) {
+  const STEP_CODES *ring = &account->codes;
+
+  uint64_t last = atomic_load_explicit(&ring->last, memory_order_acquire);
+  if (last < step || last >= step + STEP_SLOTS) {
+    return 0;
+  }
+  int value = atomic_load_explicit(&ring->code[step % STEP_SLOTS],
+                                   memory_order_relaxed);
+  atomic_thread_fence(memory_order_acquire);
+  if (atomic_load_explicit(&ring->last, memory_order_relaxed) != last) {
+    return 0;
+  }
+  *code = value;
+  return 1;
+}
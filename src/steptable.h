@@ -0,0 +1,56 @@
+// Precomputed codes around the current step
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Every account keeps the codes of the last STEP_SLOTS steps computed for
+// it, in a ring indexed by step. Kept up to date, the ring holds t - 1, t,
+// t + 1 and t + 2 during step t, so a check within one step of t is three
+// compares, and t + 2 is computed during step t, off the request path. Each
+// rollover computes only the one step that enters the ring.
+//
+// One thread refreshes, any number of threads verify. A verifier reads
+// "last" before and after the codes, and only trusts them if the ring
+// covered its window both times.
+
+#ifndef _STEPTABLE_H_
+#define _STEPTABLE_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#define STEP_SLOTS 4
+
+struct account;
+
+typedef struct step_codes {
+  _Atomic uint64_t last;                // newest step in code[], 0 if none
+  _Atomic int32_t code[STEP_SLOTS];     // code of step s in code[s % 4]
+} STEP_CODES;
+
+// Computes the codes that "count" accounts are missing for the steps up to
+// two past the current one, with one multi-buffer call per digits value.
+void step_codes_advance(struct account *const accounts[], int count,
+                        time_t now);
+
+// Checks code against the current step and, if window is 1, the steps next
+// to it. Returns 1 on a match and stores the step offset in *offset (the
+// current step wins over its neighbours), 0 if nothing matched, or -1 if
+// the ring does not cover the window; use gauth_verify() then.
+int step_codes_verify(const struct account *account, time_t now,
+                      int window, int code, int *offset);
+
+// Stores the code of "step" in *code and returns 1 if the ring holds it,
+// or returns 0.
+int step_codes_get(const struct account *account, uint64_t step, int *code);
+
+#endif /* _STEPTABLE_H_ */
@@ -17,5 +17,5 @@
 #include "config.h"
 
 #ifndef HAVE_EXPLICIT_BZERO
-void explicit_bzero(void *s, size_t len);
+void explicit_bzero(void *s, size_t len) __attribute__((visibility("hidden")));
 #endif
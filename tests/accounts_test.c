@@ -0,0 +1,199 @@
+// Tests of the account table under concurrent changes
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Writers add and remove accounts of their own while readers, each an
+// epoch reader as the workers of gauthenticatord are, look accounts up and
+// scan the whole table. Every scan must see the accounts that never change
+// in hash order, and whatever a reader reaches must still be intact. Built
+// with -fsanitize=thread when the compiler has it, which also sees the
+// trie nodes and accounts freed while a reader could reach them.
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "accounts.h"
+#include "epoch.h"
+
+#define READERS 3
+#define WRITERS 2
+
+// Accounts of the file, never removed
+#define STABLE 200
+
+// Changes per writer, and how many of its accounts it keeps at most
+#define CHANGES 4000
+#define CHURN 64
+
+#define SCAN_BATCH 32
+
+#define SECRET "JBSWY3DPEHPK3PXP"
+
+#define CHECK(cond)                                                 \
+  do {                                                              \
+    if (!(cond)) {                                                  \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,        \
+              __LINE__, #cond);                                     \
+      exit(EXIT_FAILURE);                                           \
+    }                                                               \
+  } while (0)
+
+static ACCOUNTS *accounts;
+static EPOCH *epoch;
+static _Atomic int writing;
+
+// Checks what a reader may rely on of an account it reached.
+static void check_account(const ACCOUNT *account) {
+  CHECK(account->name && strlen(account->name) > 0);
+  CHECK(account->period == 30 && account->digits == 6);
+  CHECK(atomic_load(&account->refs) > 0);
+}
+
+static void check_find(const char *name) {
+  ACCOUNT *account = accounts_find(accounts, name, strlen(name));
+  if (account) {
+    check_account(account);
+    CHECK(strcmp(account->name, name) == 0);
+  }
+}
+
+// Scans the whole table in small batches, so the root may change between
+// calls, and counts the stable accounts.
+static void check_scan(void) {
+  ACCOUNT *batch[SCAN_BATCH];
+  uint64_t cursor = 0;
+  uint32_t last = 0;
+  int stable = 0;
+
+  while (cursor < ACCOUNTS_SCAN_END) {
+    int n = accounts_scan(accounts, &cursor, batch, SCAN_BATCH);
+    for (int i = 0; i < n; ++i) {
+      check_account(batch[i]);
+      CHECK(batch[i]->hash >= last);
+      last = batch[i]->hash;
+      if (batch[i]->name[0] == 's') {
+        ++stable;
+      }
+    }
+  }
+  CHECK(stable == STABLE);
+}
+
+static void *read_all(void *arg) {
+  int reader = (int)(intptr_t)arg;
+  char name[32];
+  unsigned i = 0;
+
+  while (atomic_load(&writing)) {
+    epoch_enter(epoch, reader);
+    snprintf(name, sizeof(name), "s%u", i % STABLE);
+    CHECK(accounts_find(accounts, name, strlen(name)));
+    snprintf(name, sizeof(name), "w%u-%u", i % WRITERS, i % (2 * CHURN));
+    check_find(name);
+    if (i % 64 == 0) {
+      check_scan();
+    }
+
+    // A held account outlives the critical section it was found in.
+    ACCOUNT *held = NULL;
+    if (i % 16 == 0) {
+      held = accounts_find(accounts, name, strlen(name));
+      if (held) {
+        account_hold(held);
+      }
+    }
+    epoch_exit(epoch, reader);
+    if (held) {
+      check_account(held);
+      account_release(held);
+    }
+    ++i;
+  }
+  return NULL;
+}
+
+static void *write_all(void *arg) {
+  int writer = (int)(intptr_t)arg;
+  char name[32];
+
+  for (int i = 0; i < CHANGES; ++i) {
+    snprintf(name, sizeof(name), "w%d-%d", writer, i % (2 * CHURN));
+    if (i >= CHURN) {
+      char old[32];
+      snprintf(old, sizeof(old), "w%d-%d", writer, (i - CHURN) % (2 * CHURN));
+      CHECK(accounts_remove(accounts, old, strlen(old)) == 0);
+    }
+    CHECK(accounts_add(accounts, name, strlen(name), SECRET, 30, 6) == 0);
+  }
+  return NULL;
+}
+
+int main(void) {
+  char path[] = "/tmp/accounts_testXXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  FILE *file = fdopen(fd, "w");
+  CHECK(file);
+  for (int i = 0; i < STABLE; ++i) {
+    fprintf(file, "s%d %s\n", i, SECRET);
+  }
+  CHECK(fclose(file) == 0);
+
+  int line;
+  epoch = epoch_new(READERS);
+  CHECK(epoch);
+  accounts = accounts_load(path, epoch, &line);
+  unlink(path);
+  CHECK(accounts);
+  CHECK(accounts_count(accounts) == STABLE);
+
+  // Names are unique, whatever the writers do.
+  CHECK(accounts_add(accounts, "s0", 2, SECRET, 30, 6) < 0 && errno == EEXIST);
+  CHECK(accounts_remove(accounts, "x", 1) < 0 && errno == ENOENT);
+
+  pthread_t readers[READERS];
+  pthread_t writers[WRITERS];
+  atomic_init(&writing, 1);
+  for (int i = 0; i < READERS; ++i) {
+    CHECK(pthread_create(&readers[i], NULL, read_all,
+                         (void *)(intptr_t)i) == 0);
+  }
+  for (int i = 0; i < WRITERS; ++i) {
+    CHECK(pthread_create(&writers[i], NULL, write_all,
+                         (void *)(intptr_t)i) == 0);
+  }
+  for (int i = 0; i < WRITERS; ++i) {
+    pthread_join(writers[i], NULL);
+  }
+  atomic_store(&writing, 0);
+  for (int i = 0; i < READERS; ++i) {
+    pthread_join(readers[i], NULL);
+  }
+
+  // Every writer kept its last CHURN accounts.
+  CHECK(accounts_count(accounts) == STABLE + WRITERS * CHURN);
+  epoch_enter(epoch, 0);
+  check_scan();
+  epoch_exit(epoch, 0);
+
+  epoch_free(epoch);
+  accounts_free(accounts);
+  return EXIT_SUCCESS;
+}
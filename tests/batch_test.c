@@ -0,0 +1,194 @@
+// Tests of the batch engine
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Pools of several sizes generate and verify the codes of RFC 4226
+// (appendix D) and RFC 6238 (appendix B, SHA-1), then of enough keys for
+// the workers to split and steal the work, against gauth_generate() one
+// code at a time.
+
+#include "config.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+#include "gauth.h"
+
+#define CHECK(cond)                                                 \
+  do {                                                              \
+    if (!(cond)) {                                                  \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,        \
+              __LINE__, #cond);                                     \
+      exit(EXIT_FAILURE);                                           \
+    }                                                               \
+  } while (0)
+
+// The secret of the RFC 4226 and RFC 6238 vectors
+#define RFC_SECRET "12345678901234567890"
+
+#define KEYS 1000
+#define STEPS 7
+#define WINDOW 3
+
+static GAUTH_KEY rfc_key;
+static GAUTH_KEY keys[KEYS];
+
+// RFC 4226, appendix D: counters 0 to 9
+static const int hotp_codes[] = {
+  755224, 287082, 359152, 969429, 338314,
+  254676, 287922, 162583, 399871, 520489,
+};
+
+// RFC 6238, appendix B, the SHA-1 rows
+static const struct {
+  time_t time;
+  int code;
+} totp_vectors[] = {
+  { 59, 94287082 },
+  { 1111111109, 7081804 },
+  { 1111111111, 14050471 },
+  { 1234567890, 89005924 },
+  { 2000000000, 69279037 },
+  { 20000000000LL, 65353130 },
+};
+
+#define TOTP_VECTORS ((int)(sizeof(totp_vectors) / sizeof(totp_vectors[0])))
+
+static void test_rfc4226(BATCH_POOL *pool) {
+  int codes[10];
+  CHECK(batch_generate(pool, &rfc_key, 1, 0, 10, 6, codes) == 0);
+  CHECK(memcmp(codes, hotp_codes, sizeof(codes)) == 0);
+
+  // Every code is found at its own offset from counter 5.
+  for (int i = 0; i < 10; ++i) {
+    int offset;
+    CHECK(batch_verify(pool, &rfc_key, 1, 5, 5, 6, &hotp_codes[i],
+                       &offset) == 0);
+    CHECK(offset == i - 5);
+  }
+  // Counters before 0 do not exist.
+  int offsets[2];
+  GAUTH_KEY two[2] = { rfc_key, rfc_key };
+  int expected[2] = { hotp_codes[0], hotp_codes[9] };
+  CHECK(batch_verify(pool, two, 2, 1, 3, 6, expected, offsets) == 0);
+  CHECK(offsets[0] == -1 && offsets[1] == INT_MIN);
+}
+
+// One key per vector, each at its own step.
+static void test_rfc6238(BATCH_POOL *pool) {
+  GAUTH_KEY same[TOTP_VECTORS];
+  int expected[TOTP_VECTORS];
+  int offsets[TOTP_VECTORS];
+
+  for (int i = 0; i < TOTP_VECTORS; ++i) {
+    uint64_t step = gauth_totp_step(totp_vectors[i].time, 30);
+    int code;
+    CHECK(batch_generate(pool, &rfc_key, 1, step, 1, 8, &code) == 0);
+    CHECK(code == totp_vectors[i].code);
+
+    // Checked from a step away, within the window
+    CHECK(batch_verify(pool, &rfc_key, 1, step + 1, 1, 8,
+                       &totp_vectors[i].code, &offsets[0]) == 0);
+    CHECK(offsets[0] == -1);
+
+    same[i] = rfc_key;
+    expected[i] = totp_vectors[i].code % 1000000;
+  }
+
+  // All of them at once at the step of the first vector: only that one
+  // matches.
+  CHECK(batch_verify(pool, same, TOTP_VECTORS,
+                     gauth_totp_step(totp_vectors[0].time, 30), WINDOW, 6,
+                     expected, offsets) == 0);
+  CHECK(offsets[0] == 0);
+  for (int i = 1; i < TOTP_VECTORS; ++i) {
+    CHECK(offsets[i] == INT_MIN);
+  }
+}
+
+// Enough keys to keep every worker busy, against the scalar path
+static void test_many(BATCH_POOL *pool) {
+  static int codes[KEYS * STEPS];
+  static int expected[KEYS];
+  static int offsets[KEYS];
+  const uint64_t first = 56666666;
+
+  CHECK(batch_generate(pool, keys, KEYS, first, STEPS, 7, codes) == 0);
+  for (int k = 0; k < KEYS; ++k) {
+    for (int s = 0; s < STEPS; ++s) {
+      CHECK(codes[k * STEPS + s] == gauth_generate(&keys[k], first + s, 7));
+    }
+  }
+
+  // Key k is asked for its code at an offset from -WINDOW to WINDOW + 1,
+  // the last one out of the window.
+  const uint64_t step = first + WINDOW;
+  for (int k = 0; k < KEYS; ++k) {
+    expected[k] = gauth_generate(&keys[k],
+                                 step + k % (2 * WINDOW + 2) - WINDOW, 7);
+  }
+  CHECK(batch_verify(pool, keys, KEYS, step, WINDOW, 7, expected,
+                     offsets) == 0);
+  for (int k = 0; k < KEYS; ++k) {
+    int offset = k % (2 * WINDOW + 2) - WINDOW;
+    CHECK(offsets[k] == (offset > WINDOW ? INT_MIN : offset));
+  }
+
+  // Nothing to do
+  CHECK(batch_generate(pool, keys, 0, first, STEPS, 6, codes) == 0);
+  CHECK(batch_verify(pool, keys, 0, step, WINDOW, 6, expected,
+                     offsets) == 0);
+}
+
+static void test_invalid(BATCH_POOL *pool) {
+  int codes[4];
+  int offsets[4];
+
+  CHECK(batch_generate(pool, keys, 1, 0, 1, 5, codes) == -1);
+  CHECK(batch_generate(pool, keys, 1, 0, 1, 9, codes) == -1);
+  CHECK(batch_generate(pool, keys, 1, 0, 0, 6, codes) == -1);
+  CHECK(batch_generate(pool, keys, -1, 0, 1, 6, codes) == -1);
+  CHECK(batch_verify(pool, keys, 1, 0, BATCH_MAX_WINDOW + 1, 6, codes,
+                     offsets) == -1);
+  CHECK(batch_verify(pool, keys, 1, 0, -1, 6, codes, offsets) == -1);
+}
+
+int main(void) {
+  CHECK(gauth_key_init_raw(&rfc_key, (const uint8_t *)RFC_SECRET,
+                           strlen(RFC_SECRET)) == 0);
+  for (int k = 0; k < KEYS; ++k) {
+    uint8_t secret[20];
+    for (int i = 0; i < (int)sizeof(secret); ++i) {
+      secret[i] = (uint8_t)(k * 7 + i * 13);
+    }
+    CHECK(gauth_key_init_raw(&keys[k], secret, sizeof(secret)) == 0);
+  }
+
+  // The calling thread alone, a few workers, and one per CPU
+  static const int sizes[] = { 1, 3, 0 };
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    BATCH_POOL *pool = batch_pool_new(sizes[i]);
+    CHECK(pool);
+    CHECK(sizes[i] == 0 ? batch_pool_threads(pool) >= 1
+                        : batch_pool_threads(pool) == sizes[i]);
+    test_rfc4226(pool);
+    test_rfc6238(pool);
+    test_many(pool);
+    test_invalid(pool);
+    batch_pool_free(pool);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,214 @@
+// Tests of epoch-based reclamation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// First the order in which retired entries are released, one step at a
+// time, then readers that check the object they reach was not released
+// while a writer keeps replacing and retiring it. Released objects are
+// only marked dead and freed at the end, so an early release is caught
+// without a sanitizer. Built with -fsanitize=thread when the compiler has
+// it.
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+
+#define READERS 3
+#define REPLACEMENTS 20000
+
+#define CHECK(cond)                                                 \
+  do {                                                              \
+    if (!(cond)) {                                                  \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,        \
+              __LINE__, #cond);                                     \
+      exit(EXIT_FAILURE);                                           \
+    }                                                               \
+  } while (0)
+
+typedef struct object {
+  EPOCH_ENTRY retire;   // first, so an entry is its object
+  _Atomic int alive;
+  struct object *dead_next;
+} OBJECT;
+
+// Released objects, freed when the test is over
+static _Atomic(OBJECT *) dead;
+
+static void object_released(EPOCH_ENTRY *entry) {
+  OBJECT *object = (OBJECT *)entry;
+  CHECK(atomic_load(&object->alive));
+  atomic_store(&object->alive, 0);
+  OBJECT *head = atomic_load(&dead);
+  do {
+    object->dead_next = head;
+  } while (!atomic_compare_exchange_weak(&dead, &head, object));
+}
+
+static OBJECT *object_new(void) {
+  OBJECT *object = calloc(1, sizeof(OBJECT));
+  CHECK(object);
+  object->retire.release = object_released;
+  atomic_init(&object->alive, 1);
+  return object;
+}
+
+static int alive(OBJECT *object) {
+  return atomic_load(&object->alive);
+}
+
+static void free_dead(void) {
+  OBJECT *object = atomic_exchange(&dead, NULL);
+  while (object) {
+    OBJECT *next = object->dead_next;
+    free(object);
+    object = next;
+  }
+}
+
+// Without a domain, retiring releases right away.
+static void test_no_epoch(void) {
+  OBJECT *a = object_new();
+  epoch_retire(NULL, &a->retire);
+  CHECK(!alive(a));
+  free_dead();
+}
+
+// An entry waits for the readers that entered before it was retired, and
+// only for those.
+static void test_order(void) {
+  EPOCH *epoch = epoch_new(2);
+  CHECK(epoch);
+  OBJECT *a = object_new();
+  OBJECT *b = object_new();
+  OBJECT *c = object_new();
+
+  epoch_enter(epoch, 0);
+  epoch_retire(epoch, &a->retire);
+  epoch_reclaim(epoch);
+  CHECK(alive(a));
+
+  epoch_enter(epoch, 1);
+  epoch_retire(epoch, &b->retire);
+  epoch_reclaim(epoch);
+  CHECK(alive(a) && alive(b));
+
+  // Reader 1 entered after a was retired, so it cannot hold it.
+  epoch_exit(epoch, 0);
+  epoch_reclaim(epoch);
+  CHECK(!alive(a) && alive(b));
+
+  epoch_exit(epoch, 1);
+  epoch_reclaim(epoch);
+  CHECK(!alive(b));
+
+  // Entering again after the retirement does not hold an entry back.
+  epoch_retire(epoch, &c->retire);
+  epoch_enter(epoch, 0);
+  epoch_reclaim(epoch);
+  CHECK(!alive(c));
+  epoch_exit(epoch, 0);
+
+  free_dead();
+  epoch_free(epoch);
+}
+
+// Entries still waiting go with the domain.
+static void test_free(void) {
+  EPOCH *epoch = epoch_new(1);
+  CHECK(epoch);
+  OBJECT *a = object_new();
+
+  epoch_enter(epoch, 0);
+  epoch_retire(epoch, &a->retire);
+  epoch_reclaim(epoch);
+  CHECK(alive(a));
+  epoch_exit(epoch, 0);
+  epoch_free(epoch);
+  CHECK(!alive(a));
+  free_dead();
+}
+
+typedef struct shared {
+  EPOCH *epoch;
+  _Atomic(OBJECT *) current;
+  _Atomic int done;
+} SHARED;
+
+typedef struct reader {
+  SHARED *shared;
+  int index;
+} READER;
+
+static void *read_all(void *arg) {
+  READER *reader = arg;
+  SHARED *shared = reader->shared;
+
+  while (!atomic_load(&shared->done)) {
+    epoch_enter(shared->epoch, reader->index);
+    OBJECT *object = atomic_load(&shared->current);
+    for (int i = 0; i < 4; ++i) {
+      CHECK(alive(object));
+    }
+    epoch_exit(shared->epoch, reader->index);
+  }
+  return NULL;
+}
+
+// Readers check the object they reach while a writer replaces it.
+static void test_readers(void) {
+  SHARED shared;
+  READER readers[READERS];
+  pthread_t threads[READERS];
+
+  shared.epoch = epoch_new(READERS);
+  CHECK(shared.epoch);
+  atomic_init(&shared.current, object_new());
+  atomic_init(&shared.done, 0);
+  for (int i = 0; i < READERS; ++i) {
+    readers[i].shared = &shared;
+    readers[i].index = i;
+    CHECK(pthread_create(&threads[i], NULL, read_all, &readers[i]) == 0);
+  }
+
+  for (int i = 0; i < REPLACEMENTS; ++i) {
+    OBJECT *old = atomic_exchange(&shared.current, object_new());
+    epoch_retire(shared.epoch, &old->retire);
+    if (i % 16 == 0) {
+      epoch_reclaim(shared.epoch);
+    }
+  }
+  atomic_store(&shared.done, 1);
+  for (int i = 0; i < READERS; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  epoch_reclaim(shared.epoch);
+  OBJECT *last = atomic_load(&shared.current);
+  CHECK(alive(last));
+  free(last);
+  epoch_free(shared.epoch);
+  free_dead();
+}
+
+int main(void) {
+  test_no_epoch();
+  test_order();
+  test_free();
+  test_readers();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,571 @@
+// Tests of the gauthenticatord protocol
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Starts the daemon named by $GAUTHENTICATORD (./gauthenticatord if unset)
+// on a socket in a temporary directory, and talks to it as a client would:
+// every op, the answers to malformed and short frames, pipelined requests
+// and the oversized frame that closes a connection. A second daemon on the
+// same socket must give up without taking it over. When run as root, a
+// child that drops to another user checks that it may look codes up but
+// not change accounts.
+
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gauth.h"
+#include "gauthd.h"
+
+#define SECRET "JBSWY3DPEHPK3PXP"
+#define HOTP_SECRET "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ"
+
+// Another user for the clients that may not change accounts
+#define NOBODY 65534
+
+// How long to wait for the daemon, in milliseconds
+#define TIMEOUT_MS 5000
+
+#define CHECK(cond)                                                 \
+  do {                                                              \
+    if (!(cond)) {                                                  \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,        \
+              __LINE__, #cond);                                     \
+      exit(EXIT_FAILURE);                                           \
+    }                                                               \
+  } while (0)
+
+static char dir[] = "/tmp/gauthd_testXXXXXX";
+static char socket_path[64];
+static char accounts_path[64];
+static pid_t daemon_pid;
+
+static GAUTH_KEY key;
+static GAUTH_KEY hotp_key;
+
+typedef struct response {
+  uint32_t tag;
+  int status;
+  uint8_t body[GAUTHD_MAX_FRAME];
+  uint32_t len;
+} RESPONSE;
+
+static void put_u32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static int connect_to(void) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  strcpy(addr.sun_path, socket_path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  CHECK(fd >= 0);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void send_all(int fd, const uint8_t *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    CHECK(n > 0 || errno == EINTR);
+    if (n > 0) {
+      data += n;
+      len -= n;
+    }
+  }
+}
+
+// Reads exactly "len" bytes. Returns 0, or -1 if the daemon closed the
+// connection first.
+static int recv_all(int fd, uint8_t *data, size_t len) {
+  while (len > 0) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    CHECK(poll(&pfd, 1, TIMEOUT_MS) == 1);
+    ssize_t n = recv(fd, data, len, 0);
+    if (n == 0) {
+      return -1;
+    }
+    CHECK(n > 0 || errno == EINTR);
+    if (n > 0) {
+      data += n;
+      len -= n;
+    }
+  }
+  return 0;
+}
+
+// Builds a request frame into "out" and returns its size.
+static size_t frame(uint8_t *out, uint32_t tag, int op, const uint8_t *body,
+                    size_t len) {
+  put_u32(out, 5 + len);
+  put_u32(out + 4, tag);
+  out[8] = op;
+  if (len) {
+    memcpy(out + 9, body, len);
+  }
+  return 9 + len;
+}
+
+static void receive(int fd, RESPONSE *response) {
+  uint8_t head[9];
+  CHECK(recv_all(fd, head, sizeof(head)) == 0);
+  uint32_t len = get_u32(head);
+  CHECK(len >= 5 && len - 5 <= sizeof(response->body));
+  response->tag = get_u32(head + 4);
+  response->status = head[8];
+  response->len = len - 5;
+  CHECK(recv_all(fd, response->body, response->len) == 0);
+}
+
+// Sends one request and returns the status of its response.
+static int request(int fd, int op, const uint8_t *body, size_t len,
+                   RESPONSE *response) {
+  static uint32_t next_tag = 1;
+  uint8_t out[9 + GAUTHD_MAX_FRAME];
+  RESPONSE ignored;
+  if (!response) {
+    response = &ignored;
+  }
+  uint32_t tag = next_tag++;
+  send_all(fd, out, frame(out, tag, op, body, len));
+  receive(fd, response);
+  CHECK(response->tag == tag);
+  return response->status;
+}
+
+static size_t verify_body(uint8_t *body, int window, int code,
+                          const char *name) {
+  body[0] = window;
+  put_u32(body + 1, code);
+  body[5] = strlen(name);
+  memcpy(body + 6, name, body[5]);
+  return 6 + body[5];
+}
+
+static int verify(int fd, int window, int code, const char *name) {
+  uint8_t body[64];
+  return request(fd, GAUTHD_OP_VERIFY, body,
+                 verify_body(body, window, code, name), NULL);
+}
+
+static int lookup(int fd, int window, int code, RESPONSE *response) {
+  uint8_t body[5];
+  body[0] = window;
+  put_u32(body + 1, code);
+  return request(fd, GAUTHD_OP_LOOKUP, body, sizeof(body), response);
+}
+
+static int add(int fd, int period, int digits, const char *name,
+               const char *secret) {
+  uint8_t body[128];
+  put_u32(body, period);
+  body[4] = digits;
+  body[5] = strlen(name);
+  memcpy(body + 6, name, body[5]);
+  memcpy(body + 6 + body[5], secret, strlen(secret));
+  return request(fd, GAUTHD_OP_ADD, body, 6 + body[5] + strlen(secret), NULL);
+}
+
+static int remove_account(int fd, const char *name) {
+  uint8_t body[64];
+  body[0] = strlen(name);
+  memcpy(body + 1, name, body[0]);
+  return request(fd, GAUTHD_OP_REMOVE, body, 1 + body[0], NULL);
+}
+
+// Whether a lookup response lists the account "name"
+static int lists(const RESPONSE *response, const char *name) {
+  CHECK(response->len >= 3);
+  uint32_t pos = 3;
+  for (int i = 0; i < response->body[2]; ++i) {
+    CHECK(pos + 2 <= response->len);
+    int len = response->body[pos + 1];
+    CHECK(pos + 2 + len <= response->len);
+    if (len == (int)strlen(name) &&
+        memcmp(response->body + pos + 2, name, len) == 0) {
+      return 1;
+    }
+    pos += 2 + len;
+  }
+  return 0;
+}
+
+// Starts the daemon with the socket permissions "mode".
+static pid_t spawn_daemon(const char *mode) {
+  const char *program = getenv("GAUTHENTICATORD");
+  if (!program) {
+    program = "./gauthenticatord";
+  }
+
+  pid_t pid = fork();
+  CHECK(pid >= 0);
+  if (pid == 0) {
+    execl(program, program, "-s", socket_path, "-m", mode, "-w", "1",
+          "-l", "3", accounts_path, (char *)NULL);
+    perror(program);
+    _exit(127);
+  }
+  return pid;
+}
+
+// Runs a daemon that is expected to give up, and returns its exit status.
+static int run_daemon(const char *mode) {
+  int status;
+  pid_t pid = spawn_daemon(mode);
+  CHECK(waitpid(pid, &status, 0) == pid);
+  CHECK(WIFEXITED(status));
+  return WEXITSTATUS(status);
+}
+
+static void start_daemon(void) {
+  daemon_pid = spawn_daemon("666");
+
+  for (int waited = 0; waited < TIMEOUT_MS; waited += 10) {
+    int fd = connect_to();
+    if (fd >= 0) {
+      close(fd);
+      return;
+    }
+    CHECK(waitpid(daemon_pid, NULL, WNOHANG) == 0);
+    usleep(10000);
+  }
+  CHECK(!"the daemon did not start");
+}
+
+static void stop_daemon(void) {
+  int status;
+  CHECK(kill(daemon_pid, SIGTERM) == 0);
+  CHECK(waitpid(daemon_pid, &status, 0) == daemon_pid);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+  // The socket goes with the daemon.
+  CHECK(access(socket_path, F_OK) < 0 && errno == ENOENT);
+}
+
+static void test_verify(int fd) {
+  time_t now = time(NULL);
+  int code = gauth_totp(&key, now, 30, 6);
+
+  CHECK(verify(fd, 1, code, "alice") == GAUTHD_OK);
+  CHECK(verify(fd, 1, code, "alice") == GAUTHD_REPLAYED);
+  CHECK(verify(fd, 1, (code + 1) % 1000000, "alice") == GAUTHD_REJECTED);
+  CHECK(verify(fd, 1, code, "nobody") == GAUTHD_NO_ACCOUNT);
+  // Wider than -w, and a code no account can produce
+  CHECK(verify(fd, 2, code, "alice") == GAUTHD_BAD_REQUEST);
+  CHECK(verify(fd, 0, -1, "alice") == GAUTHD_BAD_REQUEST);
+
+  // The code of the step before comes back with its offset, unless the
+  // step changed since "now".
+  uint8_t body[64];
+  RESPONSE response;
+  int earlier = gauth_totp(&key, now - 30, 30, 6);
+  if (earlier != code) {
+    int status = request(fd, GAUTHD_OP_VERIFY, body,
+                         verify_body(body, 1, earlier, "alice"), &response);
+    CHECK(status == GAUTHD_OK || status == GAUTHD_REJECTED);
+    CHECK(response.len == 1);
+    CHECK(status != GAUTHD_OK || (int8_t)response.body[0] == -1);
+  }
+}
+
+static void test_hotp(int fd) {
+  // The next expected counter is 0; a code found past it moves it on, and
+  // only the code last accepted counts as replayed.
+  CHECK(verify(fd, 0, gauth_generate(&hotp_key, 0, 6), "bob") == GAUTHD_OK);
+  CHECK(verify(fd, 0, gauth_generate(&hotp_key, 0, 6), "bob") ==
+        GAUTHD_REPLAYED);
+  CHECK(verify(fd, 3, gauth_generate(&hotp_key, 3, 6), "bob") == GAUTHD_OK);
+  CHECK(verify(fd, 3, gauth_generate(&hotp_key, 2, 6), "bob") ==
+        GAUTHD_REJECTED);
+  CHECK(verify(fd, 3, gauth_generate(&hotp_key, 3, 6), "bob") ==
+        GAUTHD_REPLAYED);
+  // Past -l
+  CHECK(verify(fd, 4, gauth_generate(&hotp_key, 4, 6), "bob") ==
+        GAUTHD_BAD_REQUEST);
+}
+
+static void test_lookup(int fd) {
+  RESPONSE response;
+  int code = gauth_totp(&key, time(NULL), 30, 6);
+
+  CHECK(lookup(fd, 1, code, &response) == GAUTHD_OK);
+  CHECK(lists(&response, "alice"));
+  CHECK(response.body[0] << 8 | response.body[1]);
+
+  uint8_t body[6] = { 0 };
+  CHECK(lookup(fd, 2, code, NULL) == GAUTHD_BAD_REQUEST);
+  CHECK(request(fd, GAUTHD_OP_LOOKUP, body, 4, NULL) == GAUTHD_BAD_REQUEST);
+  CHECK(request(fd, GAUTHD_OP_LOOKUP, body, 6, NULL) == GAUTHD_BAD_REQUEST);
+}
+
+static void test_add_remove(int fd) {
+  CHECK(add(fd, 30, 6, "carol", SECRET) == GAUTHD_OK);
+  CHECK(add(fd, 30, 6, "carol", SECRET) == GAUTHD_EXISTS);
+  CHECK(add(fd, 30, 6, "alice", SECRET) == GAUTHD_EXISTS);
+  CHECK(verify(fd, 1, gauth_totp(&key, time(NULL), 30, 6), "carol") ==
+        GAUTHD_OK);
+  CHECK(remove_account(fd, "carol") == GAUTHD_OK);
+  CHECK(remove_account(fd, "carol") == GAUTHD_NO_ACCOUNT);
+  CHECK(verify(fd, 1, gauth_totp(&key, time(NULL), 30, 6), "carol") ==
+        GAUTHD_NO_ACCOUNT);
+
+  // Invalid accounts
+  CHECK(add(fd, 30, 6, "dave", "not base32!") == GAUTHD_BAD_REQUEST);
+  CHECK(add(fd, 30, 5, "dave", SECRET) == GAUTHD_BAD_REQUEST);
+  CHECK(add(fd, 30, 6, "", SECRET) == GAUTHD_BAD_REQUEST);
+  CHECK(add(fd, 30, 6, "dave", "") == GAUTHD_BAD_REQUEST);
+
+  // Name lengths past the end of the frame
+  uint8_t body[8] = { 0, 0, 0, 30, 6, 40, 'd', 'a' };
+  CHECK(request(fd, GAUTHD_OP_ADD, body, sizeof(body), NULL) ==
+        GAUTHD_BAD_REQUEST);
+  CHECK(request(fd, GAUTHD_OP_ADD, body, 5, NULL) == GAUTHD_BAD_REQUEST);
+  body[0] = 5;
+  CHECK(request(fd, GAUTHD_OP_REMOVE, body, 3, NULL) == GAUTHD_BAD_REQUEST);
+  CHECK(request(fd, GAUTHD_OP_REMOVE, body, 0, NULL) == GAUTHD_BAD_REQUEST);
+}
+
+// An account of a period no other account has is found by lookups once
+// the next refresh pass indexed it.
+static void test_new_period(int fd) {
+  RESPONSE response;
+  int found = 0;
+
+  CHECK(add(fd, 45, 6, "erin", HOTP_SECRET) == GAUTHD_OK);
+  for (int waited = 0; waited < TIMEOUT_MS && !found; waited += 10) {
+    int code = gauth_totp(&hotp_key, time(NULL), 45, 6);
+    found = lookup(fd, 1, code, &response) == GAUTHD_OK &&
+            lists(&response, "erin");
+    usleep(10000);
+  }
+  CHECK(found);
+  CHECK(remove_account(fd, "erin") == GAUTHD_OK);
+}
+
+static void test_malformed(int fd) {
+  uint8_t out[16];
+  RESPONSE response;
+
+  // An unknown op, and a verification without a name
+  CHECK(request(fd, 0, NULL, 0, NULL) == GAUTHD_BAD_REQUEST);
+  CHECK(request(fd, 99, NULL, 0, NULL) == GAUTHD_BAD_REQUEST);
+  CHECK(request(fd, GAUTHD_OP_VERIFY, (const uint8_t *)"\1\0\0\0\1\5",
+                6, NULL) == GAUTHD_BAD_REQUEST);
+
+  // Frames too short for an op, or even a tag: the tag is what there is
+  // of it, padded with zeros.
+  put_u32(out, 4);
+  put_u32(out + 4, 0x01020304);
+  send_all(fd, out, 8);
+  receive(fd, &response);
+  CHECK(response.tag == 0x01020304 && response.status == GAUTHD_BAD_REQUEST);
+  CHECK(response.len == 0);
+
+  put_u32(out, 2);
+  out[4] = 0xAB;
+  out[5] = 0xCD;
+  send_all(fd, out, 6);
+  receive(fd, &response);
+  CHECK(response.tag == 0xABCD0000 && response.status == GAUTHD_BAD_REQUEST);
+
+  put_u32(out, 0);
+  send_all(fd, out, 4);
+  receive(fd, &response);
+  CHECK(response.tag == 0 && response.status == GAUTHD_BAD_REQUEST);
+
+  // A frame split over several writes is answered once it is complete.
+  uint8_t body[5] = { 0 };
+  size_t len = frame(out, 77, GAUTHD_OP_LOOKUP, body, sizeof(body));
+  send_all(fd, out, 3);
+  usleep(50000);
+  send_all(fd, out + 3, 5);
+  usleep(50000);
+  send_all(fd, out + 8, len - 8);
+  receive(fd, &response);
+  CHECK(response.tag == 77 && response.status != GAUTHD_BAD_REQUEST);
+}
+
+// Many requests in one write come back in order.
+static void test_pipelining(int fd) {
+  enum { REQUESTS = 200 };
+  static uint8_t out[REQUESTS * 64];
+  size_t len = 0;
+  int code = gauth_totp(&key, time(NULL), 30, 6);
+
+  for (int i = 0; i < REQUESTS; ++i) {
+    uint8_t body[64];
+    if (i % 3 == 0) {
+      len += frame(out + len, 1000 + i, GAUTHD_OP_VERIFY, body,
+                   verify_body(body, 1, (code + 1 + i) % 1000000, "alice"));
+    } else if (i % 3 == 1) {
+      body[0] = 1;
+      put_u32(body + 1, code);
+      len += frame(out + len, 1000 + i, GAUTHD_OP_LOOKUP, body, 5);
+    } else {
+      len += frame(out + len, 1000 + i, 42, NULL, 0);
+    }
+  }
+  send_all(fd, out, len);
+
+  for (int i = 0; i < REQUESTS; ++i) {
+    RESPONSE response;
+    receive(fd, &response);
+    CHECK(response.tag == 1000u + i);
+    if (i % 3 == 1) {
+      CHECK(response.status == GAUTHD_OK && lists(&response, "alice"));
+    } else if (i % 3 == 2) {
+      CHECK(response.status == GAUTHD_BAD_REQUEST);
+    }
+  }
+}
+
+// A frame longer than GAUTHD_MAX_FRAME closes the connection.
+static void test_oversized(void) {
+  int fd = connect_to();
+  CHECK(fd >= 0);
+  uint8_t out[4];
+  put_u32(out, GAUTHD_MAX_FRAME + 1);
+  send_all(fd, out, sizeof(out));
+  CHECK(recv_all(fd, out, 1) < 0);
+  close(fd);
+
+  // Other connections go on.
+  fd = connect_to();
+  CHECK(fd >= 0);
+  CHECK(request(fd, 99, NULL, 0, NULL) == GAUTHD_BAD_REQUEST);
+  close(fd);
+}
+
+// Leaves a socket behind as a daemon that died would, for the next one to
+// replace.
+static void leave_stale_socket(void) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  strcpy(addr.sun_path, socket_path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  CHECK(fd >= 0);
+  CHECK(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+  close(fd);
+  CHECK(connect_to() < 0 && errno == ECONNREFUSED);
+}
+
+// Permissions that are not octal or not permission bits are refused.
+static void test_bad_mode(void) {
+  CHECK(run_daemon("6x6") == EXIT_FAILURE);
+  CHECK(run_daemon("") == EXIT_FAILURE);
+  CHECK(run_daemon("1666") == EXIT_FAILURE);
+  CHECK(run_daemon("-1") == EXIT_FAILURE);
+  CHECK(run_daemon("77777777777777777777777") == EXIT_FAILURE);
+}
+
+// A second daemon on the same socket leaves the first one alone.
+static void test_second_daemon(void) {
+  CHECK(run_daemon("666") == EXIT_FAILURE);
+  int fd = connect_to();
+  CHECK(fd >= 0);
+  CHECK(request(fd, 99, NULL, 0, NULL) == GAUTHD_BAD_REQUEST);
+  close(fd);
+}
+
+// A client of another user may look codes up and verify them, but not
+// change accounts.
+static void test_other_user(void) {
+  if (geteuid() != 0) {
+    printf("not root: the clients of other users are not tested\n");
+    return;
+  }
+  pid_t pid = fork();
+  CHECK(pid >= 0);
+  if (pid == 0) {
+    CHECK(setgid(NOBODY) == 0 && setuid(NOBODY) == 0);
+    int fd = connect_to();
+    CHECK(fd >= 0);
+    int code = gauth_totp(&key, time(NULL), 30, 6);
+    CHECK(lookup(fd, 1, code, NULL) == GAUTHD_OK);
+    CHECK(verify(fd, 1, (code + 1) % 1000000, "alice") == GAUTHD_REJECTED);
+    CHECK(add(fd, 30, 6, "mallory", SECRET) == GAUTHD_DENIED);
+    CHECK(remove_account(fd, "alice") == GAUTHD_DENIED);
+    // Denied before the request is even looked at
+    CHECK(request(fd, GAUTHD_OP_REMOVE, NULL, 0, NULL) == GAUTHD_DENIED);
+    close(fd);
+    exit(EXIT_SUCCESS);
+  }
+  int status;
+  CHECK(waitpid(pid, &status, 0) == pid);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+  // Nothing changed.
+  int fd = connect_to();
+  CHECK(fd >= 0);
+  CHECK(remove_account(fd, "mallory") == GAUTHD_NO_ACCOUNT);
+  close(fd);
+}
+
+int main(void) {
+  CHECK(mkdtemp(dir));
+  // Other users reach the socket through the directory.
+  CHECK(chmod(dir, 0711) == 0);
+  snprintf(socket_path, sizeof(socket_path), "%s/sock", dir);
+  snprintf(accounts_path, sizeof(accounts_path), "%s/accounts", dir);
+
+  FILE *file = fopen(accounts_path, "w");
+  CHECK(file);
+  fprintf(file, "# name secret period digits\n"
+          "alice %s\n"
+          "bob %s hotp 6\n", SECRET, HOTP_SECRET);
+  CHECK(fclose(file) == 0);
+  CHECK(gauth_key_init(&key, SECRET) == 0);
+  CHECK(gauth_key_init(&hotp_key, HOTP_SECRET) == 0);
+
+  test_bad_mode();
+  leave_stale_socket();
+  start_daemon();
+  test_second_daemon();
+  int fd = connect_to();
+  CHECK(fd >= 0);
+  test_verify(fd);
+  test_hotp(fd);
+  test_lookup(fd);
+  test_add_remove(fd);
+  test_new_period(fd);
+  test_malformed(fd);
+  test_pipelining(fd);
+  close(fd);
+  test_oversized();
+  test_other_user();
+  stop_daemon();
+
+  unlink(accounts_path);
+  rmdir(dir);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,189 @@
+// Tests of HMAC-SHA1 and the HOTP/TOTP codes built on it
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// The vectors of RFC 2202 for the general HMAC, then the fixed-shape path
+// for 8-byte counters against the general one, and the codes of RFC 4226
+// (appendix D) and RFC 6238 (appendix B, SHA-1) through the public API.
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gauth.h"
+#include "hmac.h"
+
+#define CHECK(cond)                                                 \
+  do {                                                              \
+    if (!(cond)) {                                                  \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,        \
+              __LINE__, #cond);                                     \
+      exit(EXIT_FAILURE);                                           \
+    }                                                               \
+  } while (0)
+
+// The secret of the RFC 4226 and RFC 6238 vectors
+#define RFC_SECRET "12345678901234567890"
+
+static void hex(const uint8_t *data, int length, char *out) {
+  for (int i = 0; i < length; ++i) {
+    sprintf(out + 2 * i, "%02x", data[i]);
+  }
+}
+
+static void check_hmac(const uint8_t *key, int key_length,
+                       const uint8_t *data, int data_length,
+                       const char *expected) {
+  uint8_t result[20];
+  char text[41];
+
+  hmac_sha1(key, key_length, data, data_length, result, sizeof(result));
+  hex(result, sizeof(result), text);
+  CHECK(strcmp(text, expected) == 0);
+
+  // The same through a prepared key state
+  HMAC_SHA1_KEY hmac_key;
+  hmac_sha1_init_key(&hmac_key, key, key_length);
+  hmac_sha1_with_key(&hmac_key, data, data_length, result, sizeof(result));
+  hex(result, sizeof(result), text);
+  CHECK(strcmp(text, expected) == 0);
+}
+
+// RFC 2202, section 3
+static void test_rfc2202(void) {
+  uint8_t key[80];
+  uint8_t data[80];
+
+  memset(key, 0x0b, 20);
+  check_hmac(key, 20, (const uint8_t *)"Hi There", 8,
+             "b617318655057264e28bc0b6fb378c8ef146be00");
+
+  check_hmac((const uint8_t *)"Jefe", 4,
+             (const uint8_t *)"what do ya want for nothing?", 28,
+             "effcdf6ae5eb2fa2d27416d5f184df9c259a7c79");
+
+  memset(key, 0xaa, 20);
+  memset(data, 0xdd, 50);
+  check_hmac(key, 20, data, 50, "125d7342b9ac11cd91a39af48aa17b4f63f175d3");
+
+  for (int i = 0; i < 25; ++i) {
+    key[i] = i + 1;
+  }
+  memset(data, 0xcd, 50);
+  check_hmac(key, 25, data, 50, "4c9007f4026250c6bc8414f9bf50c86c2d7235da");
+
+  // Keys longer than a block are hashed first.
+  memset(key, 0xaa, 80);
+  check_hmac(key, 80, (const uint8_t *)
+             "Test Using Larger Than Block-Size Key - Hash Key First", 54,
+             "aa4ae5e15272d00e95705637ce8a3b55ed402112");
+  check_hmac(key, 80, (const uint8_t *)
+             "Test Using Larger Than Block-Size Key and Larger Than One "
+             "Block-Size Data", 73,
+             "e8e99d0f45237d786d6bbaa7965c7808bbff1a91");
+}
+
+// hmac_sha1_counter() skips the general padding; it must agree with the
+// general HMAC of the big-endian counter for any key and counter.
+static void test_counter_path(void) {
+  static const uint64_t counters[] = {
+    0, 1, 0xFF, 0x100, 56666666, 0xFFFFFFFF, 0x100000000ULL,
+    0x0123456789ABCDEFULL, UINT64_MAX,
+  };
+  uint8_t key[100];
+
+  for (int length = 0; length <= (int)sizeof(key); length += 7) {
+    for (int i = 0; i < length; ++i) {
+      key[i] = (uint8_t)(i * 31 + length);
+    }
+    HMAC_SHA1_KEY hmac_key;
+    hmac_sha1_init_key(&hmac_key, key, length);
+
+    for (size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); ++c) {
+      uint8_t message[8];
+      for (int i = 0; i < 8; ++i) {
+        message[i] = (uint8_t)(counters[c] >> (56 - 8 * i));
+      }
+      uint8_t expected[20];
+      uint8_t result[20];
+      hmac_sha1(key, length, message, sizeof(message), expected,
+                sizeof(expected));
+      hmac_sha1_counter(&hmac_key, counters[c], result);
+      CHECK(memcmp(result, expected, sizeof(result)) == 0);
+    }
+  }
+}
+
+// RFC 4226, appendix D
+static void test_hotp(void) {
+  static const int codes[] = {
+    755224, 287082, 359152, 969429, 338314,
+    254676, 287922, 162583, 399871, 520489,
+  };
+  GAUTH_KEY key;
+
+  CHECK(gauth_key_init_raw(&key, (const uint8_t *)RFC_SECRET,
+                           strlen(RFC_SECRET)) == 0);
+  for (int i = 0; i < 10; ++i) {
+    CHECK(gauth_generate(&key, i, 6) == codes[i]);
+  }
+
+  // The same secret in Base32
+  GAUTH_KEY base32;
+  CHECK(gauth_key_init(&base32, "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ") == 0);
+  CHECK(memcmp(&base32, &key, sizeof(key)) == 0);
+
+  int offset;
+  CHECK(gauth_verify(&key, 5, 2, 6, codes[3], &offset) == 1 && offset == -2);
+  CHECK(gauth_verify(&key, 5, 2, 6, codes[9], &offset) == 0);
+  gauth_key_clear(&key);
+}
+
+// RFC 6238, appendix B, the SHA-1 rows
+static void test_totp(void) {
+  static const struct {
+    time_t time;
+    int code;
+  } vectors[] = {
+    { 59, 94287082 },
+    { 1111111109, 7081804 },
+    { 1111111111, 14050471 },
+    { 1234567890, 89005924 },
+    { 2000000000, 69279037 },
+    { 20000000000LL, 65353130 },
+  };
+  GAUTH_KEY key;
+
+  CHECK(gauth_key_init_raw(&key, (const uint8_t *)RFC_SECRET,
+                           strlen(RFC_SECRET)) == 0);
+  for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); ++i) {
+    CHECK(gauth_totp(&key, vectors[i].time, 30, 8) == vectors[i].code);
+    CHECK(gauth_generate(&key, gauth_totp_step(vectors[i].time, 30), 8) ==
+          vectors[i].code);
+    // Fewer digits keep the low ones.
+    CHECK(gauth_totp(&key, vectors[i].time, 30, 6) ==
+          vectors[i].code % 1000000);
+  }
+  CHECK(gauth_totp(&key, 59, 30, 9) == -1);
+  gauth_key_clear(&key);
+}
+
+int main(void) {
+  test_rfc2202();
+  test_counter_path();
+  test_hotp();
+  test_totp();
+  return EXIT_SUCCESS;
+}
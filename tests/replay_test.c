@@ -0,0 +1,173 @@
+// Tests of the replay cache
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Threads start marking at once from a barrier, all of them the same
+// triples, and count who was told the triple was new. Built with
+// -fsanitize=thread when the compiler has it.
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "replay.h"
+
+#define THREADS 8
+#define ROUNDS 200
+
+// Triples marked by every thread of a round
+#define TRIPLES 64
+
+#define NOW 1000000
+#define EXPIRES (NOW + 90)
+
+#define CHECK(cond)                                                 \
+  do {                                                              \
+    if (!(cond)) {                                                  \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,        \
+              __LINE__, #cond);                                     \
+      exit(EXIT_FAILURE);                                           \
+    }                                                               \
+  } while (0)
+
+typedef struct round {
+  REPLAY_CACHE *cache;
+  pthread_barrier_t start;
+  int triples;
+  time_t now;           // of the even threads
+  time_t skew;          // the odd ones are ahead by
+  _Atomic int wins[TRIPLES];
+  _Atomic int full;
+} ROUND;
+
+typedef struct marker {
+  ROUND *round;
+  int thread;
+} MARKER;
+
+static void *mark_all(void *arg) {
+  MARKER *marker = arg;
+  ROUND *round = marker->round;
+  time_t now = round->now + (marker->thread % 2 ? round->skew : 0);
+
+  pthread_barrier_wait(&round->start);
+  // Every pair of an even and an odd thread takes the triples in another
+  // order.
+  for (int j = 0; j < round->triples; ++j) {
+    int i = (j + marker->thread / 2 * 7) % round->triples;
+    int result = replay_cache_mark(round->cache, 1, 1000 + i, 123456 + i,
+                                   now, now + 90);
+    if (result == 1) {
+      atomic_fetch_add(&round->wins[i], 1);
+    } else if (result < 0) {
+      atomic_fetch_add(&round->full, 1);
+    }
+  }
+  return NULL;
+}
+
+// Has THREADS threads mark the same "triples" triples, and checks how many
+// times each was accepted. Half of the threads are "skew" seconds ahead.
+static void race(REPLAY_CACHE *cache, int triples, time_t now, time_t skew,
+                 int exactly) {
+  ROUND round = { .cache = cache, .triples = triples, .now = now,
+                  .skew = skew };
+  MARKER markers[THREADS];
+  pthread_t threads[THREADS];
+
+  for (int i = 0; i < TRIPLES; ++i) {
+    atomic_init(&round.wins[i], 0);
+  }
+  atomic_init(&round.full, 0);
+  pthread_barrier_init(&round.start, NULL, THREADS);
+  for (int t = 0; t < THREADS; ++t) {
+    markers[t].round = &round;
+    markers[t].thread = t;
+    CHECK(pthread_create(&threads[t], NULL, mark_all, &markers[t]) == 0);
+  }
+  for (int t = 0; t < THREADS; ++t) {
+    pthread_join(threads[t], NULL);
+  }
+  pthread_barrier_destroy(&round.start);
+
+  CHECK(atomic_load(&round.full) == 0);
+  for (int i = 0; i < triples; ++i) {
+    int wins = atomic_load(&round.wins[i]);
+    CHECK(exactly ? wins == 1 : wins <= 1);
+    // Whoever won, the triple is marked now.
+    CHECK(replay_cache_mark(cache, 1, 1000 + i, 123456 + i, now + skew,
+                            now + skew + 90) == 0);
+  }
+}
+
+// Spread over a large table, every triple is accepted exactly once.
+static void test_same_triples(void) {
+  for (int r = 0; r < ROUNDS; ++r) {
+    REPLAY_CACHE *cache = replay_cache_new(1u << 16);
+    CHECK(cache);
+    race(cache, TRIPLES, NOW, 0, 1);
+    replay_cache_free(cache);
+  }
+}
+
+// A table of one window makes every triple collide with all the others.
+static void test_colliding_triples(void) {
+  for (int r = 0; r < ROUNDS; ++r) {
+    REPLAY_CACHE *cache = replay_cache_new(REPLAY_PROBES);
+    CHECK(cache);
+    race(cache, REPLAY_PROBES, NOW, 0, 1);
+    // The window is full of live entries.
+    CHECK(replay_cache_mark(cache, 2, 1, 1, NOW, EXPIRES) == -1);
+    replay_cache_free(cache);
+  }
+}
+
+// Threads on either side of the expiry of the first entries of a window
+// claim different slots for one triple: the ones behind skip the entries
+// that the ones ahead reuse. At most one of them may accept it.
+static void test_expiring_window(void) {
+  for (int r = 0; r < ROUNDS; ++r) {
+    REPLAY_CACHE *cache = replay_cache_new(REPLAY_PROBES);
+    CHECK(cache);
+    for (int i = 0; i < REPLAY_PROBES / 2; ++i) {
+      CHECK(replay_cache_mark(cache, 3, i, i, NOW, NOW + 30) == 1);
+    }
+    race(cache, 4, NOW + 29, 2, 0);
+    replay_cache_free(cache);
+  }
+}
+
+// An entry stops counting as a replay once it expires.
+static void test_expiry(void) {
+  REPLAY_CACHE *cache = replay_cache_new(1024);
+  CHECK(cache);
+  CHECK(replay_cache_mark(cache, 4, 10, 654321, NOW, NOW + 30) == 1);
+  CHECK(replay_cache_mark(cache, 4, 10, 654321, NOW + 29, NOW + 59) == 0);
+  CHECK(replay_cache_mark(cache, 4, 10, 654321, NOW + 30, NOW + 60) == 1);
+  // Another account, step or code is another triple.
+  CHECK(replay_cache_mark(cache, 5, 10, 654321, NOW, NOW + 30) == 1);
+  CHECK(replay_cache_mark(cache, 4, 11, 654321, NOW, NOW + 30) == 1);
+  CHECK(replay_cache_mark(cache, 4, 10, 654320, NOW, NOW + 30) == 1);
+  replay_cache_free(cache);
+}
+
+int main(void) {
+  test_expiry();
+  test_same_triples();
+  test_colliding_triples();
+  test_expiring_window();
+  return EXIT_SUCCESS;
+}